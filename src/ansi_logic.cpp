@@ -23,12 +23,29 @@
 //
 #include "ansi_logic.h"
 
+#include "char_width.h"
+#include "memory_pool.h"
+
+#include "scrollback.h"
+#include "stats.h"
+
 //#include <unicode/uchar.h>
 #define u_toupper(x) x // We don't need this for Curses
 
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
 #include <algorithm>
+#include <atomic>
 #include <cctype>
+#include <cstring>
+#include <cwchar>
 #include <iostream>
+#include <numeric>
+
+// Last version of tables of combined characters, among all instances.
+static std::atomic<uint64_t> last_combined_version{ 0 };
 
 const RgbColor AnsiLogic::normal_colors[8] = {
     { 0, 0, 0 },       // Black
@@ -52,404 +69,993 @@ const RgbColor AnsiLogic::bright_colors[8] = {
     { 255, 255, 255 }, // Bright White
 };
 
-AnsiLogic::AnsiLogic(int cols, int rows)
-    : term_cols(cols), term_rows(rows), state(AnsiState::NORMAL)
+//
+// Color of xterm 256-color palette: 16 ANSI colors,
+// then 6x6x6 color cube, then 24 shades of gray.
+//
+RgbColor AnsiLogic::palette_color(int index)
+{
+    if (index < 8) {
+        return normal_colors[index];
+    }
+    if (index < 16) {
+        return bright_colors[index - 8];
+    }
+    if (index < 232) {
+        static const uint8_t levels[6] = { 0, 95, 135, 175, 215, 255 };
+        index -= 16;
+        return { levels[index / 36], levels[index / 6 % 6], levels[index % 6] };
+    }
+    uint8_t gray = 8 + (index - 232) * 10;
+    return { gray, gray, gray };
+}
+
+//
+// Fill the buffer with copies of the value, in storage from the pool.
+//
+template <typename T>
+static void assign_pooled(MemoryPool &pool, std::vector<T> &buf, size_t count, const T &value)
 {
-    text_buffer.resize(term_rows, std::vector<Char>(term_cols, { L' ', current_attr }));
+    pool.get(buf, count);
+    buf.assign(count, value);
+}
+
+AnsiLogic::AnsiLogic(int cols, int rows) : AnsiLogic(cols, rows, MemoryPool::global())
+{
+}
+
+AnsiLogic::AnsiLogic(int cols, int rows, MemoryPool &pool)
+    : term_cols(cols), term_rows(rows), scrollback(std::make_unique<Scrollback>(pool)),
+      state(AnsiState::GROUND), pool(pool)
+{
+    combined_version = ++last_combined_version;
+    assign_pooled(pool, text_buffer, term_rows * term_cols, Char());
+    assign_pooled(pool, wrap_flags, term_rows, uint8_t(0));
+    reset_row_map();
+    reset_scroll_region();
+    mark_all_dirty();
+    report_usage();
+}
+
+AnsiLogic::~AnsiLogic()
+{
+    pool.update_usage(reported_usage, 0);
+    pool.put(text_buffer);
+    pool.put(alt_buffer);
+    pool.put(wrap_flags);
+    pool.put(alt_wrap_flags);
+}
+
+//
+// Tell the pool how much memory the screens occupy.
+//
+void AnsiLogic::report_usage()
+{
+    const size_t bytes = (text_buffer.capacity() + alt_buffer.capacity()) * sizeof(Char) +
+                         wrap_flags.capacity() + alt_wrap_flags.capacity() +
+                         combined_text.capacity() * sizeof(wchar_t) +
+                         attr_slots.capacity() * sizeof(uint16_t);
+    pool.update_usage(reported_usage, bytes);
 }
 
 void AnsiLogic::resize(int new_cols, int new_rows)
 {
+    if (!alt_screen) {
+        reflow(new_cols, new_rows);
+    } else {
+        // Main screen is laid out as if it was shown. Alternate screen
+        // is cleared: full-screen applications redraw it on SIGWINCH anyway.
+        swap_screens();
+        std::swap(cursor, saved_cursor);
+        reflow(new_cols, new_rows);
+        std::swap(cursor, saved_cursor);
+        swap_screens();
+        assign_pooled(pool, text_buffer, term_rows * term_cols, blank_char());
+        assign_pooled(pool, wrap_flags, term_rows, uint8_t(0));
+        reset_row_map();
+        cursor.row = std::min(cursor.row, term_rows - 1);
+        cursor.col = std::min(cursor.col, term_cols - 1);
+    }
+    mark_all_dirty();
+    report_usage();
+}
+
+//
+// Lay out the screen for new size. Rows joined by soft wraps form
+// logical lines, which are wrapped again at the new width.
+// The row with the cursor stays on the screen: rows which don't fit
+// above it go to the history. History itself is rewrapped on demand.
+// Rows are laid out in scratch buffers from the pool, sized for the worst
+// case: every logical line gets one partial row.
+// Wide character which would be split moves to the next row.
+//
+void AnsiLogic::reflow(int new_cols, int new_rows)
+{
+    const size_t max_cells = size_t(term_rows) * term_cols;
+    const size_t max_rows  = max_cells / new_cols + term_rows;
+    std::vector<Char> new_buffer;
+    std::vector<uint8_t> new_wrap;
+    std::vector<Char> line; // Logical line being collected
+    pool.get(new_buffer, max_rows * new_cols);
+    pool.get(new_wrap, max_rows);
+    pool.get(line, max_cells);
+    Cursor new_cursor;
+    int cursor_offset = -1; // Position of cursor in the logical line
+
+    for (int r = 0; r < term_rows; ++r) {
+        const Char *cells = row(r);
+        bool wrapped      = is_wrapped(r) && r + 1 < term_rows;
+        int length        = term_cols;
+        if (!wrapped) {
+            while (length > 0 && cells[length - 1].ch == L' ') {
+                --length;
+            }
+        }
+        const int start = line.size();
+        int padding     = 0; // Blanks inserted before the cursor
+        for (int col = 0; col < length; ++col) {
+            if (new_cols > 1 && col + 1 < length && cells[col + 1].is_spacer() &&
+                line.size() % new_cols == size_t(new_cols - 1)) {
+                line.push_back({ L' ', cells[col].attr });
+                padding += (col < cursor.col);
+            }
+            line.push_back(cells[col]);
+        }
+        if (r == cursor.row) {
+            cursor_offset = start + cursor.col + padding;
+        }
+        if (wrapped) {
+            continue;
+        }
+
+        // Split the line into rows of new width.
+        // Blanks after the text keep attribute of the last cell.
+        const Char fill  = { L' ', cells[term_cols - 1].attr };
+        const int first  = new_wrap.size();
+        const int pieces = std::max<int>(1, (line.size() + new_cols - 1) / new_cols);
+        new_buffer.resize((first + pieces) * new_cols, fill);
+        std::copy(line.begin(), line.end(), &new_buffer[first * new_cols]);
+        new_wrap.resize(first + pieces, 1);
+        new_wrap.back() = 0;
+        if (cursor_offset >= 0) {
+            // Cursor past the text stays on the last row.
+            new_cursor.row = first + std::min(cursor_offset / new_cols, pieces - 1);
+            new_cursor.col = std::min(cursor_offset - (new_cursor.row - first) * new_cols,
+                                      new_cols - 1);
+            cursor_offset  = -1;
+        }
+        line.clear();
+    }
+
+    // Drop blank rows below the cursor, then rows above it, until the rest fits.
+    int count = new_wrap.size();
+    while (count > new_rows && count - 1 > new_cursor.row &&
+           std::all_of(&new_buffer[(count - 1) * new_cols], &new_buffer[count * new_cols],
+                       [](const Char &c) { return c.ch == L' '; })) {
+        --count;
+    }
+    int shift = std::max(0, std::min(count - new_rows, new_cursor.row));
+    for (int r = 0; r < shift; ++r) {
+        scrollback->push_line(&new_buffer[r * new_cols], new_cols, attr_table.data(),
+                              new_wrap[r], combined_text.data());
+    }
+    const int kept = std::min<int>(new_wrap.size() - shift, new_rows);
+    assign_pooled(pool, text_buffer, new_rows * new_cols, blank_char());
+    assign_pooled(pool, wrap_flags, new_rows, uint8_t(0));
+    std::copy_n(&new_buffer[shift * new_cols], kept * new_cols, text_buffer.begin());
+    std::copy_n(&new_wrap[shift], kept, wrap_flags.begin());
+    wrap_flags.back() = 0;
+    pool.put(new_buffer);
+    pool.put(new_wrap);
+    pool.put(line);
+
     term_cols = new_cols;
     term_rows = new_rows;
-    text_buffer.resize(term_rows, std::vector<Char>(term_cols, { L' ', current_attr }));
-    for (auto &line : text_buffer) {
-        line.resize(term_cols, { L' ', current_attr });
-    }
-    cursor.row = std::min(cursor.row, term_rows - 1);
-    cursor.col = std::min(cursor.col, term_cols - 1);
+    reset_row_map();
+    reset_scroll_region();
+    cursor.row = std::min(new_cursor.row - shift, term_rows - 1);
+    cursor.col = new_cursor.col;
 }
 
-std::vector<int> AnsiLogic::process_input(const char *buffer, size_t length)
+//
+// Actions of the parser on transitions.
+//
+enum ParserAction : uint8_t {
+    ACTION_NONE,         // Ignore the byte
+    ACTION_EXECUTE,      // C0 control
+    ACTION_CLEAR,        // Start of a sequence: forget parameters
+    ACTION_COLLECT,      // Private marker or intermediate byte
+    ACTION_PARAM,        // Digit or separator of parameters
+    ACTION_ESC_DISPATCH, // Final byte of ESC sequence
+    ACTION_CSI_DISPATCH, // Final byte of CSI sequence
+    ACTION_OSC_START,    // Start of OSC string
+    ACTION_OSC_PUT,      // Byte of OSC string
+    ACTION_OSC_END,      // End of OSC string, then start of the next sequence
+};
+
+static constexpr int PARSER_STATES = int(AnsiState::SOS_PM_APC_STRING) + 1;
+
+//
+// Transitions for every state and byte: action in high half, next state in low half.
+// Entry and exit actions of the state diagram are folded into the transitions:
+// entering ESCAPE clears the parameters, leaving OSC_STRING dispatches it.
+// DCS sequences are recognized and skipped.
+// In UTF-8 mode, bytes 0x80...0x9f are not C1 controls: in text they are decoded
+// by the UTF-8 decoder, in OSC strings they are part of the string.
+//
+struct ParserTable {
+    uint8_t entries[PARSER_STATES][256];
+
+    constexpr ParserTable() : entries()
+    {
+        using S = AnsiState;
+        for (int s = 0; s < PARSER_STATES; ++s) {
+            // Stay in the state and ignore, unless stated otherwise.
+            set(S(s), 0x00, 0xff, ACTION_NONE, S(s));
+
+            // C0 controls are executed in the middle of sequences, but not of strings.
+            if (S(s) < S::DCS_ENTRY) {
+                set(S(s), 0x00, 0x17, ACTION_EXECUTE, S(s));
+                set(S(s), 0x19, 0x19, ACTION_EXECUTE, S(s));
+                set(S(s), 0x1c, 0x1f, ACTION_EXECUTE, S(s));
+            }
+
+            // From anywhere: CAN and SUB cancel the sequence, ESC starts a new one.
+            set(S(s), 0x18, 0x18, ACTION_EXECUTE, S::GROUND);
+            set(S(s), 0x1a, 0x1a, ACTION_EXECUTE, S::GROUND);
+            set(S(s), 0x1b, 0x1b, ACTION_CLEAR, S::ESCAPE);
+        }
+
+        set(S::ESCAPE, 0x20, 0x2f, ACTION_COLLECT, S::ESCAPE_INTERMEDIATE);
+        set(S::ESCAPE, 0x30, 0x7e, ACTION_ESC_DISPATCH, S::GROUND);
+        set(S::ESCAPE, '[', '[', ACTION_NONE, S::CSI_ENTRY);
+        set(S::ESCAPE, ']', ']', ACTION_OSC_START, S::OSC_STRING);
+        set(S::ESCAPE, 'P', 'P', ACTION_NONE, S::DCS_ENTRY);
+        set(S::ESCAPE, 'X', 'X', ACTION_NONE, S::SOS_PM_APC_STRING);
+        set(S::ESCAPE, '^', '_', ACTION_NONE, S::SOS_PM_APC_STRING);
+
+        set(S::ESCAPE_INTERMEDIATE, 0x20, 0x2f, ACTION_COLLECT, S::ESCAPE_INTERMEDIATE);
+        set(S::ESCAPE_INTERMEDIATE, 0x30, 0x7e, ACTION_ESC_DISPATCH, S::GROUND);
+
+        // Colon separates subparameters, as in SGR 38:2:r:g:b.
+        set(S::CSI_ENTRY, 0x20, 0x2f, ACTION_COLLECT, S::CSI_INTERMEDIATE);
+        set(S::CSI_ENTRY, 0x30, 0x3b, ACTION_PARAM, S::CSI_PARAM);
+        set(S::CSI_ENTRY, 0x3c, 0x3f, ACTION_COLLECT, S::CSI_PARAM);
+        set(S::CSI_ENTRY, 0x40, 0x7e, ACTION_CSI_DISPATCH, S::GROUND);
+
+        set(S::CSI_PARAM, 0x20, 0x2f, ACTION_COLLECT, S::CSI_INTERMEDIATE);
+        set(S::CSI_PARAM, 0x30, 0x3b, ACTION_PARAM, S::CSI_PARAM);
+        set(S::CSI_PARAM, 0x3c, 0x3f, ACTION_NONE, S::CSI_IGNORE);
+        set(S::CSI_PARAM, 0x40, 0x7e, ACTION_CSI_DISPATCH, S::GROUND);
+
+        set(S::CSI_INTERMEDIATE, 0x20, 0x2f, ACTION_COLLECT, S::CSI_INTERMEDIATE);
+        set(S::CSI_INTERMEDIATE, 0x30, 0x3f, ACTION_NONE, S::CSI_IGNORE);
+        set(S::CSI_INTERMEDIATE, 0x40, 0x7e, ACTION_CSI_DISPATCH, S::GROUND);
+
+        set(S::CSI_IGNORE, 0x40, 0x7e, ACTION_NONE, S::GROUND);
+
+        set(S::DCS_ENTRY, 0x20, 0x2f, ACTION_NONE, S::DCS_INTERMEDIATE);
+        set(S::DCS_ENTRY, 0x30, 0x3f, ACTION_NONE, S::DCS_PARAM);
+        set(S::DCS_ENTRY, 0x3a, 0x3a, ACTION_NONE, S::DCS_IGNORE);
+        set(S::DCS_ENTRY, 0x40, 0x7e, ACTION_NONE, S::DCS_PASSTHROUGH);
+
+        set(S::DCS_PARAM, 0x20, 0x2f, ACTION_NONE, S::DCS_INTERMEDIATE);
+        set(S::DCS_PARAM, 0x3a, 0x3a, ACTION_NONE, S::DCS_IGNORE);
+        set(S::DCS_PARAM, 0x3c, 0x3f, ACTION_NONE, S::DCS_IGNORE);
+        set(S::DCS_PARAM, 0x40, 0x7e, ACTION_NONE, S::DCS_PASSTHROUGH);
+
+        set(S::DCS_INTERMEDIATE, 0x30, 0x3f, ACTION_NONE, S::DCS_IGNORE);
+        set(S::DCS_INTERMEDIATE, 0x40, 0x7e, ACTION_NONE, S::DCS_PASSTHROUGH);
+
+        // OSC string ends with ST or, as in xterm, with BEL.
+        set(S::OSC_STRING, 0x20, 0xff, ACTION_OSC_PUT, S::OSC_STRING);
+        set(S::OSC_STRING, 0x07, 0x07, ACTION_OSC_END, S::GROUND);
+        set(S::OSC_STRING, 0x1b, 0x1b, ACTION_OSC_END, S::ESCAPE);
+    }
+
+    constexpr void set(AnsiState s, int first, int last, ParserAction action, AnsiState next)
+    {
+        for (int c = first; c <= last; ++c) {
+            entries[int(s)][c] = (action << 4) | int(next);
+        }
+    }
+};
+
+static constexpr ParserTable parser_table;
+
+void AnsiLogic::process_input(const char *buffer, size_t length)
 {
-    std::vector<int> dirty_rows;
-    size_t i = 0;
-    while (i < length) {
-        char c = buffer[i];
-        switch (state) {
-        case AnsiState::NORMAL:
-            switch (c) {
-            case '\033':
-                state = AnsiState::ESCAPE;
-                ansi_seq.clear();
-                // std::cerr << "Received ESC, transitioning to ESCAPE state" << std::endl;
-                ++i;
-                break;
-            case '\n':
-                cursor.row++;
-                cursor.col = 0;
-                if (cursor.row >= term_rows) {
-                    scroll_up();
-                    for (int r = 0; r < term_rows; ++r) {
-                        dirty_rows.push_back(r);
-                    }
-                } else {
-                    dirty_rows.push_back(cursor.row);
-                }
-                ++i;
-                break;
-            case '\r':
-                cursor.col = 0;
-                if (i + 1 < length && buffer[i + 1] == '\n') {
+    uint64_t escapes = 0;
+    for (size_t i = 0; i < length;) {
+        const uint8_t c = buffer[i];
+        if (state == AnsiState::GROUND) {
+            if (utf8_state != UTF8_ACCEPT || c >= 0x80) {
+                // Byte of multibyte UTF-8 sequence, maybe continued from previous input.
+                if (decode_utf8(c)) {
                     ++i;
-                    cursor.row++;
-                    if (cursor.row >= term_rows) {
-                        scroll_up();
-                        for (int r = 0; r < term_rows; ++r) {
-                            dirty_rows.push_back(r);
-                        }
-                    } else {
-                        dirty_rows.push_back(cursor.row);
-                    }
-                } else {
-                    dirty_rows.push_back(cursor.row);
-                }
-                ++i;
-                break;
-            case '\b':
-                if (cursor.col > 0) {
-                    cursor.col--;
-                    text_buffer[cursor.row][cursor.col] = { L' ', current_attr };
-                    dirty_rows.push_back(cursor.row);
-                }
-                ++i;
-                break;
-            case '\t':
-                cursor.col = (cursor.col + 8) / 8 * 8;
-                if (cursor.col >= term_cols) {
-                    cursor.col = term_cols - 1;
-                }
-                ++i;
-                break;
-            case '\7':
-                // TODO: make a sound.
-                ++i;
-                break;
-            default:
-                // Decode UTF-8 sequence
-                wchar_t ch = 0;
-                int bytes  = 0;
-                if ((buffer[i] & 0x80) == 0) { // 1-byte (ASCII)
-                    ch    = buffer[i];
-                    bytes = 1;
-                } else if ((buffer[i] & 0xE0) == 0xC0 && i + 1 < length) { // 2-byte
-                    ch    = ((buffer[i] & 0x1F) << 6) | (buffer[i + 1] & 0x3F);
-                    bytes = 2;
-                } else if ((buffer[i] & 0xF0) == 0xE0 && i + 2 < length) { // 3-byte
-                    ch = ((buffer[i] & 0x0F) << 12) | ((buffer[i + 1] & 0x3F) << 6) |
-                         (buffer[i + 2] & 0x3F);
-                    bytes = 3;
-                } else if ((buffer[i] & 0xF8) == 0xF0 && i + 3 < length) { // 4-byte
-                    ch = ((buffer[i] & 0x07) << 18) | ((buffer[i + 1] & 0x3F) << 12) |
-                         ((buffer[i + 2] & 0x3F) << 6) | (buffer[i + 3] & 0x3F);
-                    bytes = 4;
-                } else {
-                    // Invalid UTF-8, skip
-                    ++i;
-                    continue;
                 }
+                // Otherwise invalid sequence was interrupted by this byte: handle it again.
+                continue;
+            }
+            if (c >= 0x20 && c < 0x7f) {
+                // Fast path: store a run of printable ASCII characters at once.
+                i += print_ascii(&buffer[i], length - i);
+                continue;
+            }
+        }
 
-                if (cursor.col < term_cols && cursor.row < term_rows) {
-                    text_buffer[cursor.row][cursor.col] = { ch, current_attr };
-                    cursor.col++;
-                    dirty_rows.push_back(cursor.row);
-                }
-                if (cursor.col >= term_cols) {
-                    cursor.col = 0;
-                    cursor.row++;
-                    if (cursor.row >= term_rows) {
-                        scroll_up();
-                        for (int r = 0; r < term_rows; ++r) {
-                            dirty_rows.push_back(r);
-                        }
-                    }
-                }
-                i += bytes;
+        const uint8_t entry = parser_table.entries[int(state)][c];
+        state               = AnsiState(entry & 0x0f);
+        escapes += (c == '\033');
+        switch (ParserAction(entry >> 4)) {
+        case ACTION_NONE:
+            break;
+        case ACTION_EXECUTE:
+            execute_control(c);
+            break;
+        case ACTION_CLEAR:
+            clear_sequence();
+            break;
+        case ACTION_COLLECT:
+            collect(c);
+            break;
+        case ACTION_PARAM:
+            // Rest of the number at once: it stays in the same state.
+            add_param(c);
+            while (i + 1 < length && buffer[i + 1] >= '0' && buffer[i + 1] <= '9') {
+                add_param(buffer[++i]);
             }
             break;
-
-        case AnsiState::ESCAPE:
-            switch (c) {
-            case '[':
-                state = AnsiState::CSI;
-                ansi_seq.clear();
-                ansi_seq += c;
-                // std::cerr << "Received [, transitioning to CSI state" << std::endl;
-                break;
-            case 'c':
-                // std::cerr << "Received ESC c, processing reset" << std::endl;
-                reset_state();
-                for (int r = 0; r < term_rows; ++r) {
-                    dirty_rows.push_back(r);
-                }
-                state = AnsiState::NORMAL;
-                ansi_seq.clear();
-                break;
-            default:
-                // std::cerr << "Unknown ESC sequence char: " << (int)c << ", resetting to NORMAL"
-                //           << std::endl;
-                state = AnsiState::NORMAL;
-                ansi_seq.clear();
+        case ACTION_ESC_DISPATCH:
+            dispatch_esc(c);
+            break;
+        case ACTION_CSI_DISPATCH:
+            csi_param_count = std::min(csi_param_count, MAX_CSI_PARAMS);
+            if (csi_private == 0 && csi_intermediate == 0) {
+                dispatch_csi(c);
+            } else if (csi_private == '?') {
+                dispatch_private_csi(c);
             }
-            ++i;
             break;
-
-        case AnsiState::CSI:
-            ansi_seq += c;
-            if (std::isalpha(c)) {
-                // std::cerr << "Received CSI final char: " << c << std::endl;
-                parse_ansi_sequence(ansi_seq, dirty_rows);
-                state = AnsiState::NORMAL;
-                ansi_seq.clear();
+        case ACTION_OSC_START:
+            osc_string.clear();
+            break;
+        case ACTION_OSC_PUT:
+            if (osc_string.size() < MAX_OSC_LENGTH) {
+                osc_string += char(c);
             }
-            ++i;
+            break;
+        case ACTION_OSC_END:
+            dispatch_osc();
+            clear_sequence();
             break;
         }
+        ++i;
     }
-    // Remove duplicates
-    std::sort(dirty_rows.begin(), dirty_rows.end());
-    dirty_rows.erase(std::unique(dirty_rows.begin(), dirty_rows.end()), dirty_rows.end());
-    return dirty_rows;
+    Stats::add(Stats::ESCAPE_SEQUENCES, escapes);
 }
 
-static std::string wchar_to_utf8(wchar_t wc)
+//
+// Execute C0 control character.
+//
+void AnsiLogic::execute_control(char c)
 {
-    std::string utf8;
-    if (wc <= 0x7F) {
-        utf8 += static_cast<char>(wc);
-    } else if (wc <= 0x7FF) {
-        utf8 += static_cast<char>(0xC0 | ((wc >> 6) & 0x1F));
-        utf8 += static_cast<char>(0x80 | (wc & 0x3F));
-    } else if (wc <= 0xFFFF) {
-        utf8 += static_cast<char>(0xE0 | ((wc >> 12) & 0x0F));
-        utf8 += static_cast<char>(0x80 | ((wc >> 6) & 0x3F));
-        utf8 += static_cast<char>(0x80 | (wc & 0x3F));
+    switch (c) {
+    case '\n':
+    case '\v':
+    case '\f':
+        line_feed();
+        cursor.col = 0;
+        break;
+    case '\r':
+        cursor.col = 0;
+        break;
+    case '\b':
+        if (cursor.col > 0) {
+            cursor.col--;
+            row(cursor.row)[cursor.col] = blank_char();
+            mark_dirty(cursor.row, cursor.col, cursor.col);
+        }
+        break;
+    case '\t':
+        cursor.col = (cursor.col + 8) / 8 * 8;
+        if (cursor.col >= term_cols) {
+            cursor.col = term_cols - 1;
+        }
+        break;
+    case '\7':
+        // TODO: make a sound.
+        break;
+    }
+}
+
+//
+// Start of ESC, CSI or DCS sequence.
+//
+void AnsiLogic::clear_sequence()
+{
+    csi_param_count  = 1;
+    csi_params[0]    = 0;
+    csi_private      = 0;
+    csi_intermediate = 0;
+    csi_colon_mask   = 0;
+}
+
+//
+// Private marker, like in ESC [ ? 25 h, or intermediate byte.
+//
+void AnsiLogic::collect(char c)
+{
+    if (c >= '<' && c <= '?') {
+        csi_private = c;
     } else {
-        utf8 += static_cast<char>(0xF0 | ((wc >> 18) & 0x07));
-        utf8 += static_cast<char>(0x80 | ((wc >> 12) & 0x3F));
-        utf8 += static_cast<char>(0x80 | ((wc >> 6) & 0x3F));
-        utf8 += static_cast<char>(0x80 | (wc & 0x3F));
+        csi_intermediate = c;
     }
-    return utf8;
 }
 
-std::string AnsiLogic::process_key(const KeyInput &key)
+//
+// Parameters are accumulated as they arrive.
+// Parameters past MAX_CSI_PARAMS are dropped.
+//
+void AnsiLogic::add_param(char c)
 {
-    std::string input;
-    // std::cerr << "Key processed: Keycode=" << key.code << ", Modifiers=" << modifiers <<
-    // std::endl;
+    if (c >= '0' && c <= '9') {
+        if (csi_param_count <= MAX_CSI_PARAMS) {
+            int &param = csi_params[csi_param_count - 1];
+            param      = std::min(param * 10 + (c - '0'), MAX_CSI_PARAM_VALUE);
+        }
+        return;
+    }
+    if (csi_param_count < MAX_CSI_PARAMS) {
+        csi_params[csi_param_count] = 0;
+        if (c == ':') {
+            csi_colon_mask |= 1u << csi_param_count;
+        }
+    }
+    csi_param_count = std::min(csi_param_count + 1, MAX_CSI_PARAMS + 1);
+}
 
-    // Map keycodes to terminal inputs
-    switch (key.code) {
-    case KeyCode::UNKNOWN:
-    case KeyCode::CAPSLOCK:
-    case KeyCode::LEFT_SHIFT:
-    case KeyCode::RIGHT_SHIFT:
-    case KeyCode::LEFT_CTRL:
-    case KeyCode::RIGHT_CTRL:
-    case KeyCode::LEFT_OPTION:
-    case KeyCode::RIGHT_OPTION:
-    case KeyCode::LEFT_COMMAND:
-    case KeyCode::RIGHT_COMMAND:
-        // No input.
-        break;
-    case KeyCode::ENTER:
-        input = "\r";
-        break;
-    case KeyCode::BACKSPACE:
-        input = "\b";
-        break;
-    case KeyCode::TAB:
-        input = "\t";
-        break;
-    case KeyCode::ESCAPE:
-        input = "\33";
-        break;
-    case KeyCode::UP:
-        input = "\033[A";
-        break;
-    case KeyCode::DOWN:
-        input = "\033[B";
-        break;
-    case KeyCode::RIGHT:
-        input = "\033[C";
-        break;
-    case KeyCode::LEFT:
-        input = "\033[D";
-        break;
-    case KeyCode::HOME:
-        input = "\033[H";
-        break;
-    case KeyCode::END:
-        input = "\033[F";
-        break;
-    case KeyCode::INSERT:
-        input = "\033[2~";
-        break;
-    case KeyCode::DELETE:
-        input = "\033[3~";
-        break;
-    case KeyCode::PAGEUP:
-        input = "\033[5~";
-        break;
-    case KeyCode::PAGEDOWN:
-        input = "\033[6~";
-        break;
-    case KeyCode::F1:
-        input = "\033OP";
-        break;
-    case KeyCode::F2:
-        input = "\033OQ";
-        break;
-    case KeyCode::F3:
-        input = "\033OR";
-        break;
-    case KeyCode::F4:
-        input = "\033OS";
-        break;
-    case KeyCode::F5:
-        input = "\033[15~";
-        break;
-    case KeyCode::F6:
-        input = "\033[17~";
+//
+// Execute ESC sequence with given final character.
+// Sequences with intermediate bytes, like designation of character sets, are ignored.
+//
+void AnsiLogic::dispatch_esc(char final_char)
+{
+    if (csi_intermediate != 0) {
+        return;
+    }
+    switch (final_char) {
+    case 'D':
+        // Index
+        line_feed();
         break;
-    case KeyCode::F7:
-        input = "\033[18~";
+    case 'E':
+        // Next line
+        line_feed();
+        cursor.col = 0;
         break;
-    case KeyCode::F8:
-        input = "\033[19~";
+    case 'M':
+        // Reverse index: at top of scroll region the text moves down.
+        if (cursor.row == scroll_top) {
+            scroll_region_down(scroll_top, scroll_bottom, 1);
+        } else if (cursor.row > 0) {
+            cursor.row--;
+        }
         break;
-    case KeyCode::F9:
-        input = "\033[20~";
+    case 'c':
+        reset_state();
+        mark_all_dirty();
         break;
-    case KeyCode::F10:
-        input = "\033[21~";
+    case '=':
+        // DECKPAM: application keypad
+        app_keypad = true;
         break;
-    case KeyCode::F11:
-        input = "\033[23~";
+    case '>':
+        // DECKPNM: numeric keypad
+        app_keypad = false;
         break;
-    case KeyCode::F12:
-        input = "\033[24~";
+    }
+}
+
+//
+// Execute OSC string: number of the command, semicolon, data.
+// Only the window title is kept. Other commands, like hyperlinks
+// of OSC 8, are consumed without effect: their text is shown as usual.
+//
+void AnsiLogic::dispatch_osc()
+{
+    size_t pos  = 0;
+    int command = 0;
+    for (; pos < osc_string.size() && osc_string[pos] >= '0' && osc_string[pos] <= '9'; ++pos) {
+        command = std::min(command * 10 + (osc_string[pos] - '0'), MAX_CSI_PARAM_VALUE);
+    }
+    if (pos == 0 || pos >= osc_string.size() || osc_string[pos] != ';') {
+        return;
+    }
+    switch (command) {
+    case 0:
+    case 2:
+        title.assign(osc_string, pos + 1, std::string::npos);
         break;
-    case KeyCode::CHARACTER:
-        if (key.mod_ctrl) {
-            //
-            // Ctrl modifier is pressed.
-            //
-            input = std::string(1, key.character & 0x1f);
-        } else if (key.mod_shift) {
-            //
-            // Shift modifier is pressed.
-            //
-            if (key.character <= 0x7f) {
-                // ASCII symbol.
-                char ch = key.character;
-                if (key.character >= 'a' && key.character <= 'z') {
-                    // Convert ASCII character to uppercase.
-                    ch = std::toupper(ch);
-                } else {
-                    static const std::map<char, char> shift_map = {
-                        { '1', '!' },  { '2', '@' }, { '3', '#' }, { '4', '$' }, { '5', '%' },
-                        { '6', '^' },  { '7', '&' }, { '8', '*' }, { '9', '(' }, { '0', ')' },
-                        { '-', '_' },  { '=', '+' }, { '[', '{' }, { ']', '}' }, { ';', ':' },
-                        { '\'', '"' }, { ',', '<' }, { '.', '>' }, { '/', '?' }, { '`', '~' }
-                    };
-                    auto it = shift_map.find(ch);
-                    if (it != shift_map.end()) {
-                        ch = it->second;
-                    }
-                }
-                input = std::string(1, ch);
-            } else {
-                // Convert Unicode character to uppercase.
-                input = wchar_to_utf8(u_toupper(key.character));
-            }
-        } else if (key.character <= 0x7f) {
-            //
-            // ASCII symbol.
-            //
-            input = std::string(1, key.character);
-        } else {
-            //
-            // Unicode symbol.
-            //
-            input = wchar_to_utf8(key.character);
+    }
+}
+
+//
+// Return length of leading run of printable ASCII characters (0x20...0x7e).
+//
+static size_t scan_printable_ascii(const char *text, size_t length)
+{
+    size_t i = 0;
+#ifdef __SSE2__
+    const __m128i below = _mm_set1_epi8(0x1f);
+    const __m128i del   = _mm_set1_epi8(0x7f);
+    for (; i + 16 <= length; i += 16) {
+        __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i *>(text + i));
+
+        // Bytes 0x80 and above are negative, so the signed compare rejects them too.
+        __m128i good  = _mm_andnot_si128(_mm_cmpeq_epi8(bytes, del), _mm_cmpgt_epi8(bytes, below));
+        unsigned mask = _mm_movemask_epi8(good);
+        if (mask != 0xffff) {
+            return i + __builtin_ctz(~mask);
+        }
+    }
+#endif
+    // Scan word at a time: look for bytes below 0x20, equal to 0x7f or above.
+    const uint64_t ones = 0x0101010101010101ull;
+    const uint64_t high = 0x8080808080808080ull;
+    for (; i + 8 <= length; i += 8) {
+        uint64_t word;
+        memcpy(&word, text + i, sizeof(word));
+        uint64_t del     = word ^ (ones * 0x7f);
+        uint64_t special = (word & high) | ((word - ones * 0x20) & ~word & high) |
+                           ((del - ones) & ~del & high);
+        if (special != 0) {
+            break;
+        }
+    }
+    for (; i < length; ++i) {
+        uint8_t c = text[i];
+        if (c < 0x20 || c >= 0x7f) {
+            break;
+        }
+    }
+    return i;
+}
+
+//
+// Store run of printable ASCII characters into the text buffer.
+// Return number of bytes consumed.
+//
+size_t AnsiLogic::print_ascii(const char *text, size_t length)
+{
+    size_t count = 0;
+    while (count < length) {
+        size_t room = term_cols - cursor.col;
+        size_t n    = scan_printable_ascii(text + count, std::min(room, length - count));
+        if (n == 0) {
+            break;
+        }
+
+        split_wide_chars(cursor.row, cursor.col, cursor.col + n - 1);
+        Char *cell = row(cursor.row) + cursor.col;
+        for (size_t k = 0; k < n; ++k) {
+            cell[k] = { wchar_t(text[count + k]), current_attr_index };
+        }
+        mark_dirty(cursor.row, cursor.col, cursor.col + n - 1);
+        cursor.col += n;
+        count += n;
+
+        if (cursor.col < term_cols) {
+            // Stopped at a non-printable byte or at end of input.
+            break;
+        }
+        wrap_line();
+    }
+    return count;
+}
+
+//
+// Table-driven UTF-8 decoder, after Bjoern Hoehrmann's DFA.
+// First 256 entries map bytes to character classes.
+// Remaining entries give next state for a combination of state and class.
+// States are multiples of 12: 0 is UTF8_ACCEPT, 12 is UTF8_REJECT.
+//
+static const uint8_t utf8_table[] = {
+    // clang-format off
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 00..1f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 20..3f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 40..5f
+    0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, 0,0,0,0,0,0,0,0,0,0,0,0,0,0,0,0, // 60..7f
+    1,1,1,1,1,1,1,1,1,1,1,1,1,1,1,1, 9,9,9,9,9,9,9,9,9,9,9,9,9,9,9,9, // 80..9f
+    7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, 7,7,7,7,7,7,7,7,7,7,7,7,7,7,7,7, // a0..bf
+    8,8,2,2,2,2,2,2,2,2,2,2,2,2,2,2, 2,2,2,2,2,2,2,2,2,2,2,2,2,2,2,2, // c0..df
+    10,3,3,3,3,3,3,3,3,3,3,3,3,4,3,3, 11,6,6,6,5,8,8,8,8,8,8,8,8,8,8,8, // e0..ff
+
+     0,12,24,36,60,96,84,12,12,12,48,72, 12,12,12,12,12,12,12,12,12,12,12,12,
+    12, 0,12,12,12,12,12, 0,12, 0,12,12, 12,24,12,12,12,12,12,24,12,24,12,12,
+    12,12,12,12,12,12,12,24,12,12,12,12, 12,24,12,12,12,12,12,12,12,24,12,12,
+    12,12,12,12,12,12,12,36,12,36,12,12, 12,36,12,12,12,12,12,36,12,36,12,12,
+    12,36,12,12,12,12,12,12,12,12,12,12,
+    // clang-format on
+};
+
+//
+// Feed one byte of UTF-8 sequence to the decoder.
+// Store the character when the sequence is complete.
+// Return false when an incomplete sequence is interrupted by this byte,
+// so it must be processed again.
+//
+bool AnsiLogic::decode_utf8(uint8_t byte)
+{
+    uint8_t type = utf8_table[byte];
+    bool started = (utf8_state != UTF8_ACCEPT);
+
+    utf8_codepoint = started ? (byte & 0x3fu) | (utf8_codepoint << 6) : (0xffu >> type) & byte;
+    utf8_state     = utf8_table[256 + utf8_state + type];
+
+    if (utf8_state == UTF8_ACCEPT) {
+        put_char(utf8_codepoint);
+    } else if (utf8_state == UTF8_REJECT) {
+        put_char(L'\uFFFD'); // Replacement character
+        utf8_state = UTF8_ACCEPT;
+        return !started;
+    }
+    return true;
+}
+
+//
+// Store character at cursor position and advance the cursor.
+// Wide character takes two cells; when only one is left in the row,
+// it is blanked and the character goes to the next row.
+// Combining marks go to the previous character.
+//
+void AnsiLogic::put_char(wchar_t ch)
+{
+    const int width = std::min(char_width(ch), term_cols);
+    if (width == 0) {
+        put_combining_mark(ch);
+        return;
+    }
+    if (cursor.col + width > term_cols && cursor.col < term_cols) {
+        split_wide_chars(cursor.row, cursor.col, cursor.col);
+        row(cursor.row)[cursor.col] = blank_char();
+        mark_dirty(cursor.row, cursor.col, cursor.col);
+        wrap_line();
+    }
+    if (cursor.col < term_cols && cursor.row < term_rows) {
+        split_wide_chars(cursor.row, cursor.col, cursor.col + width - 1);
+        Char *cell = row(cursor.row) + cursor.col;
+        cell[0]    = { ch, current_attr_index };
+        if (width == 2) {
+            cell[1] = { Char::WIDE_SPACER, current_attr_index };
+        }
+        mark_dirty(cursor.row, cursor.col, cursor.col + width - 1);
+        cursor.col += width;
+    }
+    if (cursor.col >= term_cols) {
+        wrap_line();
+    }
+}
+
+//
+// Add combining mark to the character before the cursor.
+// Right after a wrap, it's the last character of the previous row.
+//
+void AnsiLogic::put_combining_mark(wchar_t mark)
+{
+    int r = cursor.row;
+    int c = cursor.col - 1;
+    if (c < 0) {
+        if (r == 0 || !is_wrapped(r - 1)) {
+            return; // Nothing to combine with
+        }
+        r -= 1;
+        c = term_cols - 1;
+    }
+    Char *line = row(r);
+    if (c > 0 && line[c].is_spacer()) {
+        --c;
+    }
+    if (line[c].is_spacer()) {
+        return;
+    }
+    const wchar_t ch = combine(line[c].ch, mark);
+    if (ch != line[c].ch) {
+        line[c].ch = ch;
+        mark_dirty(r, c, c);
+    }
+}
+
+//
+// Get contents of a cell with the mark added to the character:
+// reference to the table of combined characters.
+// When there is no more room, the table is compacted: then the cell itself
+// is renumbered. When it is still full, the mark is dropped.
+//
+static uint64_t combined_key(wchar_t ch, wchar_t mark)
+{
+    return uint64_t(uint32_t(ch)) << 32 | uint32_t(mark);
+}
+
+wchar_t AnsiLogic::combine(wchar_t ch, wchar_t mark)
+{
+    auto it = combined_index.find(combined_key(ch, mark));
+    if (it != combined_index.end()) {
+        return it->second;
+    }
+
+    const bool combined = (ch >= Char::COMBINED);
+    size_t start        = combined ? ch - Char::COMBINED : 0;
+    const size_t length = combined ? wcslen(&combined_text[start]) : 1;
+    if (length > size_t(MAX_COMBINING_MARKS)) {
+        return ch;
+    }
+    if (combined_text.size() + length + 2 > MAX_COMBINED_TEXT) {
+        compact_combined();
+        if (combined) {
+            start = combined_remap[start];
+            ch    = Char::COMBINED + start;
+        }
+        if (combined_text.size() + length + 2 > MAX_COMBINED_TEXT) {
+            return ch;
+        }
+    }
+    const uint64_t key   = combined_key(ch, mark);
+    const wchar_t result = Char::COMBINED + combined_text.size();
+    for (size_t i = 0; i < length; ++i) {
+        combined_text.push_back(combined ? combined_text[start + i] : ch);
+    }
+    combined_text.push_back(mark);
+    combined_text.push_back(0);
+    combined_index.emplace(key, result);
+    return result;
+}
+
+static void append_utf8(std::string &out, wchar_t wc)
+{
+    if (wc <= 0x7F) {
+        out += static_cast<char>(wc);
+    } else if (wc <= 0x7FF) {
+        out += static_cast<char>(0xC0 | ((wc >> 6) & 0x1F));
+        out += static_cast<char>(0x80 | (wc & 0x3F));
+    } else if (wc <= 0xFFFF) {
+        out += static_cast<char>(0xE0 | ((wc >> 12) & 0x0F));
+        out += static_cast<char>(0x80 | ((wc >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (wc & 0x3F));
+    } else {
+        out += static_cast<char>(0xF0 | ((wc >> 18) & 0x07));
+        out += static_cast<char>(0x80 | ((wc >> 12) & 0x3F));
+        out += static_cast<char>(0x80 | ((wc >> 6) & 0x3F));
+        out += static_cast<char>(0x80 | (wc & 0x3F));
+    }
+}
+
+//
+// Input sent by keys other than characters, indexed by key code:
+//      text            - single control character, like for Enter
+//      ESC [ final     - cursor keys; ESC O final in application cursor mode
+//      ESC O final     - F1...F4
+//      ESC [ number ~  - editing keys and F5...F12
+// With modifiers, the number (1 for keys without it) is followed
+// by ; and 1 + modifier bits: shift 1, alt 2, ctrl 4, as in xterm.
+//
+struct KeySequence {
+    char text{ 0 };
+    char final{ 0 };
+    uint8_t number{ 0 };
+    bool cursor{ false };
+    bool ss3{ false };
+};
+
+struct KeyTable {
+    KeySequence keys[int(KeyCode::CHARACTER)];
+
+    constexpr KeyTable() : keys()
+    {
+        keys[int(KeyCode::ENTER)].text     = '\r';
+        keys[int(KeyCode::BACKSPACE)].text = '\b';
+        keys[int(KeyCode::TAB)].text       = '\t';
+        keys[int(KeyCode::ESCAPE)].text    = '\033';
+        cursor_key(KeyCode::UP, 'A');
+        cursor_key(KeyCode::DOWN, 'B');
+        cursor_key(KeyCode::RIGHT, 'C');
+        cursor_key(KeyCode::LEFT, 'D');
+        cursor_key(KeyCode::HOME, 'H');
+        cursor_key(KeyCode::END, 'F');
+        numbered_key(KeyCode::INSERT, 2);
+        numbered_key(KeyCode::DELETE, 3);
+        numbered_key(KeyCode::PAGEUP, 5);
+        numbered_key(KeyCode::PAGEDOWN, 6);
+        const char pf_keys[] = "PQRS";
+        for (int i = 0; i < 4; ++i) {
+            keys[int(KeyCode::F1) + i].final = pf_keys[i];
+            keys[int(KeyCode::F1) + i].ss3   = true;
+        }
+        const uint8_t f_numbers[] = { 15, 17, 18, 19, 20, 21, 23, 24 };
+        for (int i = 0; i < 8; ++i) {
+            numbered_key(KeyCode(int(KeyCode::F5) + i), f_numbers[i]);
+        }
+    }
+
+    constexpr void cursor_key(KeyCode code, char final)
+    {
+        keys[int(code)].final  = final;
+        keys[int(code)].cursor = true;
+    }
+
+    constexpr void numbered_key(KeyCode code, uint8_t number)
+    {
+        keys[int(code)].final  = '~';
+        keys[int(code)].number = number;
+    }
+};
+
+static constexpr KeyTable key_table;
+
+//
+// Characters of US keyboard layout with Shift, indexed by ASCII code.
+//
+struct ShiftTable {
+    char chars[128];
+
+    constexpr ShiftTable() : chars()
+    {
+        for (int c = 0; c < 128; ++c) {
+            chars[c] = (c >= 'a' && c <= 'z') ? c - 'a' + 'A' : c;
+        }
+        const char plain[]   = "1234567890-=[];',./`\\";
+        const char shifted[] = "!@#$%^&*()_+{}:\"<>?~|";
+        for (int i = 0; plain[i]; ++i) {
+            chars[int(plain[i])] = shifted[i];
         }
-        break;
     }
+};
+
+static constexpr ShiftTable shift_table;
+
+std::string AnsiLogic::process_key(const KeyInput &key) const
+{
+    std::string input;
+    process_key(key, input);
     return input;
 }
 
-static int get_param(const std::vector<int> &params, int index, int default_value)
+//
+// Append input for the key to the buffer: nothing is allocated
+// once the buffer has grown enough.
+//
+void AnsiLogic::process_key(const KeyInput &key, std::string &out) const
 {
-    if (params.size() > index && params[index] > default_value) {
-        return params[index];
+    if (key.code == KeyCode::CHARACTER) {
+        if (key.mod_alt) {
+            // Meta sends escape.
+            out += '\033';
+        }
+        if (key.mod_ctrl) {
+            out += char(key.character & 0x1f);
+        } else if (key.mod_shift && key.character <= 0x7f) {
+            out += shift_table.chars[key.character];
+        } else if (key.mod_shift) {
+            append_utf8(out, u_toupper(key.character));
+        } else {
+            append_utf8(out, key.character);
+        }
+        return;
     }
-    return default_value;
+    if (key.code > KeyCode::CHARACTER) {
+        return;
+    }
+
+    // Modifier keys themselves, like Shift, send nothing.
+    const KeySequence &seq = key_table.keys[int(key.code)];
+    const int modifiers    = key.mod_shift + 2 * key.mod_alt + 4 * key.mod_ctrl;
+    if (seq.text) {
+        if (key.code == KeyCode::TAB && modifiers == 1) {
+            out += "\033[Z"; // Back tab
+            return;
+        }
+        if (key.mod_alt) {
+            out += '\033';
+        }
+        if (key.code == KeyCode::ENTER && app_keypad) {
+            out += "\033OM"; // Enter of the keypad
+        } else {
+            out += seq.text;
+        }
+        return;
+    }
+    if (!seq.final) {
+        return;
+    }
+    char buf[16];
+    char *ptr = buf;
+    *ptr++    = '\033';
+    if (modifiers == 0 && (seq.ss3 || (seq.cursor && app_cursor_keys))) {
+        *ptr++ = 'O';
+    } else {
+        *ptr++ = '[';
+        if (seq.number >= 10) {
+            *ptr++ = '0' + seq.number / 10;
+        }
+        if (seq.number > 0) {
+            *ptr++ = '0' + seq.number % 10;
+        } else if (modifiers) {
+            *ptr++ = '1';
+        }
+        if (modifiers) {
+            *ptr++ = ';';
+            *ptr++ = '1' + modifiers;
+        }
+    }
+    *ptr++ = seq.final;
+    out.append(buf, ptr - buf);
 }
 
-void AnsiLogic::parse_ansi_sequence(const std::string &seq, std::vector<int> &dirty_rows)
+//
+// Parse extended color of SGR 38 or 48, at given index of parameters:
+//      38;5;n                          - color n of 256-color palette
+//      38;2;r;g;b                      - direct color
+//      38:5:n, 38:2:r:g:b, 38:2::r:g:b - same, with optional color space
+// Advance the index to the last parameter used.
+//
+void AnsiLogic::parse_extended_color(int &index, RgbColor &color) const
 {
-    if (seq.empty() || seq[0] != '[') {
-        // std::cerr << "Invalid CSI sequence: " << seq << std::endl;
+    int next = index + 1;
+    if (next >= csi_param_count) {
         return;
     }
 
-    // std::cerr << "Processing CSI sequence: " << seq << std::endl;
-    std::vector<int> params;
-    std::string param_str;
-
-    // Process all characters up to the final character
-    for (size_t i = 1; i < seq.size(); ++i) {
-        char c = seq[i];
-        if (std::isdigit(c)) {
-            param_str += c;
-        } else if (c == ';' || std::isalpha(c)) {
-            if (!param_str.empty()) {
-                try {
-                    params.push_back(std::stoi(param_str));
-                } catch (const std::exception &e) {
-                    // std::cerr << "Error parsing parameter '" << param_str << "': " << e.what()
-                    //           << std::endl;
-                    params.push_back(0);
-                }
-                param_str.clear();
-            } else {
-                params.push_back(0);
-            }
-            if (std::isalpha(c)) {
-                break; // Final character reached
-            }
+    // Colon-separated form has sub-parameters, which may include color space.
+    int subparams = 0;
+    while (next + 1 + subparams < csi_param_count &&
+           (csi_colon_mask & (1u << (next + 1 + subparams)))) {
+        ++subparams;
+    }
+    switch (csi_params[next]) {
+    case 5:
+        index = std::min(next + 1, csi_param_count - 1);
+        if (next + 1 < csi_param_count && csi_params[next + 1] < 256) {
+            color = palette_color(csi_params[next + 1]);
+        }
+        break;
+    case 2: {
+        int first = (subparams >= 4) ? next + 2 : next + 1;
+        index     = std::min(first + 2, csi_param_count - 1);
+        if (first + 2 < csi_param_count) {
+            color = { uint8_t(std::min(csi_params[first], 255)),
+                      uint8_t(std::min(csi_params[first + 1], 255)),
+                      uint8_t(std::min(csi_params[first + 2], 255)) };
         }
+        break;
+    }
+    default:
+        index = next;
+        break;
     }
+}
 
-    // Handle any remaining parameter
-    if (!param_str.empty()) {
-        try {
-            params.push_back(std::stoi(param_str));
-        } catch (const std::exception &e) {
-            // std::cerr << "Error parsing final parameter '" << param_str << "': " << e.what()
-            //           << std::endl;
-            params.push_back(0);
-        }
+//
+// Get parameter of CSI sequence.
+// Missing or zero parameter means default value.
+//
+int AnsiLogic::get_param(int index, int default_value) const
+{
+    if (index < csi_param_count && csi_params[index] > default_value) {
+        return csi_params[index];
     }
+    return default_value;
+}
 
-    // Process final character
-    switch (seq.back()) {
+//
+// Execute CSI sequence with given final character.
+//
+void AnsiLogic::dispatch_csi(char final_char)
+{
+    switch (final_char) {
     case 'm': {
         const RgbColor *current_colors = normal_colors;
-        for (size_t i = 0; i < params.size(); ++i) {
-            int p = params[i];
+        for (int i = 0; i < csi_param_count; ++i) {
+            int p = csi_params[i];
             if (p == 0) {
                 current_colors = normal_colors;
                 current_attr = CharAttr(); // Light Gray on Black
@@ -460,105 +1066,234 @@ void AnsiLogic::parse_ansi_sequence(const std::string &seq, std::vector<int> &di
                 current_attr.fg = current_colors[p - 30];
             } else if (p >= 40 && p <= 47) {
                 current_attr.bg = current_colors[p - 40];
+            } else if (p == 38) {
+                parse_extended_color(i, current_attr.fg);
+            } else if (p == 48) {
+                parse_extended_color(i, current_attr.bg);
+            } else if (p == 39) {
+                current_attr.fg = CharAttr().fg;
+            } else if (p == 49) {
+                current_attr.bg = CharAttr().bg;
             } else if (p >= 90 && p <= 97) {
                 current_attr.fg = bright_colors[p - 90];
             } else if (p >= 100 && p <= 107) {
                 current_attr.bg = bright_colors[p - 100];
             }
         }
+        current_attr_index = intern_attr(current_attr);
         break;
     }
     case 'H':
-        cursor.row = std::max(0, std::min(get_param(params, 0, 1) - 1, term_rows - 1));
-        cursor.col = std::max(0, std::min(get_param(params, 1, 1) - 1, term_cols - 1));
+        cursor.row = std::max(0, std::min(get_param(0, 1) - 1, term_rows - 1));
+        cursor.col = std::max(0, std::min(get_param(1, 1) - 1, term_cols - 1));
         break;
 
     case 'A':
-        cursor.row = std::max(0, cursor.row - get_param(params, 0, 1));
+        cursor.row = std::max(0, cursor.row - get_param(0, 1));
         break;
 
     case 'B':
-        cursor.row = std::min(term_rows - 1, cursor.row + get_param(params, 0, 1));
+        cursor.row = std::min(term_rows - 1, cursor.row + get_param(0, 1));
         break;
 
     case 'C':
-        cursor.col = std::min(term_cols - 1, cursor.col + get_param(params, 0, 1));
+        cursor.col = std::min(term_cols - 1, cursor.col + get_param(0, 1));
         break;
 
     case 'D':
-        cursor.col = std::max(0, cursor.col - get_param(params, 0, 1));
+        cursor.col = std::max(0, cursor.col - get_param(0, 1));
         break;
 
     case 'J':
-        switch (get_param(params, 0, 0)) {
+        switch (get_param(0, 0)) {
         default:
         case 0:
             // Clear from cursor to end of screen
-            for (int c = cursor.col; c < term_cols; ++c) {
-                text_buffer[cursor.row][c] = { L' ', current_attr };
-            }
-            for (int r = cursor.row + 1; r < term_rows; ++r) {
-                for (int c = 0; c < term_cols; ++c) {
-                    text_buffer[r][c] = { L' ', current_attr };
-                }
-            }
-            for (int r = cursor.row; r < term_rows; ++r) {
-                dirty_rows.push_back(r);
-            }
+            erase_cells(cursor.row, cursor.col, term_cols);
+            erase_rows(cursor.row + 1, term_rows);
             break;
         case 1:
             // Clear from start of screen to cursor
-            for (int r = 0; r < cursor.row; ++r) {
-                for (int c = 0; c < term_cols; ++c) {
-                    text_buffer[r][c] = { L' ', current_attr };
-                }
-            }
-            for (int c = 0; c <= cursor.col; ++c) {
-                text_buffer[cursor.row][c] = { L' ', current_attr };
-            }
-            for (int r = 0; r <= cursor.row; ++r) {
-                dirty_rows.push_back(r);
-            }
+            erase_rows(0, cursor.row);
+            erase_cells(cursor.row, 0, cursor.col + 1);
             break;
         case 2:
             clear_screen();
-            for (int r = 0; r < term_rows; ++r) {
-                dirty_rows.push_back(r);
-            }
+            mark_all_dirty();
             break;
         }
         break;
 
+    case 'r': {
+        // Set scroll region, move cursor home.
+        int top    = get_param(0, 1) - 1;
+        int bottom = std::min(get_param(1, 1), term_rows) - 1;
+        if (csi_param_count < 2 || csi_params[1] == 0) {
+            bottom = term_rows - 1; // Default is the whole screen
+        }
+        if (top < bottom) {
+            scroll_top    = top;
+            scroll_bottom = bottom;
+            cursor        = { 0, 0 };
+        }
+        break;
+    }
+
+    case 'L':
+        // Insert lines at cursor, inside of scroll region.
+        if (cursor.row >= scroll_top && cursor.row <= scroll_bottom) {
+            scroll_region_down(cursor.row, scroll_bottom, get_param(0, 1));
+            cursor.col = 0;
+        }
+        break;
+
+    case 'M':
+        // Delete lines at cursor, inside of scroll region.
+        if (cursor.row >= scroll_top && cursor.row <= scroll_bottom) {
+            scroll_region_up(cursor.row, scroll_bottom, get_param(0, 1), false);
+            cursor.col = 0;
+        }
+        break;
+
+    case 'S':
+        scroll_region_up(scroll_top, scroll_bottom, get_param(0, 1), scroll_top == 0);
+        break;
+
+    case 'T':
+        if (csi_param_count == 1) {
+            // With more parameters it's a mouse tracking request.
+            scroll_region_down(scroll_top, scroll_bottom, get_param(0, 1));
+        }
+        break;
+
     case 'K':
         // std::cerr << "Processing ESC [ " << mode << "K" << std::endl;
-        switch (get_param(params, 0, 0)) {
+        switch (get_param(0, 0)) {
         default:
         case 0:
-            for (int c = cursor.col; c < term_cols; ++c) {
-                text_buffer[cursor.row][c] = { L' ', current_attr };
-            }
+            erase_cells(cursor.row, cursor.col, term_cols);
             break;
         case 1:
-            for (int c = 0; c <= cursor.col; ++c) {
-                text_buffer[cursor.row][c] = { L' ', current_attr };
-            }
+            erase_cells(cursor.row, 0, cursor.col + 1);
             break;
         case 2:
-            for (int c = 0; c < term_cols; ++c) {
-                text_buffer[cursor.row][c] = { L' ', current_attr };
-            }
+            erase_cells(cursor.row, 0, term_cols);
             break;
         }
-        dirty_rows.push_back(cursor.row);
         break;
     }
 }
 
-void AnsiLogic::clear_screen()
+//
+// Execute CSI sequence with '?' private marker.
+//
+void AnsiLogic::dispatch_private_csi(char final_char)
 {
-    for (int r = 0; r < term_rows; ++r) {
-        text_buffer[r] = std::vector<Char>(term_cols, { L' ', current_attr });
+    if (csi_intermediate == 0 && (final_char == 'h' || final_char == 'l')) {
+        // DECSET, DECRST: every parameter is a mode number.
+        for (int i = 0; i < csi_param_count; ++i) {
+            set_dec_mode(csi_params[i], final_char == 'h');
+        }
+    } else if (csi_intermediate == '$' && final_char == 'p') {
+        // DECRQM: report state of the mode.
+        int mode = get_param(0, 0);
+        reply += "\033[?" + std::to_string(mode) + ";" + std::to_string(query_dec_mode(mode)) +
+                 "$y";
+    }
+}
+
+void AnsiLogic::set_dec_mode(int mode, bool enable)
+{
+    switch (mode) {
+    case 47:
+        // Alternate screen.
+        set_alt_screen(enable);
+        break;
+    case 1047:
+        // Alternate screen, cleared when leaving it.
+        if (!enable && alt_screen) {
+            erase_rows(0, term_rows);
+        }
+        set_alt_screen(enable);
+        break;
+    case 1049:
+        // Save cursor and switch to cleared alternate screen.
+        if (enable && !alt_screen) {
+            saved_cursor = cursor;
+            set_alt_screen(true);
+            erase_rows(0, term_rows);
+        } else if (!enable && alt_screen) {
+            set_alt_screen(false);
+            cursor = saved_cursor;
+        }
+        break;
+    case 1:
+        app_cursor_keys = enable;
+        break;
+    case 2004:
+        bracketed_paste = enable;
+        break;
+    case 2026:
+        sync_update = enable;
+        break;
+    }
+}
+
+//
+// Switch between main and alternate screens.
+// Only the buffers are exchanged; all rows get repainted.
+//
+void AnsiLogic::set_alt_screen(bool enable)
+{
+    if (enable == alt_screen) {
+        return;
+    }
+    if (alt_buffer.size() != text_buffer.size() || alt_row_map.size() != row_map.size()) {
+        // First use, or resized since.
+        assign_pooled(pool, alt_buffer, text_buffer.size(), Char());
+        assign_pooled(pool, alt_wrap_flags, term_rows, uint8_t(0));
+        alt_row_map.resize(term_rows);
+        std::iota(alt_row_map.begin(), alt_row_map.end(), 0);
+        report_usage();
+    }
+    swap_screens();
+    alt_screen = enable;
+    mark_all_dirty();
+}
+
+void AnsiLogic::swap_screens()
+{
+    text_buffer.swap(alt_buffer);
+    wrap_flags.swap(alt_wrap_flags);
+    row_map.swap(alt_row_map);
+}
+
+//
+// Return state of DEC private mode, as reported by DECRQM:
+// 0 - not recognized, 1 - set, 2 - reset.
+//
+int AnsiLogic::query_dec_mode(int mode) const
+{
+    switch (mode) {
+    case 47:
+    case 1047:
+    case 1049:
+        return alt_screen ? 1 : 2;
+    case 1:
+        return app_cursor_keys ? 1 : 2;
+    case 2004:
+        return bracketed_paste ? 1 : 2;
+    case 2026:
+        return sync_update ? 1 : 2;
+    default:
+        return 0;
     }
+}
+
+void AnsiLogic::clear_screen()
+{
+    std::fill(text_buffer.begin(), text_buffer.end(), blank_char());
+    std::fill(wrap_flags.begin(), wrap_flags.end(), 0);
     cursor.row = 0;
     cursor.col = 0;
 }
@@ -566,13 +1301,356 @@ void AnsiLogic::clear_screen()
 void AnsiLogic::reset_state()
 {
     // std::cerr << "Processing ESC c: Resetting terminal state" << std::endl;
-    current_attr = CharAttr();
+    current_attr       = CharAttr();
+    current_attr_index = 0;
+    sync_update        = false;
+    bracketed_paste    = false;
+    app_cursor_keys    = false;
+    app_keypad         = false;
+    set_alt_screen(false);
+    reset_scroll_region();
     clear_screen();
+    if (!combined_text.empty()) {
+        // Marks of the old screen are only in history, which has own copies.
+        compact_combined();
+    }
+}
+
+//
+// Text reached the right margin: continue on the next row.
+//
+void AnsiLogic::wrap_line()
+{
+    wrap_flags[buffer_index(cursor.row)] = 1;
+    cursor.col                           = 0;
+    line_feed();
+}
+
+//
+// Move cursor down; at bottom of scroll region the text moves up instead.
+//
+void AnsiLogic::line_feed()
+{
+    if (cursor.row == scroll_bottom) {
+        scroll_region_up(scroll_top, scroll_bottom, 1, scroll_top == 0);
+    } else if (cursor.row < term_rows - 1) {
+        cursor.row++;
+    }
+}
+
+//
+// Move rows [top, bottom] up by given number of lines.
+// Rows leaving the region are cleared and recycled at its bottom:
+// only their indices are rotated, cells stay in place.
+// When requested, the rows are saved in history first; alternate screen has no history.
+//
+void AnsiLogic::scroll_region_up(int top, int bottom, int lines, bool save)
+{
+    lines = std::min(lines, bottom - top + 1);
+    for (int r = top; r < top + lines; ++r) {
+        if (save && !alt_screen) {
+            scrollback->push_line(row(r), term_cols, attr_table.data(), is_wrapped(r),
+                                  combined_text.data());
+        }
+        std::fill_n(row(r), term_cols, blank_char());
+        wrap_flags[buffer_index(r)] = 0;
+    }
+    std::rotate(row_map.begin() + top, row_map.begin() + top + lines,
+                row_map.begin() + bottom + 1);
+
+    // Only the new rows need repainting, after the renderer scrolls.
+    for (int r = bottom - lines + 1; r <= bottom; ++r) {
+        mark_row_dirty(r);
+    }
+    add_scroll_event(top, bottom, lines);
+}
+
+//
+// Move rows [top, bottom] down by given number of lines.
+// Cleared rows appear at the top of the region.
+//
+void AnsiLogic::scroll_region_down(int top, int bottom, int lines)
+{
+    lines = std::min(lines, bottom - top + 1);
+    for (int r = bottom - lines + 1; r <= bottom; ++r) {
+        std::fill_n(row(r), term_cols, blank_char());
+        wrap_flags[buffer_index(r)] = 0;
+    }
+    std::rotate(row_map.begin() + top, row_map.begin() + bottom + 1 - lines,
+                row_map.begin() + bottom + 1);
+    for (int r = top; r < top + lines; ++r) {
+        mark_row_dirty(r);
+    }
+    add_scroll_event(top, bottom, -lines);
+}
+
+//
+// Remember the scroll for the renderer. Scrolls of the same region
+// in the same direction are merged. When there are too many,
+// the whole screen is repainted instead.
+//
+void AnsiLogic::add_scroll_event(int top, int bottom, int lines)
+{
+    if (top == 0 && bottom == term_rows - 1 && lines > 0) {
+        scroll_count += lines;
+    }
+    if (!pending_scrolls.empty()) {
+        ScrollEvent &last = pending_scrolls.back();
+        if (last.top == top && last.bottom == bottom && (last.lines > 0) == (lines > 0)) {
+            last.lines += lines;
+            return;
+        }
+    }
+    if (pending_scrolls.size() >= MAX_SCROLL_EVENTS) {
+        mark_all_dirty();
+        return;
+    }
+    pending_scrolls.push_back({ top, bottom, lines });
+}
+
+void AnsiLogic::reset_row_map()
+{
+    row_map.resize(term_rows);
+    std::iota(row_map.begin(), row_map.end(), 0);
+}
+
+void AnsiLogic::reset_scroll_region()
+{
+    scroll_top    = 0;
+    scroll_bottom = term_rows - 1;
+}
+
+//
+// Clear cells [from_col, to_col) of given row.
+// Row cleared up to the right margin does not continue anymore.
+//
+void AnsiLogic::erase_cells(int r, int from_col, int to_col)
+{
+    if (from_col < to_col) {
+        split_wide_chars(r, from_col, to_col - 1);
+        std::fill(row(r) + from_col, row(r) + to_col, blank_char());
+        mark_dirty(r, from_col, to_col - 1);
+    }
+    if (to_col >= term_cols) {
+        wrap_flags[buffer_index(r)] = 0;
+    }
+}
+
+//
+// Clear rows [from_row, to_row).
+//
+void AnsiLogic::erase_rows(int from_row, int to_row)
+{
+    for (int r = from_row; r < to_row; ++r) {
+        std::fill_n(row(r), term_cols, blank_char());
+        wrap_flags[buffer_index(r)] = 0;
+        mark_row_dirty(r);
+    }
+}
+
+//
+// Slot of the hash table where search for the key starts.
+//
+static size_t attr_slot(uint64_t key, int bits)
+{
+    return (key * 0x9e3779b97f4a7c15ull) >> (64 - bits);
+}
+
+//
+// Find index of given attribute in the table, or add a new entry.
+//
+uint16_t AnsiLogic::intern_attr(const CharAttr &attr)
+{
+    if (attr == attr_table[0]) {
+        return 0;
+    }
+    if (attr_slots.empty()) {
+        attr_slots.assign(size_t(1) << ATTR_SLOTS_LOG2, 0);
+        report_usage();
+    }
+    const uint64_t key = attr.key();
+    const size_t mask  = attr_slots.size() - 1;
+    for (size_t slot = attr_slot(key, ATTR_SLOTS_LOG2);; slot = (slot + 1) & mask) {
+        const uint16_t index = attr_slots[slot];
+        if (index == 0) {
+            break;
+        }
+        if (attr_table[index].key() == key) {
+            return index;
+        }
+    }
+    if (attr_table.size() >= MAX_ATTRS) {
+        compact_attrs();
+        if (attr_table.size() >= MAX_ATTRS) {
+            // Every entry is visible on the screen: fall back to default.
+            return 0;
+        }
+    }
+    uint16_t index = attr_table.size();
+    attr_table.push_back(attr);
+    insert_attr_slot(index);
+    return index;
+}
+
+//
+// Put entry of the attribute table into the first free slot for its key.
+//
+void AnsiLogic::insert_attr_slot(uint16_t index)
+{
+    const size_t mask = attr_slots.size() - 1;
+    size_t slot       = attr_slot(attr_table[index].key(), ATTR_SLOTS_LOG2);
+    while (attr_slots[slot] != 0) {
+        slot = (slot + 1) & mask;
+    }
+    attr_slots[slot] = index;
+}
+
+//
+// Remove attributes not referenced from the screen,
+// and renumber remaining entries.
+//
+void AnsiLogic::compact_attrs()
+{
+    std::vector<bool> &used = attr_used;
+    used.assign(attr_table.size(), false);
+    used[0]                  = true;
+    used[current_attr_index] = true;
+    for (const Char &c : text_buffer) {
+        used[c.attr] = true;
+    }
+    for (const Char &c : alt_buffer) {
+        used[c.attr] = true;
+    }
+
+    std::vector<uint16_t> &remap = attr_remap;
+    remap.resize(attr_table.size());
+    size_t count = 0;
+    for (size_t index = 0; index < attr_table.size(); ++index) {
+        if (used[index]) {
+            remap[index]        = count;
+            attr_table[count++] = attr_table[index];
+        }
+    }
+    attr_table.resize(count);
+
+    std::fill(attr_slots.begin(), attr_slots.end(), 0);
+    for (size_t index = 1; index < attr_table.size(); ++index) {
+        insert_attr_slot(index);
+    }
+
+    for (Char &c : text_buffer) {
+        c.attr = remap[c.attr];
+    }
+    for (Char &c : alt_buffer) {
+        c.attr = remap[c.attr];
+    }
+    current_attr_index = remap[current_attr_index];
+    attr_generation++;
+}
+
+//
+// Remove characters with combining marks which are not on the screens,
+// and renumber remaining entries. History has own copies of the text.
+//
+void AnsiLogic::compact_combined()
+{
+    static constexpr uint32_t UNUSED = UINT32_MAX;
+    std::vector<uint32_t> &remap     = combined_remap;
+    remap.assign(combined_text.size(), UNUSED);
+    for (const std::vector<Char> *buffer : { &text_buffer, &alt_buffer }) {
+        for (const Char &c : *buffer) {
+            if (c.is_combined()) {
+                remap[c.ch - Char::COMBINED] = 0;
+            }
+        }
+    }
+
+    // Entries move towards the start. Only base characters with one mark
+    // are indexed again: longer entries are keyed by their prefix, which
+    // may be gone. Such combinations are added again when needed.
+    combined_index.clear();
+    size_t count = 0;
+    for (size_t start = 0; start < combined_text.size();) {
+        const size_t length = wcslen(&combined_text[start]) + 1;
+        if (remap[start] != UNUSED) {
+            remap[start] = count;
+            std::copy_n(&combined_text[start], length, &combined_text[count]);
+            if (length == 3) {
+                combined_index.emplace(
+                    combined_key(combined_text[count], combined_text[count + 1]),
+                    Char::COMBINED + count);
+            }
+            count += length;
+        }
+        start += length;
+    }
+    combined_text.resize(count);
+
+    for (std::vector<Char> *buffer : { &text_buffer, &alt_buffer }) {
+        for (Char &c : *buffer) {
+            if (c.is_combined()) {
+                c.ch = Char::COMBINED + remap[c.ch - Char::COMBINED];
+            }
+        }
+    }
+    combined_version = ++last_combined_version;
+    attr_generation++;
+    mark_all_dirty();
+}
+
+//
+// Find first dirty row starting from given one.
+// Return term_rows when there are no more dirty rows.
+//
+int AnsiLogic::next_dirty_row(int r) const
+{
+    while (r < term_rows && !is_dirty(r)) {
+        ++r;
+    }
+    return r;
+}
+
+void AnsiLogic::clear_dirty()
+{
+    std::fill(dirty_bits.begin(), dirty_bits.end(), 0);
+    pending_scrolls.clear();
+}
+
+//
+// Copy screen, cursor and attributes, with rows in screen order.
+//
+void AnsiLogic::take_snapshot(ScreenSnapshot &snap) const
+{
+    snap.cols = term_cols;
+    snap.rows = term_rows;
+    snap.cells.resize(text_buffer.size());
+    for (int r = 0; r < term_rows; ++r) {
+        std::copy_n(get_row(r), term_cols, &snap.cells[r * term_cols]);
+    }
+    snap.attrs = attr_table;
+
+    // Within a version, the table is only appended to: copy the new part.
+    if (snap.combined_version != combined_version || snap.combined.size() > combined_text.size()) {
+        snap.combined.assign(combined_text.begin(), combined_text.end());
+        snap.combined_version = combined_version;
+    } else {
+        snap.combined.insert(snap.combined.end(), combined_text.begin() + snap.combined.size(),
+                             combined_text.end());
+    }
+    snap.attr_generation = attr_generation;
+    snap.cursor          = cursor;
+    snap.sync_update     = sync_update;
+    snap.scroll_count    = scroll_count;
 }
 
-void AnsiLogic::scroll_up()
+void AnsiLogic::mark_all_dirty()
 {
-    text_buffer.erase(text_buffer.begin());
-    text_buffer.push_back(std::vector<Char>(term_cols, { L' ', current_attr }));
-    cursor.row = term_rows - 1;
+    dirty_bits.assign((term_rows + 63) / 64, ~uint64_t(0));
+    if (term_rows % 64 != 0) {
+        dirty_bits.back() = (uint64_t(1) << (term_rows % 64)) - 1;
+    }
+    dirty_spans.assign(term_rows, { 0, term_cols - 1 });
+
+    // Everything gets repainted, so there is no use in scrolling.
+    pending_scrolls.clear();
 }
@@ -24,12 +24,12 @@
 #ifndef ANSI_LOGIC_H
 #define ANSI_LOGIC_H
 
-#include <gtest/gtest_prod.h>
-
+#include <algorithm>
 #include <cstdint>
 #include <cwchar>
-#include <map>
+#include <memory>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 // Device-independent keycodes
@@ -60,10 +60,17 @@ struct KeyInput {
     wchar_t character{};
     bool mod_shift{};
     bool mod_ctrl{};
+    bool mod_alt{};
 
     KeyInput() = default;
-    KeyInput(unsigned c, bool shift, bool ctrl)
-        : code(KeyCode::CHARACTER), character(c), mod_shift(shift), mod_ctrl(ctrl) {}
+    KeyInput(unsigned c, bool shift, bool ctrl, bool alt = false)
+        : code(KeyCode::CHARACTER), character(c), mod_shift(shift), mod_ctrl(ctrl), mod_alt(alt)
+    {
+    }
+    KeyInput(KeyCode k, bool shift = false, bool ctrl = false, bool alt = false)
+        : code(k), mod_shift(shift), mod_ctrl(ctrl), mod_alt(alt)
+    {
+    }
 };
 
 // Structure for color
@@ -87,12 +94,70 @@ struct CharAttr {
     {
         return fg == other.fg && bg == other.bg;
     }
+
+    // Pack all fields into one integer, for hashing.
+    uint64_t key() const
+    {
+        return uint64_t(fg.r) << 40 | uint64_t(fg.g) << 32 | uint64_t(fg.b) << 24 |
+               uint64_t(bg.r) << 16 | uint64_t(bg.g) << 8 | uint64_t(bg.b);
+    }
 };
 
-// Structure for a single character with attributes
+// Structure for a single character cell.
+// Attributes are stored as index in attribute table of AnsiLogic,
+// to keep the cell small: 8 bytes.
+// Wide character takes two cells: the right one is a spacer.
+// Character with combining marks is stored in the table of AnsiLogic,
+// and the cell refers to it by offset, past the range of Unicode.
 struct Char {
-    wchar_t ch = L' '; // Use wchar_t for Unicode
-    CharAttr attr;
+    static constexpr wchar_t WIDE_SPACER = 0;
+    static constexpr wchar_t COMBINED    = 0x110000;
+
+    wchar_t ch{ L' ' }; // Use wchar_t for Unicode
+    uint16_t attr{ 0 }; // Index in attribute table
+
+    bool operator==(const Char &other) const { return ch == other.ch && attr == other.attr; }
+    bool operator!=(const Char &other) const { return !(*this == other); }
+    bool is_spacer() const { return ch == WIDE_SPACER; }
+    bool is_combined() const { return ch >= COMBINED; }
+};
+
+// View of cells in a screen row, without copying, like std::span<const Char>
+class CellSpan {
+public:
+    CellSpan() = default;
+    CellSpan(const Char *data, size_t size) : ptr(data), count(size) {}
+
+    const Char *data() const { return ptr; }
+    size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+    const Char &operator[](size_t index) const { return ptr[index]; }
+    const Char *begin() const { return ptr; }
+    const Char *end() const { return ptr + count; }
+
+    CellSpan subspan(size_t offset, size_t length) const
+    {
+        offset = std::min(offset, count);
+        return { ptr + offset, std::min(length, count - offset) };
+    }
+
+private:
+    const Char *ptr{ nullptr };
+    size_t count{ 0 };
+};
+
+// Range of modified columns in a screen row
+struct DirtySpan {
+    int first_col{ 0 };
+    int last_col{ 0 };
+};
+
+// Rows [top, bottom] of the screen moved up by given number of lines,
+// or down when the number is negative.
+struct ScrollEvent {
+    int top;
+    int bottom;
+    int lines;
 };
 
 // Cursor position
@@ -101,22 +166,139 @@ struct Cursor {
     int col = 0;
 };
 
-// ANSI parsing states
-enum class AnsiState { NORMAL, ESCAPE, CSI };
+// Copy of the screen, for drawing outside of the parser.
+struct ScreenSnapshot {
+    int cols{ 0 };
+    int rows{ 0 };
+    std::vector<Char> cells;        // Rows in screen order, cols cells each
+    std::vector<CharAttr> attrs;    // Attribute table, indexed by Char::attr
+    std::vector<wchar_t> combined;  // Characters with combining marks
+    uint64_t combined_version{ 0 }; // Version of the combined table
+    unsigned attr_generation{ 0 };
+    Cursor cursor;
+    bool sync_update{ false };
+    uint64_t scroll_count{ 0 }; // Total number of lines scrolled
+};
+
+class MemoryPool;
+class Scrollback;
+
+// States of the parser, after the VT500 state diagram by Paul Williams.
+enum class AnsiState : uint8_t {
+    GROUND,              // Text and C0 controls
+    ESCAPE,              // After ESC
+    ESCAPE_INTERMEDIATE, // ESC with intermediate bytes, like ESC ( B
+    CSI_ENTRY,           // After ESC [
+    CSI_PARAM,           // Parameters of CSI sequence
+    CSI_INTERMEDIATE,    // Intermediate bytes of CSI sequence
+    CSI_IGNORE,          // Malformed CSI sequence, up to the final byte
+    DCS_ENTRY,           // After ESC P
+    DCS_PARAM,           // Parameters of DCS sequence
+    DCS_INTERMEDIATE,    // Intermediate bytes of DCS sequence
+    DCS_PASSTHROUGH,     // Data string of DCS sequence, up to ST
+    DCS_IGNORE,          // Malformed DCS sequence, up to ST
+    OSC_STRING,          // After ESC ], up to ST or BEL
+    SOS_PM_APC_STRING,   // After ESC X, ESC ^ or ESC _, up to ST
+};
 
 class AnsiLogic {
 public:
     AnsiLogic(int cols, int rows);
+
+    // Screens and history take their buffers from given pool.
+    AnsiLogic(int cols, int rows, MemoryPool &pool);
+    ~AnsiLogic();
     void resize(int new_cols, int new_rows);
-    std::vector<int> process_input(const char *buffer, size_t length);
-    std::string process_key(const KeyInput &key);
-    const std::vector<std::vector<Char>> &get_text_buffer() const { return text_buffer; }
+    void process_input(const char *buffer, size_t length);
+
+    // Append input of the key for the application to the buffer.
+    void process_key(const KeyInput &key, std::string &out) const;
+    std::string process_key(const KeyInput &key) const;
+    const Char *get_row(int row) const { return &text_buffer[buffer_index(row) * term_cols]; }
+    const CharAttr &get_attr(uint16_t index) const { return attr_table[index]; }
+
+    // Base character and combining marks of the cell, null-terminated.
+    // Valid for cells with is_combined(). History keeps own copies of the text.
+    const wchar_t *get_combined(wchar_t ch) const { return &combined_text[ch - Char::COMBINED]; }
+    const std::vector<wchar_t> &get_combined_table() const { return combined_text; }
+
+    // Entries are only appended while the version stays the same.
+    // Versions are unique among all instances, so that copies can be updated.
+    uint64_t get_combined_version() const { return combined_version; }
+    static constexpr int MAX_COMBINING_MARKS = 4; // As many as curses keeps in a cell
+    size_t get_attr_count() const { return attr_table.size(); }
+
+    // Incremented when attribute table or table of combined characters
+    // is renumbered, so that caches indexed by them must be discarded.
+    unsigned get_attr_generation() const { return attr_generation; }
     const Cursor &get_cursor() const { return cursor; }
     int get_cols() const { return term_cols; }
     int get_rows() const { return term_rows; }
 
+    // Row continues on the next one: text was wrapped at the right margin.
+    // Wrapped rows are joined again when the screen is resized.
+    bool is_wrapped(int row) const { return wrap_flags[buffer_index(row)]; }
+
+    // Dirty state of the screen, to be queried and cleared by the renderer.
+    // Rows are dirty when their contents changed since last clear_dirty().
+    // Pending scrolls are the moves of screen regions in between:
+    // the renderer should scroll its copy first, in order, then repaint dirty rows.
+    bool is_dirty(int row) const { return test_dirty_bit(buffer_index(row)); }
+    const DirtySpan &get_dirty_span(int row) const { return dirty_spans[buffer_index(row)]; }
+    int next_dirty_row(int row) const;
+    const std::vector<ScrollEvent> &get_pending_scrolls() const { return pending_scrolls; }
+    void clear_dirty();
+
+    // Cells of the row, in place.
+    CellSpan get_cells(int row) const { return { get_row(row), size_t(term_cols) }; }
+
+    // Call fn(row, first_col, cells) for every dirty row, with the changed cells only.
+    template <typename Fn>
+    void for_each_dirty_row(Fn &&fn) const
+    {
+        for (int row = next_dirty_row(0); row < term_rows; row = next_dirty_row(row + 1)) {
+            const DirtySpan &span = get_dirty_span(row);
+            fn(row, span.first_col,
+               get_cells(row).subspan(span.first_col, span.last_col - span.first_col + 1));
+        }
+    }
+
+    // Lines scrolled off the top of the screen.
+    Scrollback &get_scrollback() { return *scrollback; }
+    const Scrollback &get_scrollback() const { return *scrollback; }
+
+    // Copy the whole screen. Storage of the snapshot is reused.
+    void take_snapshot(ScreenSnapshot &snap) const;
+
+    // Synchronized update (DEC mode 2026): the application is in the middle
+    // of repainting the screen, and the renderer should hold the frame.
+    bool is_synchronized_update() const { return sync_update; }
+
+    // Bracketed paste (DEC mode 2004): the application wants pasted text
+    // between ESC [ 200 ~ and ESC [ 201 ~.
+    bool is_bracketed_paste() const { return bracketed_paste; }
+
+    // Alternate screen of full-screen applications is shown.
+    bool is_alt_screen() const { return alt_screen; }
+
+    // Color of xterm 256-color palette, as set by SGR 38;5;n.
+    static RgbColor palette_color(int index);
+
+    // Window title, as set by OSC 0 or OSC 2, in UTF-8.
+    const std::string &get_title() const { return title; }
+
+    // Replies to queries from the application, to be sent back to the PTY.
+    const std::string &get_reply() const { return reply; }
+    void clear_reply() { reply.clear(); }
+
 private:
-    // Declare test cases as friends
+    // Declare test cases as friends.
+    // Same as in gtest_prod.h, so that users of the library don't need gtest;
+    // our definition is removed after the list.
+#ifndef FRIEND_TEST
+#define FRIEND_TEST(test_case_name, test_name) friend class test_case_name##_##test_name##_Test
+#define ANSI_LOGIC_OWN_FRIEND_TEST
+#endif
     FRIEND_TEST(AnsiLogicTest, EscCResetsStateAndClearsScreen);
     FRIEND_TEST(AnsiLogicTest, EscKClearsLine);
     FRIEND_TEST(AnsiLogicTest, EscMSetsColors);
@@ -129,27 +311,208 @@ private:
     FRIEND_TEST(AnsiLogicTest, ClearScreenEsc1J);
     FRIEND_TEST(AnsiLogicTest, ClearScreenEsc2J);
     FRIEND_TEST(AnsiLogicTest, Utf8Input);
+    FRIEND_TEST(AnsiLogicTest, ScrollWrapsAround);
+    FRIEND_TEST(AnsiLogicTest, ResizeAfterScroll);
+    FRIEND_TEST(AnsiLogicTest, AttributeTable);
+    FRIEND_TEST(AnsiLogicTest, AttributeTableCompaction);
+    FRIEND_TEST(AnsiLogicTest, DirtySpans);
+    FRIEND_TEST(AnsiLogicTest, PendingScroll);
+    FRIEND_TEST(AnsiLogicTest, AsciiRunWraps);
+    FRIEND_TEST(AnsiLogicTest, Utf8SplitAcrossCalls);
+    FRIEND_TEST(AnsiLogicTest, Utf8Invalid);
+    FRIEND_TEST(AnsiLogicTest, CsiParameters);
+    FRIEND_TEST(AnsiLogicTest, SynchronizedUpdate);
+    FRIEND_TEST(AnsiLogicTest, Snapshot);
+    FRIEND_TEST(AnsiLogicTest, ScrollbackReceivesLines);
+    FRIEND_TEST(AnsiLogicTest, ResizeRewraps);
+    FRIEND_TEST(AnsiLogicTest, ExtendedColors);
+    FRIEND_TEST(AnsiLogicTest, AlternateScreen);
+    FRIEND_TEST(AnsiLogicTest, ScrollRegion);
+    FRIEND_TEST(AnsiLogicTest, ControlStrings);
+    FRIEND_TEST(AnsiLogicTest, WideCharacters);
+    FRIEND_TEST(AnsiLogicTest, CombiningMarks);
+    FRIEND_TEST(AnsiLogicTest, CombinedTableCompaction);
+#ifdef ANSI_LOGIC_OWN_FRIEND_TEST
+#undef FRIEND_TEST
+#undef ANSI_LOGIC_OWN_FRIEND_TEST
+#endif
 
     // Terminal state
     int term_cols;
     int term_rows;
-    std::vector<std::vector<Char>> text_buffer;
+    std::vector<Char> text_buffer;   // Rows of term_cols cells each, in any order
+    std::vector<int> row_map;        // Index of each screen row in text_buffer
+    std::vector<uint8_t> wrap_flags; // Soft wrap of rows, indexed like rows of text_buffer
+    int scroll_top{ 0 };             // Scroll region, set by DECSTBM
+    int scroll_bottom{ 0 };
     Cursor cursor;
     CharAttr current_attr;
+    uint16_t current_attr_index{ 0 }; // Index of current_attr in attribute table
+
+    // Table of distinct attributes, referenced from cells.
+    // Entry 0 is always the default attribute.
+    // Other entries are found by hash of the key, in a table with open
+    // addressing: slots hold the index, or 0 when free. The table is
+    // allocated with the first attribute which is not the default one.
+    std::vector<CharAttr> attr_table{ CharAttr() };
+    std::vector<uint16_t> attr_slots;
+    unsigned attr_generation{ 0 };
+    static constexpr size_t MAX_ATTRS    = 65536;
+    static constexpr int ATTR_SLOTS_LOG2 = 17; // Twice as many slots as entries
+
+    // Scratch buffers of compact_attrs(), kept for the next time.
+    std::vector<bool> attr_used;
+    std::vector<uint16_t> attr_remap;
+
+    // Characters with combining marks, null-terminated, one after another.
+    // Indexed by previous contents of the cell and the mark, so that every
+    // combination is stored once. When the table is full, entries which are
+    // not on the screens are removed; if it is still full, new marks are dropped.
+    std::vector<wchar_t> combined_text;
+    std::unordered_map<uint64_t, wchar_t> combined_index;
+    uint64_t combined_version;
+    static constexpr size_t MAX_COMBINED_TEXT = 65536;
+    std::vector<uint32_t> combined_remap; // Scratch buffer of compact_combined()
+
+    // Dirty state: one bit per row, plus range of modified columns.
+    // Indexed by position in text_buffer, so that it moves along
+    // with the contents when the screen scrolls.
+    std::vector<uint64_t> dirty_bits;
+    std::vector<DirtySpan> dirty_spans;
+    std::vector<ScrollEvent> pending_scrolls; // Scrolls since last clear_dirty()
+    static constexpr size_t MAX_SCROLL_EVENTS = 16;
+    uint64_t scroll_count{ 0 }; // Lines the whole screen scrolled since start
+    std::unique_ptr<Scrollback> scrollback;
     AnsiState state;
-    std::string ansi_seq;
+
+    // CSI sequence being received
+    static constexpr int MAX_CSI_PARAMS      = 16;
+    static constexpr int MAX_CSI_PARAM_VALUE = 65535;
+    int csi_params[MAX_CSI_PARAMS]{};
+    int csi_param_count{ 0 };
+    char csi_private{ 0 };        // Private marker: one of < = > ?
+    char csi_intermediate{ 0 };   // Intermediate byte: 0x20...0x2f
+    unsigned csi_colon_mask{ 0 }; // Parameters preceded by colon, as in 38:2:r:g:b
+
+    // OSC string being received; longer strings are truncated.
+    static constexpr size_t MAX_OSC_LENGTH = 4096;
+    std::string osc_string;
+    std::string title;
+
+    // DEC private modes
+    bool sync_update{ false };     // Mode 2026: synchronized update
+    bool bracketed_paste{ false }; // Mode 2004: pasted text goes between markers
+    bool app_cursor_keys{ false }; // Mode 1 (DECCKM): cursor keys send ESC O
+    bool app_keypad{ false };      // DECKPAM: keypad sends ESC O sequences
+
+    // Alternate screen (modes 47, 1047, 1049): buffers of the screen
+    // which is not shown. Switching exchanges them with the current ones.
+    bool alt_screen{ false };
+    std::vector<Char> alt_buffer;
+    std::vector<uint8_t> alt_wrap_flags;
+    std::vector<int> alt_row_map;
+    Cursor saved_cursor; // Cursor of main screen, saved by mode 1049
+
+    MemoryPool &pool;           // Storage of the buffers
+    size_t reported_usage{ 0 }; // Memory of the buffers, as known to the pool
+
+    std::string reply; // Pending response to the application
+
+    // State of UTF-8 decoder, kept between calls of process_input()
+    static constexpr uint8_t UTF8_ACCEPT = 0;
+    static constexpr uint8_t UTF8_REJECT = 12;
+    uint8_t utf8_state{ UTF8_ACCEPT };
+    uint32_t utf8_codepoint{ 0 };
 
     // ANSI colors
     static const RgbColor normal_colors[8];
     static const RgbColor bright_colors[8];
 
     // ANSI parsing methods
-    void parse_ansi_sequence(const std::string &seq, std::vector<int> &dirty_rows);
+    size_t print_ascii(const char *text, size_t length);
+    bool decode_utf8(uint8_t byte);
+    void put_char(wchar_t ch);
+    void put_combining_mark(wchar_t mark);
+    wchar_t combine(wchar_t ch, wchar_t mark);
+    void execute_control(char c);
+    void clear_sequence();
+    void collect(char c);
+    void add_param(char c);
+    void dispatch_esc(char final_char);
+    void dispatch_osc();
+    void dispatch_csi(char final_char);
+    void dispatch_private_csi(char final_char);
+    void parse_extended_color(int &index, RgbColor &color) const;
+    void set_dec_mode(int mode, bool enable);
+    void set_alt_screen(bool enable);
+    void swap_screens();
+    int query_dec_mode(int mode) const;
+    int get_param(int index, int default_value) const;
+
+    // Map screen row to index of the row in text buffer
+    int buffer_index(int row) const { return row_map[row]; }
+    Char *row(int r) { return &text_buffer[buffer_index(r) * term_cols]; }
+
+    // Blank cell with current attributes
+    Char blank_char() const { return { L' ', current_attr_index }; }
+
+    // Mark columns [from_col, to_col] of given row as modified.
+    void mark_dirty(int r, int from_col, int to_col)
+    {
+        int index       = buffer_index(r);
+        uint64_t &word  = dirty_bits[index / 64];
+        uint64_t bit    = uint64_t(1) << (index % 64);
+        DirtySpan &span = dirty_spans[index];
+        if (word & bit) {
+            span.first_col = std::min(span.first_col, from_col);
+            span.last_col  = std::max(span.last_col, to_col);
+        } else {
+            word |= bit;
+            span = { from_col, to_col };
+        }
+    }
+    void mark_row_dirty(int r) { mark_dirty(r, 0, term_cols - 1); }
+
+    // Columns [from_col, to_col] of given row are about to be overwritten:
+    // blank the halves of wide characters which stick out of the range.
+    void split_wide_chars(int r, int from_col, int to_col)
+    {
+        Char *line = row(r);
+        if (from_col > 0 && line[from_col].is_spacer()) {
+            line[from_col - 1].ch = L' ';
+            mark_dirty(r, from_col - 1, from_col - 1);
+        }
+        if (to_col + 1 < term_cols && line[to_col + 1].is_spacer()) {
+            line[to_col + 1].ch = L' ';
+            mark_dirty(r, to_col + 1, to_col + 1);
+        }
+    }
+    void mark_all_dirty();
+    bool test_dirty_bit(int index) const
+    {
+        return dirty_bits[index / 64] & (uint64_t(1) << (index % 64));
+    }
+
+    // Attribute table methods
+    uint16_t intern_attr(const CharAttr &attr);
+    void insert_attr_slot(uint16_t index);
+    void compact_attrs();
+    void compact_combined();
 
     // Terminal management methods
+    void wrap_line();
+    void erase_cells(int r, int from_col, int to_col);
+    void erase_rows(int from_row, int to_row);
     void clear_screen();
     void reset_state();
-    void scroll_up();
+    void reflow(int new_cols, int new_rows);
+    void line_feed();
+    void scroll_region_up(int top, int bottom, int lines, bool save);
+    void scroll_region_down(int top, int bottom, int lines);
+    void add_scroll_event(int top, int bottom, int lines);
+    void reset_row_map();
+    void reset_scroll_region();
+    void report_usage();
 };
 
 #endif // ANSI_LOGIC_H
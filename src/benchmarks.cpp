@@ -0,0 +1,407 @@
+//
+// Benchmarks for the terminal emulator: parser throughput and render cost.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <benchmark/benchmark.h>
+#include <locale.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+#include <random>
+#include <string>
+
+#include "ansi_logic.h"
+#include "curses_terminal.h"
+
+//
+// Count heap allocations, to report them per megabyte of input.
+// All forms of operator new and delete are replaced, so that every
+// pointer is freed by the same allocator which gave it.
+//
+static std::atomic<size_t> allocation_count{ 0 };
+
+static void *counted_alloc(size_t size, size_t alignment) noexcept
+{
+    allocation_count.fetch_add(1, std::memory_order_relaxed);
+    if (size == 0) {
+        size = 1;
+    }
+    if (alignment <= alignof(std::max_align_t)) {
+        return malloc(size);
+    }
+    void *ptr = nullptr;
+    return posix_memalign(&ptr, alignment, size) == 0 ? ptr : nullptr;
+}
+
+static void *counted_alloc_or_throw(size_t size, size_t alignment)
+{
+    void *ptr = counted_alloc(size, alignment);
+    if (!ptr) {
+        throw std::bad_alloc();
+    }
+    return ptr;
+}
+
+void *operator new(size_t size)
+{
+    return counted_alloc_or_throw(size, 0);
+}
+
+void *operator new[](size_t size)
+{
+    return counted_alloc_or_throw(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment)
+{
+    return counted_alloc_or_throw(size, size_t(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment)
+{
+    return counted_alloc_or_throw(size, size_t(alignment));
+}
+
+void *operator new(size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size, 0);
+}
+
+void *operator new[](size_t size, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size, 0);
+}
+
+void *operator new(size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size, size_t(alignment));
+}
+
+void *operator new[](size_t size, std::align_val_t alignment, const std::nothrow_t &) noexcept
+{
+    return counted_alloc(size, size_t(alignment));
+}
+
+void operator delete(void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, size_t, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, size_t, std::align_val_t) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete(void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+void operator delete[](void *ptr, std::align_val_t, const std::nothrow_t &) noexcept
+{
+    free(ptr);
+}
+
+// Size of every corpus.
+static constexpr size_t CORPUS_SIZE = 1024 * 1024;
+
+// Input is fed to the parser in pieces, as read from the PTY.
+static constexpr size_t CHUNK_SIZE = CursesTerminal::DEFAULT_READ_BUFFER_SIZE;
+
+// Output of the child between two frames, for render benchmarks.
+static constexpr size_t FRAME_SIZE = 4096;
+
+// Scrollback limit for the steady state benchmark: less than a corpus.
+static constexpr size_t HISTORY_LIMIT = 256 * 1024;
+
+static constexpr int SCREEN_COLS = 80;
+static constexpr int SCREEN_ROWS = 24;
+
+enum class Corpus {
+    ASCII_LOG,     // Plain text lines, like a build log
+    SGR_COLOR,     // Words in 16, 256 and direct colors
+    UTF8_CJK,      // Chinese and Japanese text
+    SCREEN_UPDATE, // Cursor-addressed repaints of full-screen applications
+};
+
+static void append_utf8(std::string &out, unsigned c)
+{
+    if (c < 0x80) {
+        out += char(c);
+    } else if (c < 0x800) {
+        out += char(0xc0 | (c >> 6));
+        out += char(0x80 | (c & 0x3f));
+    } else {
+        out += char(0xe0 | (c >> 12));
+        out += char(0x80 | ((c >> 6) & 0x3f));
+        out += char(0x80 | (c & 0x3f));
+    }
+}
+
+//
+// Generate corpus of given kind. Contents depends only on the kind,
+// so results are comparable between runs and machines.
+//
+static std::string make_corpus(Corpus kind)
+{
+    std::mt19937 random(12345);
+    auto pick = [&](unsigned n) { return unsigned(random() % n); };
+    static const char *const words[] = { "open", "read", "write", "close", "socket", "connect",
+                                         "worker", "request", "done", "error", "retry", "cache" };
+    char buf[256];
+    std::string out;
+    out.reserve(CORPUS_SIZE + 4096);
+
+    while (out.size() < CORPUS_SIZE) {
+        switch (kind) {
+        case Corpus::ASCII_LOG:
+            snprintf(buf, sizeof(buf),
+                     "2025-06-%02u 12:%02u:%02u.%03u INFO %s[%u]: %s id=%08x took %u ms\r\n",
+                     1 + pick(28), pick(60), pick(60), pick(1000), words[pick(12)], pick(64),
+                     words[pick(12)], unsigned(random()), pick(5000));
+            out += buf;
+            break;
+
+        case Corpus::SGR_COLOR:
+            for (int i = 0; i < 8; ++i) {
+                switch (pick(4)) {
+                case 0:
+                    snprintf(buf, sizeof(buf), "\033[%u;%um", pick(2), 30 + pick(8));
+                    break;
+                case 1:
+                    snprintf(buf, sizeof(buf), "\033[38;5;%um", pick(256));
+                    break;
+                case 2:
+                    snprintf(buf, sizeof(buf), "\033[38;2;%u;%u;%um\033[48;5;%um", pick(256),
+                             pick(256), pick(256), 232 + pick(24));
+                    break;
+                default:
+                    snprintf(buf, sizeof(buf), "\033[0m");
+                    break;
+                }
+                out += buf;
+                out += words[pick(12)];
+                out += ' ';
+            }
+            out += "\033[0m\r\n";
+            break;
+
+        case Corpus::UTF8_CJK:
+            for (int i = 0; i < 30; ++i) {
+                // Mostly ideographs, some kana and ASCII punctuation.
+                unsigned c = pick(8) ? 0x4e00 + pick(0x5200) : 0x3041 + pick(0x56);
+                append_utf8(out, c);
+                if (pick(10) == 0) {
+                    out += ", ";
+                }
+            }
+            out += "\r\n";
+            break;
+
+        case Corpus::SCREEN_UPDATE:
+            // Like htop: repaint of meters with colors, then a few fields by cursor moves.
+            // Like vim: scroll the text region, update the status line.
+            for (int row = 1; row <= 4; ++row) {
+                unsigned used = pick(60);
+                snprintf(buf, sizeof(buf), "\033[%d;1H\033[1m%3d\033[0m[\033[32m%.*s\033[0m%*s]",
+                         row, row - 1, int(used), "||||||||||||||||||||||||||||||||||||||||"
+                                                  "||||||||||||||||||||",
+                         int(60 - used), "");
+                out += buf;
+            }
+            for (int i = 0; i < 12; ++i) {
+                snprintf(buf, sizeof(buf), "\033[%u;%uH\033[38;5;%um%5u\033[0m", 6 + pick(18),
+                         1 + pick(70), pick(256), pick(100000));
+                out += buf;
+            }
+            snprintf(buf, sizeof(buf), "\033[6;23r\033[23;1H\n%s %s %s\033[K\033[r",
+                     words[pick(12)], words[pick(12)], words[pick(12)]);
+            out += buf;
+            snprintf(buf, sizeof(buf), "\033[24;1H\033[7m line %u of %u \033[K\033[0m\033[%u;%uH",
+                     pick(10000), 10000u, 6 + pick(18), 1 + pick(80));
+            out += buf;
+            break;
+        }
+    }
+    return out;
+}
+
+static const std::string &get_corpus(Corpus kind)
+{
+    static std::string corpora[4];
+    std::string &corpus = corpora[int(kind)];
+    if (corpus.empty()) {
+        corpus = make_corpus(kind);
+    }
+    return corpus;
+}
+
+//
+// Parser throughput: whole corpus through AnsiLogic, in PTY-sized chunks.
+// Without history, unless asked: then lines scrolled off go there,
+// with the default limit.
+//
+static void BM_Parse(benchmark::State &state, Corpus kind, bool history)
+{
+    const std::string &data = get_corpus(kind);
+    AnsiLogic logic(SCREEN_COLS, SCREEN_ROWS);
+    if (!history) {
+        logic.get_scrollback().set_limit(0);
+    }
+
+    const size_t allocations = allocation_count;
+    for (auto _ : state) {
+        for (size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE) {
+            logic.process_input(&data[offset], std::min(CHUNK_SIZE, data.size() - offset));
+            logic.clear_dirty();
+            logic.clear_reply();
+        }
+        benchmark::ClobberMemory();
+    }
+    const double megabytes = double(state.iterations()) * data.size() / (1024 * 1024);
+    state.SetBytesProcessed(int64_t(state.iterations()) * data.size());
+    state.counters["allocs/MB"] = double(allocation_count - allocations) / megabytes;
+}
+BENCHMARK_CAPTURE(BM_Parse, ascii_log, Corpus::ASCII_LOG, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parse, sgr_color, Corpus::SGR_COLOR, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parse, utf8_cjk, Corpus::UTF8_CJK, false)->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parse, screen_update, Corpus::SCREEN_UPDATE, false)
+    ->Unit(benchmark::kMillisecond);
+BENCHMARK_CAPTURE(BM_Parse, ascii_log_history, Corpus::ASCII_LOG, true)
+    ->Unit(benchmark::kMillisecond);
+
+//
+// Steady state of a long session: history is full, so for every new chunk
+// an old one is discarded, and buffers are reused through the pool.
+//
+static void BM_History(benchmark::State &state)
+{
+    const std::string &data = get_corpus(Corpus::ASCII_LOG);
+    AnsiLogic logic(SCREEN_COLS, SCREEN_ROWS);
+    logic.get_scrollback().set_limit(HISTORY_LIMIT);
+    logic.process_input(data.data(), data.size());
+
+    const size_t allocations = allocation_count;
+    for (auto _ : state) {
+        for (size_t offset = 0; offset < data.size(); offset += CHUNK_SIZE) {
+            logic.process_input(&data[offset], std::min(CHUNK_SIZE, data.size() - offset));
+            logic.clear_dirty();
+        }
+        benchmark::ClobberMemory();
+    }
+    const double megabytes = double(state.iterations()) * data.size() / (1024 * 1024);
+    state.SetBytesProcessed(int64_t(state.iterations()) * data.size());
+    state.counters["allocs/MB"] = double(allocation_count - allocations) / megabytes;
+}
+BENCHMARK(BM_History)->Unit(benchmark::kMillisecond);
+
+//
+// Render cost: one frame per iteration, drawn with curses into /dev/null.
+// Parsing of output between frames is not counted.
+//
+static void BM_Render(benchmark::State &state, Corpus kind)
+{
+    const std::string &data = get_corpus(kind);
+    FILE *output            = fopen("/dev/null", "w");
+    size_t offset           = 0;
+    size_t allocations      = 0;
+    {
+        CursesTerminal terminal(SCREEN_COLS, SCREEN_ROWS, output);
+        for (auto _ : state) {
+            state.PauseTiming();
+            const size_t length = std::min(FRAME_SIZE, data.size() - offset);
+            terminal.process_output(&data[offset], length);
+            offset = (offset + length < data.size()) ? offset + length : 0;
+            const size_t before = allocation_count;
+            state.ResumeTiming();
+
+            terminal.render_frame();
+            allocations += allocation_count - before;
+        }
+    }
+    fclose(output);
+    state.counters["allocs/frame"] = double(allocations) / state.iterations();
+    state.counters["frames/s"]     = benchmark::Counter(state.iterations(),
+                                                        benchmark::Counter::kIsRate);
+}
+BENCHMARK_CAPTURE(BM_Render, ascii_log, Corpus::ASCII_LOG);
+BENCHMARK_CAPTURE(BM_Render, sgr_color, Corpus::SGR_COLOR);
+BENCHMARK_CAPTURE(BM_Render, utf8_cjk, Corpus::UTF8_CJK);
+BENCHMARK_CAPTURE(BM_Render, screen_update, Corpus::SCREEN_UPDATE);
+
+int main(int argc, char **argv)
+{
+    // Curses needs the locale for wide characters.
+    setlocale(LC_ALL, "en_US.UTF-8");
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv)) {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
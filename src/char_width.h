@@ -0,0 +1,51 @@
+//
+// Display width of Unicode characters.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#ifndef CHAR_WIDTH_H
+#define CHAR_WIDTH_H
+
+#include <cstdint>
+
+// Tables generated by gen_char_width.py: index of a block for every
+// 256 characters, and blocks of 2-bit widths, four characters per byte.
+extern const uint8_t char_width_index[0x110000 / 256];
+extern const uint8_t char_width_blocks[][64];
+
+//
+// Number of cells taken by the character: 0 for combining marks,
+// 2 for wide East Asian characters and emoji, 1 otherwise.
+// Like wcwidth() for printable characters, but independent of the locale.
+//
+inline int char_width(uint32_t c)
+{
+    if (c < 0x300) {
+        return 1; // No combining marks before U+0300
+    }
+    if (c >= 0x110000) {
+        return 1;
+    }
+    const uint8_t *block = char_width_blocks[char_width_index[c >> 8]];
+    return (block[(c & 0xff) >> 2] >> ((c & 3) * 2)) & 3;
+}
+
+#endif // CHAR_WIDTH_H
@@ -23,27 +23,51 @@
 //
 #include "curses_terminal.h"
 
+#include "recording.h"
+#include "scrollback.h"
+
 #include <fcntl.h>
 #include <ncurses.h>
+#include <poll.h>
 #include <signal.h>
 #include <sys/ioctl.h>
-#include <sys/select.h>
 #include <sys/wait.h>
 #include <termios.h>
 #include <unistd.h>
 
 #include <algorithm>
+#include <climits>
 #include <cstring>
 #include <iostream>
 
-CursesTerminal::CursesTerminal(int cols, int rows) : display(cols, rows), dirty_lines(rows, true)
+CursesTerminal::CursesTerminal(int cols, int rows, size_t read_buffer_size, int frame_rate)
+    : read_buffer(read_buffer_size),
+      frame_interval(frame_rate > 0 ? std::chrono::duration_cast<Clock::duration>(
+                                          std::chrono::seconds(1)) / frame_rate
+                                    : Clock::duration::zero())
 {
+    sessions.push_back(std::make_unique<Session>(cols, rows));
+    session = sessions.back().get();
     initialize_ncurses();
-    initialize_pty();
+    initialize_pty(*session);
     initialize_colors();
 }
 
-CursesTerminal::~CursesTerminal()
+CursesTerminal::CursesTerminal(int cols, int rows, FILE *output, int frame_rate)
+    : frame_interval(frame_rate > 0 ? std::chrono::duration_cast<Clock::duration>(
+                                          std::chrono::seconds(1)) / frame_rate
+                                    : Clock::duration::zero())
+{
+    sessions.push_back(std::make_unique<Session>(cols, rows));
+    session = sessions.back().get();
+    initialize_ncurses(output);
+    initialize_colors();
+}
+
+//
+// Stop the child and close its PTY.
+//
+static void close_pty(int pty_fd, pid_t child_pid)
 {
     if (child_pid > 0) {
         kill(child_pid, SIGTERM);
@@ -52,37 +76,124 @@ CursesTerminal::~CursesTerminal()
     if (pty_fd != -1) {
         close(pty_fd);
     }
+}
+
+CursesTerminal::~CursesTerminal()
+{
+    stop_parser_thread();
+    for (auto &s : sessions) {
+        close_pty(s->pty_fd, s->child_pid);
+        stop_recording(*s);
+    }
+    if (stats_file) {
+        fclose(stats_file);
+    }
+    if (!screen) {
+        fputs("\033[?2004l", stdout);
+        fflush(stdout);
+    }
     endwin();
+    if (screen) {
+        delscreen(screen);
+        fclose(screen_input);
+    }
+    for (const std::string &message : recording_errors) {
+        std::cerr << message << std::endl;
+    }
 }
 
-void CursesTerminal::initialize_ncurses()
+void CursesTerminal::initialize_ncurses(FILE *output)
 {
-    initscr();
+    if (!output) {
+        initscr();
+
+        // Ask the terminal to mark pastes.
+        define_key("\033[200~", KEY_PASTE_BEGIN);
+        define_key("\033[201~", KEY_PASTE_END);
+        fputs("\033[?2004h", stdout);
+        fflush(stdout);
+    } else {
+        // Size of the stream is not known: take it from the display.
+        screen_input = fopen("/dev/null", "r");
+        screen       = newterm("xterm-256color", output, screen_input);
+        if (!screen) {
+            std::cerr << "newterm failed" << std::endl;
+            exit(1);
+        }
+        resizeterm(session->display.get_rows(), session->display.get_cols());
+    }
     raw(); // Use raw mode to disable signal generation for Ctrl+C
     noecho();
     nonl();
     keypad(stdscr, TRUE);
+    define_modified_keys();
+    idlok(stdscr, TRUE);   // Allow hardware insert/delete line and scrolling
     nodelay(stdscr, TRUE); // Non-blocking input
     start_color();
     use_default_colors();
 }
 
-void CursesTerminal::initialize_pty()
+//
+// Keys with modifiers have no names in curses. Find their codes by terminfo
+// capabilities of xterm, like kUP5 for Ctrl+Up: suffix is 1 + modifiers.
+//
+void CursesTerminal::define_modified_keys()
 {
-    pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
+    static const struct {
+        const char *name;
+        KeyCode code;
+    } keys[] = {
+        { "kUP", KeyCode::UP },     { "kDN", KeyCode::DOWN },   { "kRIT", KeyCode::RIGHT },
+        { "kLFT", KeyCode::LEFT },  { "kHOM", KeyCode::HOME },  { "kEND", KeyCode::END },
+        { "kIC", KeyCode::INSERT }, { "kDC", KeyCode::DELETE }, { "kPRV", KeyCode::PAGEUP },
+        { "kNXT", KeyCode::PAGEDOWN },
+    };
+    char name[16];
+    for (const auto &key : keys) {
+        for (int suffix = 2; suffix <= 8; ++suffix) {
+            snprintf(name, sizeof(name), "%s%d", key.name, suffix);
+            const char *str = tigetstr(name);
+            if (!str || str == (char *)-1) {
+                continue;
+            }
+            const int code = key_defined(str);
+            if (code <= KEY_MAX) {
+                // Not a key, or one of standard keys, like KEY_SR.
+                continue;
+            }
+            if (size_t(code) >= modified_keys.size()) {
+                modified_keys.resize(code + 1);
+            }
+            const int modifiers = suffix - 1;
+            modified_keys[code] = KeyInput(key.code, modifiers & 1, modifiers & 4, modifiers & 2);
+        }
+    }
+}
+
+//
+// Start shell in a new PTY.
+// Failures in the parent are thrown, so that other sessions continue.
+//
+void CursesTerminal::initialize_pty(Session &s)
+{
+    int pty_fd = posix_openpt(O_RDWR | O_NOCTTY);
     if (pty_fd < 0) {
-        std::cerr << "posix_openpt failed: " << strerror(errno) << std::endl;
-        exit(1);
+        throw std::runtime_error(std::string("posix_openpt failed: ") + strerror(errno));
     }
     if (grantpt(pty_fd) < 0 || unlockpt(pty_fd) < 0) {
-        std::cerr << "PTY setup failed: " << strerror(errno) << std::endl;
-        exit(1);
+        int saved_errno = errno;
+        close(pty_fd);
+        throw std::runtime_error(std::string("PTY setup failed: ") + strerror(saved_errno));
     }
 
-    child_pid = fork();
+    // Children of other sessions must not keep this PTY open.
+    fcntl(pty_fd, F_SETFD, FD_CLOEXEC);
+
+    pid_t child_pid = fork();
     if (child_pid < 0) {
-        std::cerr << "fork failed: " << strerror(errno) << std::endl;
-        exit(1);
+        int saved_errno = errno;
+        close(pty_fd);
+        throw std::runtime_error(std::string("fork failed: ") + strerror(saved_errno));
     } else if (child_pid == 0) {
         if (setsid() < 0) {
             std::cerr << "setsid failed: " << strerror(errno) << std::endl;
@@ -109,8 +220,8 @@ void CursesTerminal::initialize_pty()
 
         // Set initial geometry of child tty.
         struct winsize ws = {};
-        ws.ws_col         = display.get_cols();
-        ws.ws_row         = display.get_rows();
+        ws.ws_col         = s.display.get_cols();
+        ws.ws_row         = s.display.get_rows();
         if (ioctl(STDIN_FILENO, TIOCSWINSZ, &ws) < 0) {
             std::cerr << "ioctl TIOCSWINSZ failed: " << strerror(errno) << std::endl;
             exit(1);
@@ -121,157 +232,501 @@ void CursesTerminal::initialize_pty()
         std::cerr << "execlp failed: " << strerror(errno) << std::endl;
         exit(1);
     }
+
+    s.pty_fd    = pty_fd;
+    s.child_pid = child_pid;
+
+    // Reads from the child must not block the main loop.
+    if (fcntl(pty_fd, F_SETFL, fcntl(pty_fd, F_GETFL) | O_NONBLOCK) < 0) {
+        throw std::runtime_error(std::string("fcntl O_NONBLOCK failed: ") + strerror(errno));
+    }
 }
 
+//
+// Find out what colors the terminal has.
+//
 void CursesTerminal::initialize_colors()
 {
-    for (int fg = 0; fg < 8; ++fg) {
-        for (int bg = 0; bg < 8; ++bg) {
-            init_pair(fg * 8 + bg + 1, fg, bg);
-        }
+    if (!has_colors()) {
+        return;
     }
+    direct_color = (COLORS >= 0x1000000);
+    palette_size = (COLORS >= 256) ? 256 : (COLORS >= 16) ? 16 : 8;
+    pair_limit   = std::min(COLOR_PAIRS - 1, 0xffff);
+    color_table.assign(1 << 15, -1);
+    pair_colors.assign(1, 0); // Pair 0 is reserved by curses
+    pair_last_use.assign(1, 0);
 }
 
-static int get_color_index(const RgbColor &color)
+//
+// Number of the terminal color nearest to given one.
+// Palettes of 8 and 16 colors are the ANSI colors of AnsiLogic.
+//
+int CursesTerminal::get_host_color(const RgbColor &color)
 {
-    switch (color.r) {
-    case 0:
-        switch (color.g) {
-        case 0:
-            switch (color.b) {
-            case 0:
-                return 0; // 0, 0, 0 - Black
-            case 255:
-                return 4 + 8; // 0, 0, 255 - Bright Blue
-            default:
-                return 4; // 0, 0, 192 - Blue
-            }
-        case 255:
-            switch (color.b) {
-            case 0:
-                return 2 + 8; // 0, 255, 0 - Bright Green
-            case 255:
-                return 6 + 8; // 0, 255, 255 - Bright Cyan
-            default:
-                return 4; // ~ Cyan
-            }
-        default:
-            switch (color.b) {
-            case 0:
-                return 2; // 0, 192, 0 - Green
-            case 255:
-                return 4; // ~ Cyan
-            default:
-                return 6; // 0, 192, 192 - Cyan
-            }
+    if (direct_color) {
+        return color.r << 16 | color.g << 8 | color.b;
+    }
+    for (int index = 0; index < 16; ++index) {
+        if (AnsiLogic::palette_color(index) == color) {
+            return index; // ANSI colors as is
         }
-    case 255:
-        switch (color.g) {
-        case 0:
-            switch (color.b) {
-            case 0:
-                return 1 + 8; // 255, 0, 0 - Bright Red
-            case 255:
-                return 5 + 8; // 255, 0, 255 - Bright Magenta
-            default:
-                return 5; // ~ Magenta
+    }
+    int key       = (color.r >> 3) << 10 | (color.g >> 3) << 5 | (color.b >> 3);
+    int16_t &slot = color_table[key];
+    if (slot < 0) {
+        // Compare with middle of the cell of the table; green weighs more.
+        const int r = (color.r & ~7) | 4, g = (color.g & ~7) | 4, b = (color.b & ~7) | 4;
+        int best_distance = INT_MAX;
+        for (int index = 0; index < std::max(palette_size, 16); ++index) {
+            RgbColor entry = AnsiLogic::palette_color(index);
+            int distance   = 2 * (entry.r - r) * (entry.r - r) + 4 * (entry.g - g) * (entry.g - g) +
+                           3 * (entry.b - b) * (entry.b - b);
+            if (distance < best_distance) {
+                best_distance = distance;
+                slot          = index;
             }
-        case 255:
-            switch (color.b) {
-            case 0:
-                return 3 + 8; // 255, 255, 0 - Bright Yellow
-            case 255:
-                return 7 + 8; // 255, 255, 255 - Bright White
-            default:
-                return 3 + 8; // ~ Bright Yellow
+        }
+    }
+    return slot;
+}
+
+//
+// Get color pair for given curses colors, allocate when needed.
+// Return 0, default colors, when the terminal has no free pairs.
+//
+int CursesTerminal::get_color_pair(int fg, int bg)
+{
+    const uint64_t key = uint64_t(fg) << 32 | uint32_t(bg);
+    auto it            = pair_index.find(key);
+    if (it != pair_index.end()) {
+        pair_last_use[it->second] = frame_count;
+        return it->second;
+    }
+    if (free_pairs.empty() && int(pair_colors.size()) > pair_limit) {
+        release_color_pairs();
+    }
+
+    int pair;
+    if (!free_pairs.empty()) {
+        pair = free_pairs.back();
+        free_pairs.pop_back();
+    } else if (int(pair_colors.size()) <= pair_limit) {
+        pair = pair_colors.size();
+        pair_colors.push_back(0);
+        pair_last_use.push_back(0);
+    } else {
+        return 0;
+    }
+    if (init_extended_pair(pair, fg, bg) == ERR) {
+        free_pairs.push_back(pair);
+        return 0;
+    }
+    pair_index[key]     = pair;
+    pair_colors[pair]   = key;
+    pair_last_use[pair] = frame_count;
+    return pair;
+}
+
+//
+// Free color pairs which are not used by cells on the screen.
+// A quarter of all pairs are released at once, the oldest ones,
+// so that the screen is scanned rarely.
+// Pair reused with other colors would repaint all cells which have it,
+// so nothing is released while the shadow copy is not complete.
+//
+void CursesTerminal::release_color_pairs()
+{
+    if (redraw_all) {
+        return;
+    }
+    std::vector<bool> visible(pair_colors.size());
+    for (const Char &cell : shadow) {
+        if (cell != UNKNOWN_CELL && cell.attr < attr_cache.size() &&
+            attr_cache[cell.attr].pair > 0) {
+            visible[attr_cache[cell.attr].pair] = true;
+        }
+    }
+    std::vector<int> candidates;
+    for (int pair = 1; pair < int(pair_colors.size()); ++pair) {
+        if (!visible[pair] && frame_count - pair_last_use[pair] > 1) {
+            candidates.push_back(pair);
+        }
+    }
+    size_t count = std::min(candidates.size(), std::max<size_t>(1, pair_colors.size() / 4));
+    std::nth_element(candidates.begin(), candidates.begin() + count, candidates.end(),
+                     [this](int a, int b) { return pair_last_use[a] < pair_last_use[b]; });
+
+    std::vector<bool> released(pair_colors.size());
+    for (size_t i = 0; i < count; ++i) {
+        int pair = candidates[i];
+        pair_index.erase(pair_colors[pair]);
+        free_pairs.push_back(pair);
+        released[pair] = true;
+    }
+
+    // Cached attributes must not refer to released pairs.
+    for (CursesAttr &entry : attr_cache) {
+        if (entry.pair > 0 && released[entry.pair]) {
+            entry.pair = -1;
+        }
+    }
+}
+
+//
+// Compute curses attributes for given entry of the attribute table.
+// With eight colors, bright foreground is shown as bold.
+//
+const CursesTerminal::CursesAttr &CursesTerminal::update_attr_cache(uint16_t index)
+{
+    if (index >= attr_cache.size()) {
+        attr_cache.resize(std::max<size_t>(index + 1, attr_cache.size() * 2));
+    }
+    CursesAttr &entry = attr_cache[index];
+    entry.attr        = A_NORMAL;
+    entry.pair        = 0;
+    if (pair_limit > 0) {
+        int fg = get_host_color(frame_attrs[index].fg);
+        int bg = get_host_color(frame_attrs[index].bg);
+        if (palette_size == 8) {
+            entry.attr = (fg >= 8) ? A_BOLD : A_NORMAL;
+            fg %= 8;
+            bg %= 8;
+        }
+        entry.pair = get_color_pair(fg, bg);
+    }
+    return entry;
+}
+
+//
+// Read and parse available output of the child.
+// Return true when the screen may have changed.
+// When the child is gone, the session is marked closed.
+//
+bool CursesTerminal::read_pty(Session &s)
+{
+    //
+    // Drain everything the child has written so far. Reads are accumulated
+    // in the persistent buffer so that the parser gets few large chunks.
+    // The amount per wakeup is limited to keep the keyboard responsive
+    // when the child produces output faster than we can consume it.
+    //
+    const size_t limit = read_buffer.size() * MAX_BUFFERS_PER_WAKEUP;
+    size_t total       = 0;
+    Stats::add(Stats::PTY_WAKEUPS);
+    while (total < limit) {
+        size_t length    = 0;
+        bool would_block = false;
+        bool closed      = false;
+        while (length < read_buffer.size()) {
+            ssize_t bytes_read =
+                read(s.pty_fd, &read_buffer[length], read_buffer.size() - length);
+            if (bytes_read > 0) {
+                length += bytes_read;
+            } else if (bytes_read < 0 && errno == EINTR) {
+                continue;
+            } else {
+                would_block = (bytes_read < 0 && (errno == EAGAIN || errno == EWOULDBLOCK));
+                closed      = !would_block;
+                break;
             }
-        default:
-            switch (color.b) {
-            case 0:
-                return 3; // ~ Yellow (Brown)
-            case 255:
-                return 5 + 8; // ~ Bright Magenta
-            default:
-                return 1 + 8; // ~ Bright Red
+        }
+        if (length > 0) {
+            if (s.recorder) {
+                s.recorder->write_output(read_buffer.data(), length);
             }
+            StatsTimer timer(Stats::PARSE_TIME);
+            s.display.process_input(read_buffer.data(), length);
+            total += length;
         }
-    default:
-        switch (color.g) {
-        case 0:
-            switch (color.b) {
-            case 0:
-                return 1; // 192, 0, 0 - Red
-            case 255:
-                return 5; // ~ Magenta
-            default:
-                return 5; // 192, 0, 192 - Magenta
+        if (!s.display.get_reply().empty()) {
+            write_pty(s, s.display.get_reply());
+            s.display.clear_reply();
+        }
+        if (closed) {
+            s.closed = true;
+            break;
+        }
+        if (would_block) {
+            break;
+        }
+    }
+    Stats::add(Stats::PTY_BYTES, total);
+    Stats::record(Stats::BYTES_PER_WAKEUP, total);
+    return total > 0;
+}
+
+void CursesTerminal::get_poll_fds(std::vector<struct pollfd> &fds) const
+{
+    if (parser_thread.joinable()) {
+        fds.push_back({ notify_pipe[0], POLLIN, 0 });
+        return;
+    }
+    // One entry per session, in order. Negative fds are ignored by poll().
+    for (const auto &s : sessions) {
+        fds.push_back({ s->pty_fd, short(s->pending_input.empty() ? POLLIN : POLLIN | POLLOUT),
+                        0 });
+    }
+}
+
+void CursesTerminal::process_pty_input(const struct pollfd *fds, size_t count)
+{
+    if (!parser_thread.joinable()) {
+        // Background sessions are parsed, but only the active one needs drawing.
+        bool finished = false;
+        for (size_t i = 0; i < count && i < sessions.size(); ++i) {
+            Session &s = *sessions[i];
+            if (fds[i].revents & POLLOUT) {
+                flush_pty(s);
             }
-        case 255:
-            switch (color.b) {
-            case 0:
-                return 3 + 8; // ~ Bright Yellow
-            case 255:
-                return 6 + 8; // ~ Bright Cyan
-            default:
-                return 3 + 8; // ~ Bright Green
+            if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                continue;
             }
-        default:
-            switch (color.b) {
-            case 0:
-                return 3; // 192, 85, 0 - Yellow (Brown)
-            case 255:
-                return 4 + 8; // ~ Bright Blue
-            default:
-                return 7; // 192, 192, 192 - White (Light Gray)
+            if (read_pty(s) && &s == session) {
+                frame_pending = true;
             }
+            finished |= s.closed;
+        }
+        if (finished) {
+            close_finished_sessions();
         }
+        return;
+    }
+    if (count == 0 || !(fds[0].revents & POLLIN)) {
+        return;
     }
+
+    // Parser thread has published a new snapshot, or some session has finished.
+    char buf[64];
+    while (read(notify_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+    frame_pending = true;
+    if (parser_done && parser_error) {
+        std::rethrow_exception(parser_error);
+    }
+    close_finished_sessions();
 }
 
-int CursesTerminal::get_color_pair(const CharAttr &attr)
+void CursesTerminal::process_output(const char *data, size_t length)
 {
-    int fg = get_color_index(attr.fg);
-    int bg = get_color_index(attr.bg) % 8;
-    int pair = COLOR_PAIR(fg % 8 * 8 + bg + 1);
-    if (fg >= 8)
-        pair |= A_BOLD;
-    return pair;
+    session->display.process_input(data, length);
+    session->display.clear_reply();
+    frame_pending = true;
 }
 
-void CursesTerminal::process_pty_input()
+//
+// Write one byte to the pipe, to wake up the thread polling the other end.
+//
+static void wake_up(int fd)
+{
+    char c = 0;
+    if (write(fd, &c, 1) < 0) {
+        // Pipe is full: wakeup is already pending.
+    }
+}
+
+void CursesTerminal::start_parser_thread()
 {
-    fd_set read_fds;
-    FD_ZERO(&read_fds);
-    FD_SET(pty_fd, &read_fds);
+    for (int *fds : { notify_pipe, stop_pipe }) {
+        if (pipe(fds) < 0) {
+            std::cerr << "pipe failed: " << strerror(errno) << std::endl;
+            exit(1);
+        }
+        for (int i = 0; i < 2; ++i) {
+            fcntl(fds[i], F_SETFL, fcntl(fds[i], F_GETFL) | O_NONBLOCK);
+            fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+        }
+    }
+
+    // Start drawing from the current screen.
+    publish_snapshot();
+    snapshots.acquire();
+    drawn_scroll_count = snapshots.front().scroll_count;
+
+    parser_stop   = false;
+    parser_done   = false;
+    parser_thread = std::thread(&CursesTerminal::parser_loop, this);
+}
 
-    struct timeval timeout = { 0, 0 };
-    if (select(pty_fd + 1, &read_fds, nullptr, nullptr, &timeout) > 0) {
-        char buffer[1024];
-        ssize_t bytes_read = read(pty_fd, buffer, sizeof(buffer));
-        if (bytes_read > 0) {
-            std::vector<int> dirty_rows = display.process_input(buffer, bytes_read);
-            for (int row : dirty_rows) {
-                if (row >= 0 && static_cast<size_t>(row) < dirty_lines.size()) {
-                    dirty_lines[row] = true;
+void CursesTerminal::stop_parser_thread()
+{
+    if (!parser_thread.joinable()) {
+        return;
+    }
+    parser_stop = true;
+    wake_up(stop_pipe[1]);
+    parser_thread.join();
+
+    for (int fd : { notify_pipe[0], notify_pipe[1], stop_pipe[0], stop_pipe[1] }) {
+        close(fd);
+    }
+}
+
+//
+// Body of parser thread: drain PTYs of all sessions as fast as the children write,
+// independently of how fast the screen can be drawn.
+// Every batch of output of the active session is published as a snapshot
+// for the main thread. Main thread is also woken up when a session has finished.
+//
+void CursesTerminal::parser_loop()
+{
+    std::vector<struct pollfd> fds;
+    try {
+        while (!parser_stop) {
+            // Sessions may come and go while we sleep: the list is made anew every time.
+            fds.clear();
+            fds.push_back({ stop_pipe[0], POLLIN, 0 });
+            {
+                std::lock_guard<std::mutex> lock(display_mutex);
+                for (const auto &s : sessions) {
+                    if (!s->closed) {
+                        fds.push_back({ s->pty_fd,
+                                        short(s->pending_input.empty() ? POLLIN : POLLIN | POLLOUT),
+                                        0 });
+                    }
                 }
             }
-        } else {
-            throw std::runtime_error("PTY closed: child process terminated");
+            if (poll(fds.data(), fds.size(), -1) < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
+            }
+            if (fds[0].revents & POLLIN) {
+                char buf[64];
+                while (read(stop_pipe[0], buf, sizeof(buf)) > 0) {
+                }
+            }
+
+            std::lock_guard<std::mutex> lock(display_mutex);
+            bool changed  = false;
+            bool finished = false;
+            for (const auto &s : sessions) {
+                auto entry = std::find_if(fds.begin() + 1, fds.end(), [&](const pollfd &pfd) {
+                    return pfd.fd == s->pty_fd;
+                });
+                if (s->closed || entry == fds.end()) {
+                    continue;
+                }
+                if (entry->revents & POLLOUT) {
+                    flush_pty(*s);
+                }
+                if (!(entry->revents & (POLLIN | POLLHUP | POLLERR))) {
+                    continue;
+                }
+                if (read_pty(*s) && s.get() == session) {
+                    changed = true;
+                }
+                finished |= s->closed;
+            }
+            if (changed) {
+                publish_snapshot();
+            }
+            if (changed || finished) {
+                wake_up(notify_pipe[1]);
+            }
         }
+    } catch (...) {
+        parser_error = std::current_exception();
     }
+    parser_done = true;
+    wake_up(notify_pipe[1]);
 }
 
+//
+// Pass current screen to the renderer.
+// Caller must hold display_mutex: the back slot belongs to whoever holds it.
+//
+void CursesTerminal::publish_snapshot()
+{
+    session->display.take_snapshot(snapshots.back());
+    snapshots.publish();
+
+    // Renderer compares snapshots with its shadow copy instead.
+    session->display.clear_dirty();
+}
+
+//
+// Handle all keys which have arrived. Input for the application is collected
+// and written with one call; a paste is held until its end.
+//
 void CursesTerminal::process_keyboard_input()
 {
-    wint_t ch;
-    int status = get_wch(&ch);
-    if (status == ERR)
+    for (;;) {
+        wint_t ch;
+        int status = get_wch(&ch);
+        if (status == ERR) {
+            break;
+        }
+        process_key_event(status, ch);
+    }
+    if (!pasting || keyboard_output.size() >= MAX_PENDING_INPUT) {
+        flush_keyboard_output();
+    }
+}
+
+void CursesTerminal::process_key_event(int status, wint_t ch)
+{
+    if (status == KEY_CODE_YES && (ch == KEY_PASTE_BEGIN || ch == KEY_PASTE_END)) {
+        pasting = (ch == KEY_PASTE_BEGIN);
+        if (pasting && view_active) {
+            scroll_view(INT_MAX);
+        }
+        std::lock_guard<std::mutex> lock(display_mutex);
+        if (session->display.is_bracketed_paste()) {
+            keyboard_output += pasting ? "\033[200~" : "\033[201~";
+        }
+        return;
+    }
+    if (pasting) {
+        translate_key(status, ch);
         return;
+    }
+    if (session_prefix) {
+        session_prefix = false;
 
+        // Input typed so far goes to the session it was typed in.
+        flush_keyboard_output();
+        if (process_session_key(status, ch)) {
+            return;
+        }
+    } else if (status == OK && ch == CTRL_B) {
+        session_prefix = true;
+        return;
+    }
+    if (status == KEY_CODE_YES && ch == KEY_F(24)) {
+        // Shift+F12: show or hide statistics.
+        toggle_stats_overlay();
+        return;
+    }
+    if (status == KEY_CODE_YES && (ch == KEY_SPREVIOUS || ch == KEY_SNEXT)) {
+        // Shift+PageUp/PageDown: browse history, keeping one line of context.
+        int page = std::max(1, get_rows() - 1);
+        scroll_view(ch == KEY_SPREVIOUS ? -page : page);
+        return;
+    }
+    if (view_active && process_view_key(status, ch)) {
+        return;
+    }
+    if (view_active && ch != KEY_RESIZE) {
+        // Typing returns to the live screen.
+        scroll_view(INT_MAX);
+    }
+    translate_key(status, ch);
+}
+
+//
+// Append input for the application, as sent by the key.
+//
+void CursesTerminal::translate_key(int status, wint_t ch)
+{
     KeyInput key;
     key.character = ch;
 
     switch (ch) {
+    case KEY_RESIZE:
+        // Queued by resizeterm(); the resize itself is handled by the main loop.
+        return;
     case KEY_ENTER:
         key.code = KeyCode::ENTER;
         break;
@@ -279,30 +734,57 @@ void CursesTerminal::process_keyboard_input()
     case KEY_BACKSPACE:
         key.code = KeyCode::BACKSPACE;
         break;
+    case KEY_BTAB:
+        key = KeyInput(KeyCode::TAB, true);
+        break;
     case KEY_UP:
         key.code = KeyCode::UP;
         break;
+    case KEY_SR:
+        key = KeyInput(KeyCode::UP, true);
+        break;
     case KEY_DOWN:
         key.code = KeyCode::DOWN;
         break;
+    case KEY_SF:
+        key = KeyInput(KeyCode::DOWN, true);
+        break;
     case KEY_RIGHT:
         key.code = KeyCode::RIGHT;
         break;
+    case KEY_SRIGHT:
+        key = KeyInput(KeyCode::RIGHT, true);
+        break;
     case KEY_LEFT:
         key.code = KeyCode::LEFT;
         break;
+    case KEY_SLEFT:
+        key = KeyInput(KeyCode::LEFT, true);
+        break;
     case KEY_HOME:
         key.code = KeyCode::HOME;
         break;
+    case KEY_SHOME:
+        key = KeyInput(KeyCode::HOME, true);
+        break;
     case KEY_END:
         key.code = KeyCode::END;
         break;
+    case KEY_SEND:
+        key = KeyInput(KeyCode::END, true);
+        break;
     case KEY_IC:
         key.code = KeyCode::INSERT;
         break;
+    case KEY_SIC:
+        key = KeyInput(KeyCode::INSERT, true);
+        break;
     case KEY_DC:
         key.code = KeyCode::DELETE;
         break;
+    case KEY_SDC:
+        key = KeyInput(KeyCode::DELETE, true);
+        break;
     case KEY_PPAGE:
         key.code = KeyCode::PAGEUP;
         break;
@@ -346,6 +828,17 @@ void CursesTerminal::process_keyboard_input()
         key.code = KeyCode::F12;
         break;
     default:
+        if (status == KEY_CODE_YES && ch < modified_keys.size() &&
+            modified_keys[ch].code != KeyCode::UNKNOWN) {
+            key = modified_keys[ch];
+            break;
+        }
+        if (status == KEY_CODE_YES && ch >= KEY_F(13) && ch <= KEY_F(36)) {
+            // Xterm reports Shift+F1..F12 as F13..F24, and Ctrl+F1..F12 as F25..F36.
+            const bool shift = ch <= KEY_F(24);
+            key = KeyInput(KeyCode(int(KeyCode::F1) + (ch - KEY_F(13)) % 12), shift, !shift);
+            break;
+        }
         key.code = KeyCode::CHARACTER;
         if (ch < ' ') {
             // Handle control characters (ASCII 0x00–0x1F).
@@ -355,74 +848,931 @@ void CursesTerminal::process_keyboard_input()
         break;
     }
 
-    std::string input = display.process_key(key);
-    if (!input.empty()) {
-        if (write(pty_fd, input.c_str(), input.size()) < 0) {
-            throw std::runtime_error("PTY closed: child process terminated");
+    std::lock_guard<std::mutex> lock(display_mutex);
+    session->display.process_key(key, keyboard_output);
+}
+
+void CursesTerminal::flush_keyboard_output()
+{
+    if (keyboard_output.empty()) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(display_mutex);
+    write_pty(*session, keyboard_output);
+    keyboard_output.clear();
+    if (!session->pending_input.empty() && parser_thread.joinable()) {
+        // Parser thread owns polling of the PTYs: let it wait for room.
+        wake_up(stop_pipe[1]);
+    }
+}
+
+//
+// Key after Ctrl+B. Return false when it should go to the application.
+//
+bool CursesTerminal::process_session_key(int status, wint_t ch)
+{
+    if (status != OK) {
+        return true;
+    }
+    switch (ch) {
+    case CTRL_B:
+        return false;
+    case 'c':
+        try {
+            new_session();
+        } catch (const std::runtime_error &) {
+            beep();
         }
+        break;
+    case 'n':
+    case 'p': {
+        size_t index = std::find_if(sessions.begin(), sessions.end(),
+                                    [this](const auto &s) { return s.get() == session; }) -
+                       sessions.begin();
+        size_t count = sessions.size();
+        select_session((ch == 'n') ? (index + 1) % count : (index + count - 1) % count);
+        break;
     }
+    default:
+        if (ch >= '0' && ch <= '9') {
+            select_session(ch - '0');
+        }
+        break;
+    }
+    return true;
 }
 
-void CursesTerminal::render_frame()
+void CursesTerminal::new_session()
 {
-    const auto &text_buffer = display.get_text_buffer();
-    for (size_t row = 0; row < text_buffer.size(); ++row) {
-        if (!dirty_lines[row])
-            continue;
-        dirty_lines[row] = false;
+    auto s = std::make_unique<Session>(get_cols(), get_rows());
+    s->display.get_scrollback().set_limit(scrollback_limit);
+    if (!spill_directory.empty() && !s->display.get_scrollback().enable_spill(spill_directory)) {
+        throw std::runtime_error("Cannot create spill file in " + spill_directory + ": " +
+                                 strerror(errno));
+    }
+    initialize_pty(*s);
+
+    std::lock_guard<std::mutex> lock(display_mutex);
+    sessions.push_back(std::move(s));
+    show_session(sessions.back().get());
+    if (parser_thread.joinable()) {
+        wake_up(stop_pipe[1]); // Poll the new PTY
+    }
+}
 
-        move(row, 0);
-        clrtoeol();
+void CursesTerminal::select_session(size_t index)
+{
+    if (index >= sessions.size() || sessions[index].get() == session) {
+        return;
+    }
+    std::lock_guard<std::mutex> lock(display_mutex);
+    show_session(sessions[index].get());
+}
 
-        std::wstring current_text;
-        CharAttr current_attr = text_buffer[row][0].attr;
-        int start_col         = 0;
+//
+// Make the session active, and draw it from scratch.
+// Caller must hold display_mutex.
+//
+void CursesTerminal::show_session(Session *s)
+{
+    session       = s;
+    view_active   = false;
+    search_prompt = false;
+    invalidate_frame(); // Attribute indices belong to another screen
+    frame_pending = true;
+    if (parser_thread.joinable()) {
+        publish_snapshot();
+        snapshots.acquire();
+        drawn_scroll_count = snapshots.front().scroll_count;
+    }
+}
 
-        for (int col = 0; col < display.get_cols(); ++col) {
-            const Char &ch = text_buffer[row][col];
-            if (ch.attr == current_attr && col < display.get_cols() - 1) {
-                current_text += ch.ch;
-            } else {
-                if (!current_text.empty()) {
-                    attron(get_color_pair(current_attr));
-                    mvaddwstr(row, start_col, current_text.c_str());
-                    attroff(get_color_pair(current_attr));
+//
+// Remove sessions whose children have finished.
+// When the active one is gone, show the next one. Throw when none is left.
+// Children are reaped and PTYs closed without the lock, and with the parser
+// thread stopped, so that it does not poll descriptors being closed.
+//
+void CursesTerminal::close_finished_sessions()
+{
+    std::vector<std::unique_ptr<Session>> finished;
+    bool removed = false;
+    {
+        std::lock_guard<std::mutex> lock(display_mutex);
+        size_t active = 0;
+        for (size_t i = 0; i < sessions.size();) {
+            Session &s = *sessions[i];
+            if (!s.closed) {
+                if (&s == session) {
+                    active = i;
                 }
-                current_text = ch.ch;
-                current_attr = ch.attr;
-                start_col    = col;
+                ++i;
+                continue;
+            }
+            if (&s == session) {
+                active  = i;
+                removed = true;
             }
+            finished.push_back(std::move(sessions[i]));
+            sessions.erase(sessions.begin() + i);
         }
-        if (!current_text.empty()) {
-            attron(get_color_pair(current_attr));
-            mvaddwstr(row, start_col, current_text.c_str());
-            attroff(get_color_pair(current_attr));
+        if (finished.empty()) {
+            return;
+        }
+        if (sessions.empty()) {
+            session = nullptr;
+        } else if (removed) {
+            session = sessions[std::min(active, sessions.size() - 1)].get();
+        }
+    }
+
+    const bool threaded = parser_thread.joinable();
+    stop_parser_thread();
+    for (auto &s : finished) {
+        close_pty(s->pty_fd, s->child_pid);
+        stop_recording(*s);
+    }
+    finished.clear();
+    if (!session) {
+        throw std::runtime_error("PTY closed: child process terminated");
+    }
+    if (threaded) {
+        start_parser_thread();
+    }
+    if (removed) {
+        std::lock_guard<std::mutex> lock(display_mutex);
+        show_session(session);
+    }
+}
+
+//
+// Write as much as the PTY takes without blocking.
+// Return number of bytes written. On errors the data are dropped:
+// child has gone away, and the session is closed when reading the PTY fails.
+//
+static size_t write_some(int fd, const char *data, size_t length)
+{
+    size_t written = 0;
+    while (written < length) {
+        ssize_t bytes = write(fd, data + written, length - written);
+        if (bytes > 0) {
+            written += bytes;
+        } else if (bytes < 0 && errno == EINTR) {
+            continue;
+        } else if (bytes < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            break;
+        } else {
+            return length;
         }
     }
+    return written;
+}
 
-    const Cursor &cursor = display.get_cursor();
-    if (cursor.row >= 0 && cursor.row < static_cast<int>(text_buffer.size()) && cursor.col >= 0 &&
-        cursor.col < display.get_cols()) {
+//
+// Send input to the child. What the PTY does not take now is queued,
+// and written when poll() reports room for it.
+//
+void CursesTerminal::write_pty(Session &s, const std::string &data)
+{
+    size_t written = 0;
+    if (s.pending_input.empty()) {
+        written = write_some(s.pty_fd, data.data(), data.size());
+    }
+    size_t room = MAX_PENDING_INPUT - std::min(MAX_PENDING_INPUT, s.pending_input.size());
+    s.pending_input.append(data, written, room);
+}
+
+void CursesTerminal::flush_pty(Session &s)
+{
+    size_t written = write_some(s.pty_fd, s.pending_input.data(), s.pending_input.size());
+    s.pending_input.erase(0, written);
+}
+
+//
+// Draw accumulated changes, when the next frame is due.
+// A frame is drawn right away when input arrives after a pause,
+// while a flood of output is coalesced into one frame per interval.
+// Frame is held while the application is in synchronized update,
+// but not longer than SYNC_UPDATE_TIMEOUT.
+// Return timeout in milliseconds for poll() until the pending frame is due,
+// or -1 when there is nothing to draw.
+//
+int CursesTerminal::update_display()
+{
+    int timeout = -1;
+    if (resize_pending) {
+        Clock::time_point now = Clock::now();
+        if (now < resize_due) {
+            timeout = std::chrono::ceil<std::chrono::milliseconds>(resize_due - now).count();
+        } else {
+            resize_pending = false;
+            if (resize_cols != get_cols() || resize_rows != get_rows()) {
+                resize(resize_cols, resize_rows);
+            }
+        }
+    }
+    if (stats_overlay || stats_file) {
+        Clock::time_point now = Clock::now();
+        if (now >= stats_time + STATS_INTERVAL) {
+            update_stats(now);
+        }
+        int wait =
+            std::chrono::ceil<std::chrono::milliseconds>(stats_time + STATS_INTERVAL - now).count();
+        timeout = (timeout < 0) ? wait : std::min(timeout, wait);
+    }
+    if (!frame_pending) {
+        return timeout;
+    }
+    bool sync_update;
+    if (parser_thread.joinable()) {
+        snapshots.acquire();
+        sync_update = snapshots.front().sync_update;
+    } else {
+        sync_update = session->display.is_synchronized_update();
+    }
+
+    Clock::time_point now = Clock::now();
+    Clock::time_point due = last_frame + frame_interval;
+    if (!sync_update) {
+        sync_active = false;
+    } else {
+        if (!sync_active) {
+            sync_active = true;
+            sync_start  = now;
+        }
+        due = std::max(due, sync_start + SYNC_UPDATE_TIMEOUT);
+    }
+    if (now < due) {
+        int wait = std::chrono::ceil<std::chrono::milliseconds>(due - now).count();
+        return (timeout < 0) ? wait : std::min(timeout, wait);
+    }
+    render_frame();
+    return timeout;
+}
+
+void CursesTerminal::render_frame()
+{
+    StatsTimer timer(Stats::RENDER_TIME);
+    if (view_active) {
+        render_view();
+        return;
+    }
+    if (parser_thread.joinable()) {
+        snapshots.acquire();
+        render_snapshot(snapshots.front());
+        return;
+    }
+
+    AnsiLogic &display = session->display;
+    const int rows     = display.get_rows();
+    begin_frame(rows, display.get_cols(), display.get_attr_generation(), &display.get_attr(0),
+                display.get_combined_table().data());
+    if (!redraw_all) {
+        for (const ScrollEvent &event : display.get_pending_scrolls()) {
+            scroll_frame(event.top, event.bottom, event.lines);
+        }
+    }
+    if (redraw_all) {
+        for (int row = 0; row < rows; ++row) {
+            draw_row(row, display.get_row(row), 0, display.get_cols() - 1);
+        }
+    } else {
+        for (int row = display.next_dirty_row(0); row < rows;
+             row = display.next_dirty_row(row + 1)) {
+            const DirtySpan &span = display.get_dirty_span(row);
+            draw_row(row, display.get_row(row), span.first_col, span.last_col);
+        }
+    }
+    display.clear_dirty();
+    end_frame(display.get_cursor());
+}
+
+//
+// Draw snapshot from the parser thread.
+// Dirty state is not known, so all rows are compared with the shadow copy.
+//
+void CursesTerminal::render_snapshot(const ScreenSnapshot &snap)
+{
+    begin_frame(snap.rows, snap.cols, snap.attr_generation, snap.attrs.data(),
+                snap.combined.data());
+    uint64_t scroll = snap.scroll_count - drawn_scroll_count;
+    if (scroll < uint64_t(snap.rows)) {
+        scroll_frame(0, snap.rows - 1, scroll);
+    }
+    drawn_scroll_count = snap.scroll_count;
+
+    for (int row = 0; row < snap.rows; ++row) {
+        draw_row(row, &snap.cells[row * snap.cols], 0, snap.cols - 1);
+    }
+    end_frame(snap.cursor);
+}
+
+void CursesTerminal::begin_frame(int rows, int cols, unsigned attr_generation,
+                                 const CharAttr *attrs, const wchar_t *combined)
+{
+    // Every cell may have a base character with combining marks.
+    const size_t text_size = cols * (1 + AnsiLogic::MAX_COMBINING_MARKS);
+    if (shadow.size() != size_t(rows * cols) || scratch.size() != text_size) {
+        // Screen was resized: contents of curses window are not known.
+        shadow.assign(rows * cols, UNKNOWN_CELL);
+        scratch.resize(text_size);
+        redraw_all = true;
+    }
+    if (attr_cache_generation != attr_generation) {
+        // Attribute table was renumbered: attributes in shadow copy are stale.
+        attr_cache.clear();
+        attr_cache_generation = attr_generation;
+        std::fill(shadow.begin(), shadow.end(), UNKNOWN_CELL);
+        redraw_all = true;
+    }
+    frame_rows        = rows;
+    frame_cols        = cols;
+    frame_attrs       = attrs;
+    frame_combined    = combined;
+    frame_rows_drawn  = 0;
+    frame_cells_drawn = 0;
+    frame_count++;
+}
+
+//
+// Let curses shift lines [top, bottom] up, or down when the number is negative,
+// so it can use the terminal scroll capability. Shadow copy is moved the same way.
+// Lines which appear are filled by curses with its background, so they are unknown.
+//
+void CursesTerminal::scroll_frame(int top, int bottom, int lines)
+{
+    bottom = std::min(bottom, frame_rows - 1);
+    if (lines == 0 || top < 0 || std::abs(lines) > bottom - top) {
+        return; // Whole region gets repainted anyway
+    }
+    setscrreg(top, bottom);
+    scrollok(stdscr, TRUE);
+    wscrl(stdscr, lines);
+    scrollok(stdscr, FALSE);
+    setscrreg(0, frame_rows - 1);
+
+    auto first         = shadow.begin() + top * frame_cols;
+    auto last          = shadow.begin() + (bottom + 1) * frame_cols;
+    const size_t shift = std::abs(lines) * frame_cols;
+    if (lines > 0) {
+        std::move(first + shift, last, first);
+        std::fill(last - shift, last, UNKNOWN_CELL);
+    } else {
+        std::move_backward(first, last - shift, last);
+        std::fill(first, first + shift, UNKNOWN_CELL);
+    }
+}
+
+//
+// Send to curses the cells in given range of columns which differ from
+// the shadow copy. Changed cells are drawn in runs of same attribute.
+//
+void CursesTerminal::draw_row(int row, const Char *line, int first_col, int last_col)
+{
+    Char *drawn      = &shadow[row * frame_cols];
+    last_col         = std::min(last_col, frame_cols - 1);
+    const int before = frame_cells_drawn;
+
+    for (int col = std::max(first_col, 0); col <= last_col;) {
+        if (line[col] == drawn[col]) {
+            ++col;
+            continue;
+        }
+        // Right half of a wide character is drawn along with the left one.
+        const int start_col = (line[col].is_spacer() && col > 0 && !line[col - 1].is_spacer())
+                                  ? col - 1
+                                  : col;
+
+        // Find end of the run: same attribute, no long stretch of unchanged cells.
+        const uint16_t attr = line[start_col].attr;
+        int end_col         = col + 1;
+        for (int c = end_col; c <= last_col && line[c].attr == attr && c - end_col < MAX_REDRAW_GAP;
+             ++c) {
+            if (line[c] != drawn[c]) {
+                end_col = c + 1;
+            }
+        }
+
+        int length = 0;
+        for (col = start_col; col < end_col; ++col) {
+            const Char &cell = line[col];
+            drawn[col]       = cell;
+            if (cell.is_combined()) {
+                for (const wchar_t *p = &frame_combined[cell.ch - Char::COMBINED]; *p; ++p) {
+                    scratch[length++] = *p;
+                }
+            } else if (!cell.is_spacer()) {
+                scratch[length++] = cell.ch;
+            } else if (col == 0 || line[col - 1].is_spacer()) {
+                scratch[length++] = L' '; // Spacer without its wide character
+            }
+        }
+        const CursesAttr &rendition = get_curses_attr(attr);
+        mark_pair_used(rendition.pair);
+        attr_set(rendition.attr, 0, const_cast<int *>(&rendition.pair));
+        mvaddnwstr(row, start_col, scratch.data(), length);
+        frame_cells_drawn += end_col - start_col;
+    }
+    if (frame_cells_drawn != before) {
+        frame_rows_drawn++;
+    }
+}
+
+void CursesTerminal::end_frame(const Cursor &cursor)
+{
+    if (stats_overlay) {
+        draw_stats_overlay();
+    }
+    Stats::add(Stats::FRAMES);
+    Stats::add(Stats::ROWS_DRAWN, frame_rows_drawn);
+    Stats::add(Stats::CELLS_DRAWN, frame_cells_drawn);
+    Stats::record(Stats::ROWS_PER_FRAME, frame_rows_drawn);
+
+    attrset(A_NORMAL);
+    if (cursor.row >= 0 && cursor.row < frame_rows && cursor.col >= 0 && cursor.col < frame_cols) {
         move(cursor.row, cursor.col);
         curs_set(1);
     } else {
         curs_set(0);
     }
 
-    refresh();
+    {
+        StatsTimer timer(Stats::REFRESH_TIME);
+        refresh();
+    }
+    last_frame    = Clock::now();
+    frame_pending = false;
+    redraw_all    = false;
+}
+
+//
+// Forget what is on the screen: attribute indices are about to change meaning.
+//
+void CursesTerminal::invalidate_frame()
+{
+    attr_cache.clear();
+    std::fill(shadow.begin(), shadow.end(), UNKNOWN_CELL);
+    redraw_all = true;
+}
+
+void CursesTerminal::set_scrollback_limit(size_t bytes)
+{
+    std::lock_guard<std::mutex> lock(display_mutex);
+    scrollback_limit = bytes;
+    for (auto &s : sessions) {
+        s->display.get_scrollback().set_limit(bytes);
+    }
+}
+
+void CursesTerminal::start_recording(const std::string &path)
+{
+    std::lock_guard<std::mutex> lock(display_mutex);
+    auto file = std::make_unique<Recorder>();
+    if (!file->open(path, session->display.get_cols(), session->display.get_rows())) {
+        throw std::runtime_error("Cannot create " + path + ": " + strerror(errno));
+    }
+    session->recorder = std::move(file);
+}
+
+//
+// Write the rest of the recording and close it.
+// Dropped data are remembered: the screen belongs to curses yet.
+//
+void CursesTerminal::stop_recording(Session &s)
+{
+    if (!s.recorder) {
+        return;
+    }
+    s.recorder->close();
+    if (s.recorder->has_failed()) {
+        recording_errors.push_back("Recording is incomplete: " +
+                                   std::to_string(s.recorder->get_dropped_bytes()) +
+                                   " bytes were dropped");
+    }
+    s.recorder.reset();
+}
+
+void CursesTerminal::set_stats_file(const std::string &path)
+{
+    stats_file = fopen(path.c_str(), "a");
+    if (!stats_file) {
+        throw std::runtime_error("Cannot open " + path + ": " + strerror(errno));
+    }
+    stats_time = Clock::now();
+    Stats::collect(stats_last);
+}
+
+void CursesTerminal::set_scrollback_spill(const std::string &directory)
+{
+    std::lock_guard<std::mutex> lock(display_mutex);
+    spill_directory = directory;
+    for (auto &s : sessions) {
+        if (!s->display.get_scrollback().enable_spill(directory)) {
+            throw std::runtime_error("Cannot create spill file in " + directory + ": " +
+                                     strerror(errno));
+        }
+    }
+}
+
+//
+// Move the view through history by given number of lines:
+// negative towards older lines. View ends when it reaches the live screen.
+//
+void CursesTerminal::scroll_view(int lines)
+{
+    std::lock_guard<std::mutex> lock(display_mutex);
+    Scrollback &history = session->display.get_scrollback();
+    if (!view_active) {
+        // History is laid out for the current width only when it is viewed.
+        history.rewrap(session->display.get_cols());
+    }
+
+    uint64_t top = view_active ? std::max(view_top, history.begin()) : history.end();
+    if (lines < 0) {
+        top -= std::min<uint64_t>(top - history.begin(), -int64_t(lines));
+    } else {
+        top = std::min<uint64_t>(top + lines, history.end());
+    }
+
+    bool active = (top < history.end());
+    if (active != view_active) {
+        // View frames have their own attribute table.
+        invalidate_frame();
+        view_attrs.clear();
+        view_attr_index.clear();
+        search_prompt = false;
+        match_found   = false;
+    }
+    view_active   = active;
+    view_top      = top;
+    frame_pending = true;
+}
+
+//
+// Handle keys specific to the view: search prompt, and search commands.
+// Return false when the key should go to the shell.
+//
+bool CursesTerminal::process_view_key(int status, wint_t ch)
+{
+    if (search_prompt) {
+        if (ch == '\r' || ch == '\n' || (status == KEY_CODE_YES && ch == KEY_ENTER)) {
+            search_prompt = false;
+        } else if (ch == '\033') {
+            // Cancel: back to where the search started.
+            search_prompt = false;
+            match_found   = false;
+            search_text.clear();
+            view_top = search_origin_top;
+        } else if (ch == 127 || ch == '\b' || (status == KEY_CODE_YES && ch == KEY_BACKSPACE)) {
+            if (!search_text.empty()) {
+                search_text.pop_back();
+                search_view(search_origin, true);
+            }
+        } else if (status == OK && ch >= ' ') {
+            search_text += wchar_t(ch);
+            search_view(search_origin, true);
+        }
+        frame_pending = true;
+        return true;
+    }
+    if (status != OK) {
+        return false;
+    }
+    if (ch == '/') {
+        search_prompt     = true;
+        search_origin     = view_top + get_rows() - 1;
+        search_origin_top = view_top;
+        match_found       = false;
+        search_text.clear();
+        frame_pending = true;
+        return true;
+    }
+    if ((ch == 'n' || ch == 'N') && !search_text.empty()) {
+        if (!match_found) {
+            search_view(search_origin, ch == 'n');
+        } else if (ch == 'n' && match_line > 0) {
+            search_view(match_line - 1, true);
+        } else if (ch == 'N') {
+            search_view(match_line + 1, false);
+        }
+        frame_pending = true;
+        return true;
+    }
+    return false;
+}
+
+//
+// Find search text in history and the live screen, starting from given line.
+// Move the view to show the match.
+//
+void CursesTerminal::search_view(uint64_t from, bool backward)
+{
+    std::lock_guard<std::mutex> lock(display_mutex);
+    const AnsiLogic &display  = session->display;
+    const Scrollback &history = display.get_scrollback();
+    const int rows            = display.get_rows();
+    const int cols            = display.get_cols();
+    const uint64_t live       = history.end();
+
+    // Lines of the live screen follow the history.
+    auto search_screen = [&](uint64_t start, uint64_t &found_line, int &found_col) {
+        view_line_text.resize(cols);
+        for (uint64_t line = start; line >= live && line < live + rows;
+             backward ? --line : ++line) {
+            const Char *in = display.get_row(line - live);
+            for (int col = 0; col < cols; ++col) {
+                view_line_text[col] = in[col].ch;
+            }
+            found_col = Scrollback::find_text(view_line_text.data(), cols, search_text);
+            if (found_col >= 0) {
+                found_line = line;
+                return true;
+            }
+        }
+        return false;
+    };
+
+    uint64_t line = 0;
+    int col       = 0;
+    if (backward) {
+        match_found = search_screen(std::min(from, live + rows - 1), line, col) ||
+                      history.search(search_text, from, true, line, col);
+    } else {
+        match_found = history.search(search_text, from, false, line, col) ||
+                      search_screen(std::max(from, live), line, col);
+    }
+    if (!match_found) {
+        return;
+    }
+    match_line = line;
+    match_col  = col;
+
+    // Bring the match into view, in the middle of the screen if it was away.
+    const int visible = search_prompt ? rows - 1 : rows;
+    if (match_line < view_top || match_line >= view_top + visible) {
+        uint64_t top = (match_line > uint64_t(visible / 2)) ? match_line - visible / 2 : 0;
+        view_top     = std::min(std::max(top, history.begin()), live);
+    }
+}
+
+//
+// Get index of attribute in the table of the view.
+//
+uint16_t CursesTerminal::get_view_attr(const CharAttr &attr)
+{
+    auto it = view_attr_index.find(attr.key());
+    if (it != view_attr_index.end()) {
+        return it->second;
+    }
+    if (view_attrs.size() >= 65536) {
+        return 0; // Table full: rather unlikely
+    }
+    uint16_t index = view_attrs.size();
+    view_attrs.push_back(attr);
+    view_attr_index.emplace(attr.key(), index);
+    return index;
+}
+
+//
+// Draw lines from history, followed by top of the live screen.
+// Only lines in the view are decoded.
+//
+void CursesTerminal::render_view()
+{
+    std::unique_lock<std::mutex> lock(display_mutex);
+    const AnsiLogic &display  = session->display;
+    const Scrollback &history = display.get_scrollback();
+    const int rows            = display.get_rows();
+    const int cols            = display.get_cols();
+
+    // Oldest lines may have been discarded meanwhile.
+    view_top = std::max(view_top, history.begin());
+
+    view_cells.resize(rows * cols);
+    view_line_text.resize(cols);
+    const std::vector<wchar_t> &combined = display.get_combined_table();
+    if (view_combined_version != display.get_combined_version() ||
+        view_combined_size > combined.size()) {
+        view_combined.assign(combined.begin(), combined.end());
+        view_combined_version = display.get_combined_version();
+    } else {
+        // Same version: the table was only appended to.
+        view_combined.resize(view_combined_size);
+        view_combined.insert(view_combined.end(), combined.begin() + view_combined_size,
+                             combined.end());
+    }
+    view_combined_size = combined.size();
+    view_line_attrs.resize(cols);
+    for (int row = 0; row < rows; ++row) {
+        Char *out     = &view_cells[row * cols];
+        uint64_t line = view_top + row;
+        if (line < history.end()) {
+            history.read_line(line, view_line_text.data(), view_line_attrs.data(), cols,
+                              &view_combined);
+            for (int col = 0; col < cols; ++col) {
+                out[col] = { view_line_text[col], get_view_attr(view_line_attrs[col]) };
+            }
+        } else {
+            const Char *in = display.get_row(line - history.end());
+            for (int col = 0; col < cols; ++col) {
+                out[col] = { in[col].ch, get_view_attr(display.get_attr(in[col].attr)) };
+            }
+        }
+    }
+
+    // Show cursor when it's in the visible part of the live screen.
+    Cursor cursor     = display.get_cursor();
+    uint64_t distance = history.end() - view_top;
+    cursor.row        = (distance < uint64_t(rows)) ? cursor.row + int(distance) : -1;
+    lock.unlock();
+
+    // Highlight the match.
+    if (match_found && match_line >= view_top && match_line - view_top < uint64_t(rows)) {
+        Char *out           = &view_cells[(match_line - view_top) * cols];
+        const uint16_t attr = get_view_attr({ { 0, 0, 0 }, { 192, 85, 0 } }); // Black on yellow
+        // Wide characters take two cells for one character of the text.
+        int count = 0;
+        for (int col = match_col;
+             col < cols && (count < int(search_text.size()) || out[col].is_spacer()); ++col) {
+            count += !out[col].is_spacer();
+            out[col].attr = attr;
+        }
+    }
+
+    // Prompt on the bottom line.
+    if (search_prompt) {
+        std::wstring prompt = L"/" + search_text;
+        if (!search_text.empty() && !match_found) {
+            prompt += L"  (not found)";
+        }
+        Char *out = &view_cells[(rows - 1) * cols];
+        for (int col = 0; col < cols; ++col) {
+            out[col] = { col < int(prompt.size()) ? prompt[col] : L' ', get_view_attr(CharAttr()) };
+        }
+        cursor = { rows - 1, std::min<int>(search_text.size() + 1, cols - 1) };
+    }
+
+    begin_frame(rows, cols, attr_cache_generation, view_attrs.data(), view_combined.data());
+    for (int row = 0; row < rows; ++row) {
+        draw_row(row, &view_cells[row * cols], 0, cols - 1);
+    }
+    end_frame(cursor);
+}
+
+//
+// Window managers send bursts of size changes while the window is dragged.
+// Resize only when the size settles, or once per RESIZE_MAX_DELAY at least.
+//
+void CursesTerminal::request_resize(int new_cols, int new_rows)
+{
+    if (!resize_pending && new_cols == get_cols() && new_rows == get_rows()) {
+        return;
+    }
+    Clock::time_point now = Clock::now();
+    if (!resize_pending) {
+        resize_pending = true;
+        resize_first   = now;
+    }
+    resize_cols = new_cols;
+    resize_rows = new_rows;
+    resize_due  = std::min(now + RESIZE_DELAY, resize_first + RESIZE_MAX_DELAY);
 }
 
 void CursesTerminal::resize(int new_cols, int new_rows)
 {
-    display.resize(new_cols, new_rows);
-    dirty_lines.assign(new_rows, true);
+    // All sessions share the screen.
+    std::unique_lock<std::mutex> lock(display_mutex);
+    for (auto &s : sessions) {
+        s->display.resize(new_cols, new_rows);
+        if (s->recorder) {
+            s->recorder->write_resize(new_cols, new_rows);
+        }
+
+        struct winsize ws = {};
+        ws.ws_col         = new_cols;
+        ws.ws_row         = new_rows;
+        if (s->pty_fd >= 0 && ioctl(s->pty_fd, TIOCSWINSZ, &ws) < 0) {
+            std::cerr << "ioctl TIOCSWINSZ failed: " << strerror(errno) << std::endl;
+        }
+    }
+    if (parser_thread.joinable()) {
+        publish_snapshot();
+    }
+    lock.unlock();
+
+    // Our SIGWINCH handler replaces the one from ncurses, so tell it about the new size.
+    resizeterm(new_rows, new_cols);
+    shadow.clear();
+    frame_pending = true;
+}
+
+void CursesTerminal::toggle_stats_overlay()
+{
+    stats_overlay = !stats_overlay;
+    if (stats_overlay) {
+        if (!stats_file) {
+            // Start counting from now.
+            stats_time = Clock::now();
+            Stats::collect(stats_last);
+        }
+        stats_lines = { Stats::ENABLED ? "Collecting statistics..."
+                                       : "Statistics are not compiled in" };
+    } else {
+        // Cells under the overlay must be drawn again.
+        const bool drawn = (shadow.size() == size_t(frame_rows * frame_cols));
+        for (int row = 0; drawn && row < std::min(stats_height, frame_rows); ++row) {
+            auto line = shadow.begin() + row * frame_cols;
+            std::fill(line + std::max(frame_cols - stats_width, 0), line + frame_cols,
+                      UNKNOWN_CELL);
+        }
+        redraw_all = true;
+    }
+    frame_pending = true;
+}
+
+//
+// Take counts of the last interval: compose text of the overlay, and dump to the file.
+//
+void CursesTerminal::update_stats(Clock::time_point now)
+{
+    Stats::Snapshot snap;
+    Stats::collect(snap);
+    const Stats::Snapshot diff = snap - stats_last;
+    const double seconds       = std::chrono::duration<double>(now - stats_time).count();
+    stats_last                 = snap;
+    stats_time                 = now;
+    if (!Stats::ENABLED || seconds <= 0) {
+        return;
+    }
 
-    struct winsize ws = {};
-    ws.ws_col         = new_cols;
-    ws.ws_row         = new_rows;
-    if (ioctl(pty_fd, TIOCSWINSZ, &ws) < 0) {
-        std::cerr << "ioctl TIOCSWINSZ failed: " << strerror(errno) << std::endl;
+    const uint64_t *count = diff.counters;
+    const uint64_t frames = std::max<uint64_t>(count[Stats::FRAMES], 1);
+    char buf[128];
+    if (stats_overlay) {
+        stats_lines.clear();
+        snprintf(buf, sizeof(buf), "PTY     %7.0f reads/s %8.2f MB/s %7llu B/read",
+                 count[Stats::PTY_WAKEUPS] / seconds,
+                 count[Stats::PTY_BYTES] / seconds / (1024 * 1024),
+                 (unsigned long long)diff.mean(Stats::BYTES_PER_WAKEUP));
+        stats_lines.push_back(buf);
+        snprintf(buf, sizeof(buf), "Parse   %7.0f seq/s   p50 %6llu us p99 %6llu us",
+                 count[Stats::ESCAPE_SEQUENCES] / seconds,
+                 (unsigned long long)diff.percentile(Stats::PARSE_TIME, 0.5) / 1000,
+                 (unsigned long long)diff.percentile(Stats::PARSE_TIME, 0.99) / 1000);
+        stats_lines.push_back(buf);
+        snprintf(buf, sizeof(buf), "Frames  %7.0f fps     %6.1f rows %8.0f cells",
+                 count[Stats::FRAMES] / seconds, double(count[Stats::ROWS_DRAWN]) / frames,
+                 double(count[Stats::CELLS_DRAWN]) / frames);
+        stats_lines.push_back(buf);
+        snprintf(buf, sizeof(buf), "Render  p50 %6llu us  refresh p50 %6llu us p99 %6llu us",
+                 (unsigned long long)diff.percentile(Stats::RENDER_TIME, 0.5) / 1000,
+                 (unsigned long long)diff.percentile(Stats::REFRESH_TIME, 0.5) / 1000,
+                 (unsigned long long)diff.percentile(Stats::REFRESH_TIME, 0.99) / 1000);
+        stats_lines.push_back(buf);
+        frame_pending = true;
     }
+    if (stats_file) {
+        fprintf(stats_file,
+                "%lld seconds=%.3f pty_reads=%llu pty_bytes=%llu sequences=%llu frames=%llu "
+                "rows=%llu cells=%llu parse_p50_ns=%llu parse_p99_ns=%llu render_p50_ns=%llu "
+                "render_p99_ns=%llu refresh_p50_ns=%llu refresh_p99_ns=%llu\n",
+                (long long)time(nullptr), seconds, (unsigned long long)count[Stats::PTY_WAKEUPS],
+                (unsigned long long)count[Stats::PTY_BYTES],
+                (unsigned long long)count[Stats::ESCAPE_SEQUENCES],
+                (unsigned long long)count[Stats::FRAMES],
+                (unsigned long long)count[Stats::ROWS_DRAWN],
+                (unsigned long long)count[Stats::CELLS_DRAWN],
+                (unsigned long long)diff.percentile(Stats::PARSE_TIME, 0.5),
+                (unsigned long long)diff.percentile(Stats::PARSE_TIME, 0.99),
+                (unsigned long long)diff.percentile(Stats::RENDER_TIME, 0.5),
+                (unsigned long long)diff.percentile(Stats::RENDER_TIME, 0.99),
+                (unsigned long long)diff.percentile(Stats::REFRESH_TIME, 0.5),
+                (unsigned long long)diff.percentile(Stats::REFRESH_TIME, 0.99));
+        fflush(stats_file);
+    }
+}
 
-    wresize(stdscr, new_rows, new_cols);
+//
+// Draw statistics in the top right corner, over the frame.
+// Shadow copy there is unknown, so the cells are drawn again when the overlay goes away.
+//
+void CursesTerminal::draw_stats_overlay()
+{
+    int width = 0;
+    for (const std::string &line : stats_lines) {
+        width = std::max<int>(width, line.size() + 2);
+    }
+    stats_width  = std::min(width, frame_cols);
+    stats_height = std::min<int>(stats_lines.size(), frame_rows);
+
+    attrset(A_REVERSE);
+    const int left = frame_cols - stats_width;
+    for (int row = 0; row < stats_height; ++row) {
+        std::string text = " " + stats_lines[row];
+        text.resize(stats_width, ' ');
+        mvaddnstr(row, left, text.c_str(), stats_width);
+
+        auto line = shadow.begin() + row * frame_cols;
+        std::fill(line + left, line + frame_cols, UNKNOWN_CELL);
+    }
 }
@@ -24,31 +24,305 @@
 #ifndef CURSES_TERMINAL_H
 #define CURSES_TERMINAL_H
 
+#include <ncurses.h>
+#include <poll.h>
+
+#include <atomic>
+#include <chrono>
+#include <exception>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
 #include <vector>
 
 #include "ansi_logic.h"
+#include "recording.h"
+#include "scrollback.h"
+#include "stats.h"
+#include "triple_buffer.h"
 
 class CursesTerminal {
 public:
-    CursesTerminal(int cols, int rows);
+    // Default size of the PTY read buffer.
+    static constexpr size_t DEFAULT_READ_BUFFER_SIZE = 64 * 1024;
+
+    // Default limit of frames per second.
+    static constexpr int DEFAULT_FRAME_RATE = 60;
+
+    CursesTerminal(int cols, int rows, size_t read_buffer_size = DEFAULT_READ_BUFFER_SIZE,
+                   int frame_rate = DEFAULT_FRAME_RATE);
+
+    // Draw into given stream instead of the terminal, with no PTY and no child:
+    // output comes from process_output(). For benchmarks and replay.
+    CursesTerminal(int cols, int rows, FILE *output, int frame_rate = DEFAULT_FRAME_RATE);
     ~CursesTerminal();
-    void process_pty_input();
+
+    // Parse data as if the child has written it.
+    void process_output(const char *data, size_t length);
+    // Fds are the entries added by get_poll_fds(), with results of poll().
+    void process_pty_input(const struct pollfd *fds, size_t count);
     void process_keyboard_input();
     void render_frame();
+    int update_display();
     void resize(int new_cols, int new_rows);
-    int get_cols() const { return display.get_cols(); }
-    int get_rows() const { return display.get_rows(); }
+
+    // Resize later, from update_display(), when no more requests come for a while.
+    void request_resize(int new_cols, int new_rows);
+    int get_cols() const { return session->display.get_cols(); }
+    int get_rows() const { return session->display.get_rows(); }
+
+    // Append descriptors to poll for input to process_pty_input():
+    // PTYs of all sessions, or notifications from the parser thread when it runs.
+    void get_poll_fds(std::vector<struct pollfd> &fds) const;
+
+    // Start another shell, and show it. Sessions are switched by keys, like in tmux:
+    // Ctrl+B then c creates a session, n and p select next and previous one,
+    // 0 to 9 select by number; Ctrl+B twice sends Ctrl+B.
+    void new_session();
+    void select_session(size_t index);
+    size_t get_session_count() const { return sessions.size(); }
+
+    // Limit memory for scrollback history.
+    void set_scrollback_limit(size_t bytes);
+
+    // Keep old scrollback history in a file in given directory.
+    void set_scrollback_spill(const std::string &directory);
+
+    // Write output of the child in the current session to a file, with timing, for replay.
+    void start_recording(const std::string &path);
+
+    // Append performance statistics to a file, every STATS_INTERVAL.
+    void set_stats_file(const std::string &path);
+
+    // Parser state, for inspection.
+    const AnsiLogic &get_display() const { return session->display; }
+
+    // Move reading of the PTY and parsing to a separate thread.
+    // Screen contents is passed back as snapshots.
+    void start_parser_thread();
 
 private:
-    AnsiLogic display;
-    int pty_fd      = -1;
-    pid_t child_pid = -1;
-    std::vector<bool> dirty_lines;
+    // Shell in a PTY, with its own screen. Only the active session is drawn;
+    // others keep reading their PTY, with changes accumulated in the dirty state.
+    struct Session {
+        Session(int cols, int rows) : display(cols, rows) {}
+        AnsiLogic display;
+        int pty_fd{ -1 };
+        pid_t child_pid{ -1 };
+        bool closed{ false };               // Child has finished
+        std::unique_ptr<Recorder> recorder; // Copy of the PTY stream, when recording
+        std::string pending_input;          // Input the PTY has not taken yet
+    };
+    static constexpr wint_t CTRL_B = 2;
+    std::vector<std::unique_ptr<Session>> sessions;
+    Session *session{ nullptr };   // Active one
+    bool session_prefix{ false };  // CTRL_B was pressed: next key controls sessions
+    std::vector<char> read_buffer; // Persistent buffer for PTY output
+
+    // Keyboard input is translated for all keys of a wakeup, and written at once.
+    // Input the PTY does not take is kept, up to the limit, until it becomes writable.
+    static constexpr size_t MAX_PENDING_INPUT = 1024 * 1024;
+    std::string keyboard_output;
+
+    // Bracketed paste of the host terminal: a paste comes between two keys
+    // defined for its markers. Keys of the paste are not taken as commands,
+    // and pasted text is written to the PTY at once, when the paste ends.
+    static constexpr int KEY_PASTE_BEGIN = KEY_MAX + 1;
+    static constexpr int KEY_PASTE_END   = KEY_MAX + 2;
+    bool pasting{ false };
+
+    // Keys with modifiers, defined by terminfo, indexed by curses key code.
+    std::vector<KeyInput> modified_keys;
+
+    // Settings of history, for new sessions.
+    size_t scrollback_limit{ Scrollback::DEFAULT_LIMIT };
+    std::string spill_directory;
+
+    // Curses screen on a stream other than the terminal.
+    SCREEN *screen{ nullptr };
+    FILE *screen_input{ nullptr };
+
+    // Limit of PTY data consumed per wakeup, in units of read_buffer size.
+    static constexpr size_t MAX_BUFFERS_PER_WAKEUP = 16;
+
+    // Frame scheduling: changes are accumulated and drawn
+    // at most once per frame interval.
+    using Clock = std::chrono::steady_clock;
+    Clock::duration frame_interval;
+    Clock::time_point last_frame;
+    bool frame_pending{ false };
+
+    // How long to hold the frame while the application is in synchronized update.
+    static constexpr std::chrono::milliseconds SYNC_UPDATE_TIMEOUT{ 200 };
+    Clock::time_point sync_start;
+    bool sync_active{ false };
 
-    void initialize_ncurses();
-    void initialize_pty();
+    // Delayed resize.
+    static constexpr std::chrono::milliseconds RESIZE_DELAY{ 50 };
+    static constexpr std::chrono::milliseconds RESIZE_MAX_DELAY{ 250 };
+    bool resize_pending{ false };
+    int resize_cols{ 0 };
+    int resize_rows{ 0 };
+    Clock::time_point resize_first; // First request of the burst
+    Clock::time_point resize_due;
+
+    // Parser thread: owns the PTY reading, shares sessions under the mutex.
+    std::thread parser_thread;
+    std::mutex display_mutex;
+    TripleBuffer<ScreenSnapshot> snapshots;
+    int notify_pipe[2]{ -1, -1 }; // Parser thread wakes up the main loop
+    int stop_pipe[2]{ -1, -1 };   // Main thread asks the parser to finish, or to poll new PTYs
+    std::atomic<bool> parser_stop{ false };
+    std::atomic<bool> parser_done{ false };
+    std::exception_ptr parser_error; // Why parser thread has finished
+    uint64_t drawn_scroll_count{ 0 }; // Scroll count of the last drawn snapshot
+
+    bool read_pty(Session &s);
+    void close_finished_sessions();
+
+    // Recordings which have lost data, reported when curses is done.
+    std::vector<std::string> recording_errors;
+    void stop_recording(Session &s);
+    void process_key_event(int status, wint_t ch);
+    void translate_key(int status, wint_t ch);
+    void flush_keyboard_output();
+    bool process_session_key(int status, wint_t ch);
+    void show_session(Session *s);
+    void parser_loop();
+    void publish_snapshot();
+    void stop_parser_thread();
+    void render_snapshot(const ScreenSnapshot &snap);
+
+    void initialize_ncurses(FILE *output = nullptr);
+    void define_modified_keys();
+    void initialize_pty(Session &s);
     void initialize_colors();
-    int get_color_pair(const CharAttr &attr);
+    void write_pty(Session &s, const std::string &data);
+    void flush_pty(Session &s);
+
+    // Curses rendition of a cell: attributes and color pair.
+    struct CursesAttr {
+        attr_t attr{ A_NORMAL };
+        int pair{ -1 }; // Negative when not computed yet
+    };
+
+    // Curses attributes for each entry of the attribute table, computed on demand.
+    std::vector<CursesAttr> attr_cache;
+    unsigned attr_cache_generation{ 0 };
+
+    const CursesAttr &get_curses_attr(uint16_t index)
+    {
+        if (index < attr_cache.size() && attr_cache[index].pair >= 0) {
+            return attr_cache[index];
+        }
+        return update_attr_cache(index);
+    }
+    const CursesAttr &update_attr_cache(uint16_t index);
+
+    // Colors of the host terminal. RGB colors are mapped to the nearest
+    // palette entry via lookup table, indexed by 5 bits of each component.
+    // Terminals with direct color take RGB values as they are.
+    bool direct_color{ false };
+    int palette_size{ 0 };            // 8, 16 or 256 colors
+    std::vector<int16_t> color_table; // Negative when not computed yet
+    int get_host_color(const RgbColor &color);
+
+    // Color pairs are allocated on demand, up to the limit of the terminal.
+    // When all are taken, pairs not on the screen are released, least recently used first.
+    // A pair is on the screen when a cell of the shadow copy has it, or when it was
+    // drawn in this frame or the last one. While contents of the curses window
+    // are not known, no pairs are released: any of them may be there.
+    int pair_limit{ 0 };
+    std::unordered_map<uint64_t, int> pair_index; // Pair by foreground and background
+    std::vector<uint64_t> pair_colors;            // Foreground and background by pair
+    std::vector<unsigned> pair_last_use;          // Frame where the pair was last drawn
+    std::vector<int> free_pairs;
+    unsigned frame_count{ 0 };
+    int get_color_pair(int fg, int bg);
+    void release_color_pairs();
+
+    // Copy of the screen as last drawn via curses, to send only changed cells.
+    // Cells of unknown contents hold UNKNOWN_CELL, which never matches.
+    std::vector<Char> shadow;
+    std::vector<wchar_t> scratch; // Text of one run of cells, for mvaddnwstr()
+    static constexpr Char UNKNOWN_CELL{ wchar_t(-1), 0 };
+
+    // Unchanged cells between two changed ones are redrawn when there are
+    // fewer than this, instead of splitting the run.
+    static constexpr int MAX_REDRAW_GAP = 4;
+
+    // Geometry, attribute table and combined characters of the frame being drawn.
+    int frame_rows{ 0 };
+    int frame_cols{ 0 };
+    const CharAttr *frame_attrs{ nullptr };
+    const wchar_t *frame_combined{ nullptr };
+
+    void begin_frame(int rows, int cols, unsigned attr_generation, const CharAttr *attrs,
+                     const wchar_t *combined);
+    void scroll_frame(int top, int bottom, int lines);
+    void draw_row(int row, const Char *line, int first_col, int last_col);
+    void end_frame(const Cursor &cursor);
+    void invalidate_frame();
+    bool redraw_all{ false }; // Shadow copy was invalidated, dirty state is not enough
+    void mark_pair_used(int pair)
+    {
+        if (pair > 0) {
+            pair_last_use[pair] = frame_count;
+        }
+    }
+
+    // Cells and rows sent to curses in the current frame.
+    int frame_rows_drawn{ 0 };
+    int frame_cells_drawn{ 0 };
+
+    // Statistics of the hot paths: overlay toggled by Shift+F12,
+    // and periodic dump to a file.
+    static constexpr std::chrono::seconds STATS_INTERVAL{ 1 };
+    bool stats_overlay{ false };
+    FILE *stats_file{ nullptr };
+    Clock::time_point stats_time; // When the statistics were collected last
+    Stats::Snapshot stats_last;
+    std::vector<std::string> stats_lines; // Text of the overlay
+    int stats_width{ 0 };                 // Size of the overlay as drawn
+    int stats_height{ 0 };
+
+    void toggle_stats_overlay();
+    void update_stats(Clock::time_point now);
+    void draw_stats_overlay();
+
+    // Scrollback view, with Shift+PageUp/PageDown.
+    // View position is the number of top line in history, where lines
+    // past the end of history continue into the live screen.
+    bool view_active{ false };
+    uint64_t view_top{ 0 };
+    std::vector<Char> view_cells;                           // Frame composed for the view
+    std::vector<CharAttr> view_attrs;                       // Attribute table for view_cells
+    std::unordered_map<uint64_t, uint16_t> view_attr_index; // Index in view_attrs by key
+    std::vector<wchar_t> view_line_text;                    // Line decoded from history
+    std::vector<CharAttr> view_line_attrs;
+
+    // Copy of combined characters of the session, followed by those of history lines.
+    std::vector<wchar_t> view_combined;
+    size_t view_combined_size{ 0 };      // Part copied from the session
+    uint64_t view_combined_version{ 0 }; // Version of the copied table
+
+    void scroll_view(int lines);
+    void render_view();
+    uint16_t get_view_attr(const CharAttr &attr);
+
+    // Search in the view: '/' opens prompt, the view follows matches
+    // as the text is typed; 'n' finds older match, 'N' newer one.
+    bool search_prompt{ false };
+    std::wstring search_text;
+    uint64_t search_origin{ 0 };     // Line where the search started
+    uint64_t search_origin_top{ 0 }; // View position to return on Escape
+    bool match_found{ false };
+    uint64_t match_line{ 0 };
+    int match_col{ 0 };
+
+    bool process_view_key(int status, wint_t ch);
+    void search_view(uint64_t from, bool backward);
 };
 
 #endif // CURSES_TERMINAL_H
@@ -0,0 +1,113 @@
+#!/usr/bin/env python3
+#
+# Generate char_width.cpp: display width of Unicode characters.
+#
+#   python3 src/gen_char_width.py > src/char_width.cpp
+#
+# Widths come from the Unicode database of Python:
+#   0 - combining marks and invisible format characters (categories Mn, Me, Cf),
+#       Hangul medial and final jamo, zero width space
+#   2 - East Asian Wide and Fullwidth, and unassigned code points
+#       of ideograph blocks and planes 2 and 3
+#   1 - all the rest
+# Table has two stages: index of a block for every 256 characters,
+# then blocks of 2-bit widths, four per byte. Equal blocks are shared.
+#
+import sys
+import unicodedata
+
+BLOCK_SIZE = 256
+LIMIT = 0x110000
+
+# Default width of unassigned code points, as in EastAsianWidth.txt.
+UNASSIGNED_WIDE = [(0x3400, 0x4DBF), (0x4E00, 0x9FFF), (0xF900, 0xFAFF),
+                   (0x20000, 0x2FFFD), (0x30000, 0x3FFFD)]
+
+
+# Format characters which are visible: soft hyphen and prepended concatenation marks.
+VISIBLE_FORMAT = {0x00AD, 0x0600, 0x0601, 0x0602, 0x0603, 0x0604, 0x0605, 0x06DD, 0x070F,
+                  0x0890, 0x0891, 0x08E2, 0x110BD, 0x110CD}
+
+
+def width(c):
+    if c in VISIBLE_FORMAT:
+        return 1
+    if 0x1160 <= c <= 0x11FF or 0xD7B0 <= c <= 0xD7FF or c == 0x200B:
+        return 0
+    ch = chr(c)
+    category = unicodedata.category(ch)
+    if category in ('Mn', 'Me', 'Cf'):
+        return 0
+    if category == 'Cn':
+        # Unassigned: wide only in ranges reserved for ideographs.
+        for first, last in UNASSIGNED_WIDE:
+            if first <= c <= last:
+                return 2
+        return 1
+    if unicodedata.east_asian_width(ch) in ('W', 'F'):
+        return 2
+    return 1
+
+
+def main():
+    blocks = []
+    index = {}
+    stage1 = []
+    for start in range(0, LIMIT, BLOCK_SIZE):
+        packed = bytearray(BLOCK_SIZE // 4)
+        for c in range(start, start + BLOCK_SIZE):
+            packed[(c - start) // 4] |= width(c) << ((c % 4) * 2)
+        packed = bytes(packed)
+        if packed not in index:
+            index[packed] = len(blocks)
+            blocks.append(packed)
+        stage1.append(index[packed])
+    if len(blocks) > 256:
+        sys.exit('too many blocks')
+
+    out = sys.stdout
+    out.write('''//
+// Width of Unicode characters, generated by gen_char_width.py
+// from Unicode %s data. Do not edit.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include "char_width.h"
+
+// clang-format off
+''' % unicodedata.unidata_version)
+
+    out.write('const uint8_t char_width_index[0x110000 / 256] = {\n')
+    for i in range(0, len(stage1), 16):
+        out.write('    ' + ','.join('%d' % b for b in stage1[i:i + 16]) + ',\n')
+    out.write('};\n\n')
+
+    out.write('const uint8_t char_width_blocks[%d][64] = {\n' % len(blocks))
+    for block in blocks:
+        out.write('    {\n')
+        for i in range(0, len(block), 16):
+            out.write('        ' + ','.join('0x%02x' % b for b in block[i:i + 16]) + ',\n')
+        out.write('    },\n')
+    out.write('};\n')
+    out.write('// clang-format on\n')
+
+
+main()
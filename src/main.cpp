@@ -21,16 +21,162 @@
 // OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
 // SOFTWARE.
 //
+#include <fcntl.h>
+#include <locale.h>
 #include <ncurses.h>
+#include <poll.h>
+#include <signal.h>
+#include <sys/ioctl.h>
 #include <unistd.h>
-#include <locale.h>
 
+#include <cerrno>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <vector>
 
 #include "curses_terminal.h"
+#include "memory_pool.h"
+#include "scrollback.h"
+
+//
+// Self-pipe for SIGWINCH: the handler writes one byte,
+// the main loop wakes up in poll() and handles the resize.
+//
+static int sigwinch_pipe[2] = { -1, -1 };
+
+static void handle_sigwinch(int)
+{
+    int saved_errno = errno;
+    char c          = 0;
+    if (write(sigwinch_pipe[1], &c, 1) < 0) {
+        // Pipe is full: a resize is already pending.
+    }
+    errno = saved_errno;
+}
+
+static void install_sigwinch_handler()
+{
+    if (pipe(sigwinch_pipe) < 0) {
+        throw std::runtime_error(std::string("pipe failed: ") + strerror(errno));
+    }
+    for (int fd : sigwinch_pipe) {
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL) | O_NONBLOCK);
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+
+    // Replaces the handler installed by ncurses in initscr().
+    struct sigaction sa = {};
+    sa.sa_handler       = handle_sigwinch;
+    sa.sa_flags         = SA_RESTART;
+    sigemptyset(&sa.sa_mask);
+    if (sigaction(SIGWINCH, &sa, nullptr) < 0) {
+        throw std::runtime_error(std::string("sigaction failed: ") + strerror(errno));
+    }
+}
+
+static void process_sigwinch(CursesTerminal &terminal)
+{
+    // Drain the pipe: a burst of signals needs only one resize.
+    char buf[64];
+    while (read(sigwinch_pipe[0], buf, sizeof(buf)) > 0) {
+    }
+
+    struct winsize ws = {};
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) < 0 || ws.ws_row == 0 || ws.ws_col == 0) {
+        return;
+    }
+    terminal.request_resize(ws.ws_col, ws.ws_row);
+}
+
+static void usage(const char *progname)
+{
+    std::cerr << "Usage: " << progname
+              << " [-t] [-b bytes] [-f fps] [-s bytes] [-S dir] [-M bytes] [-r file] [-T file]"
+              << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "    -t          Parse output of the shell in a separate thread" << std::endl;
+    std::cerr << "    -b bytes    Size of PTY read buffer (default "
+              << CursesTerminal::DEFAULT_READ_BUFFER_SIZE << ")" << std::endl;
+    std::cerr << "    -f fps      Limit of screen updates per second, 0 for no limit (default "
+              << CursesTerminal::DEFAULT_FRAME_RATE << ")" << std::endl;
+    std::cerr << "    -s bytes    Memory limit for scrollback history, 0 to disable (default "
+              << Scrollback::DEFAULT_LIMIT << ")" << std::endl;
+    std::cerr << "    -S dir      Keep history over the limit in a temporary file in this directory"
+              << std::endl;
+    std::cerr << "    -M bytes    Memory budget for screens and history of all sessions (default "
+              << MemoryPool::DEFAULT_BUDGET << ")" << std::endl;
+    std::cerr << "    -r file     Record output of the shell to a file, for replay" << std::endl;
+    std::cerr << "    -T file     Append performance statistics to a file every second"
+              << std::endl;
+    exit(1);
+}
 
 int main(int argc, char *argv[])
 {
+    size_t read_buffer_size     = CursesTerminal::DEFAULT_READ_BUFFER_SIZE;
+    int frame_rate              = CursesTerminal::DEFAULT_FRAME_RATE;
+    size_t scrollback_limit     = Scrollback::DEFAULT_LIMIT;
+    size_t memory_budget        = MemoryPool::DEFAULT_BUDGET;
+    const char *spill_directory = nullptr;
+    const char *record_file     = nullptr;
+    const char *stats_file      = nullptr;
+    bool parser_thread          = false;
+    for (int opt; (opt = getopt(argc, argv, "tb:f:s:S:M:r:T:")) != -1;) {
+        switch (opt) {
+        case 't':
+            parser_thread = true;
+            break;
+        case 'b':
+            read_buffer_size = strtoul(optarg, nullptr, 0);
+            if (read_buffer_size == 0) {
+                usage(argv[0]);
+            }
+            break;
+        case 'f': {
+            char *end;
+            long value = strtol(optarg, &end, 0);
+            if (*end != 0 || value < 0 || value > 1000) {
+                usage(argv[0]);
+            }
+            frame_rate = value;
+            break;
+        }
+        case 's': {
+            char *end;
+            scrollback_limit = strtoull(optarg, &end, 0);
+            if (*end != 0) {
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'S':
+            spill_directory = optarg;
+            break;
+        case 'M': {
+            char *end;
+            memory_budget = strtoull(optarg, &end, 0);
+            if (*end != 0) {
+                usage(argv[0]);
+            }
+            break;
+        }
+        case 'r':
+            record_file = optarg;
+            break;
+        case 'T':
+            stats_file = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc) {
+        usage(argv[0]);
+    }
+
+    MemoryPool::global().set_budget(memory_budget);
+
     try {
         // Get terminal size
         int rows, cols;
@@ -39,24 +185,53 @@ int main(int argc, char *argv[])
         getmaxyx(stdscr, rows, cols);
         endwin();
 
-        CursesTerminal terminal(cols, rows);
+        CursesTerminal terminal(cols, rows, read_buffer_size, frame_rate);
+        terminal.set_scrollback_limit(scrollback_limit);
+        if (spill_directory) {
+            terminal.set_scrollback_spill(spill_directory);
+        }
+        if (record_file) {
+            terminal.start_recording(record_file);
+        }
+        if (stats_file) {
+            terminal.set_stats_file(stats_file);
+        }
+        install_sigwinch_handler();
+        if (parser_thread) {
+            terminal.start_parser_thread();
+        }
+
+        // Descriptors of the PTYs follow the fixed ones.
+        enum { POLL_KEYBOARD, POLL_SIGWINCH, POLL_COUNT };
+        std::vector<struct pollfd> fds;
 
-        // Main loop
+        // Main loop: sleep until keyboard, PTY or resize needs attention,
+        // or until the pending frame or resize is due.
+        terminal.render_frame();
+        int timeout = -1;
         while (true) {
             try {
-                terminal.process_keyboard_input();
-                terminal.process_pty_input();
-                terminal.render_frame();
-
-                // Check for terminal resize
-                int new_rows, new_cols;
-                getmaxyx(stdscr, new_rows, new_cols);
-                if (new_rows != terminal.get_rows() ||
-                    new_cols != terminal.get_cols()) {
-                    terminal.resize(new_cols, new_rows);
+                // Sessions come and go: the list is made anew every time.
+                fds.clear();
+                fds.push_back({ STDIN_FILENO, POLLIN, 0 });
+                fds.push_back({ sigwinch_pipe[0], POLLIN, 0 });
+                terminal.get_poll_fds(fds);
+                if (poll(fds.data(), fds.size(), timeout) < 0) {
+                    if (errno == EINTR) {
+                        continue;
+                    }
+                    throw std::runtime_error(std::string("poll failed: ") + strerror(errno));
                 }
-
-                usleep(10000); // 10ms delay
+                if (fds[POLL_SIGWINCH].revents & POLLIN) {
+                    process_sigwinch(terminal);
+                }
+                if (fds[POLL_KEYBOARD].revents & POLLIN) {
+                    terminal.process_keyboard_input();
+                } else if (fds[POLL_KEYBOARD].revents & (POLLHUP | POLLERR)) {
+                    break; // Controlling terminal has gone away
+                }
+                terminal.process_pty_input(&fds[POLL_COUNT], fds.size() - POLL_COUNT);
+                timeout = terminal.update_display();
             } catch (const std::runtime_error &e) {
                 if (std::string(e.what()) == "PTY closed: child process terminated") {
                     break; // Exit loop when child process terminates
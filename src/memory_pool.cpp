@@ -0,0 +1,53 @@
+//
+// Shared storage for screens and history of the terminal emulator.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include "memory_pool.h"
+
+MemoryPool &MemoryPool::global()
+{
+    static MemoryPool pool;
+    return pool;
+}
+
+//
+// Free buffers over the new budget are released.
+//
+void MemoryPool::set_budget(size_t bytes)
+{
+    budget.store(bytes, std::memory_order_relaxed);
+
+    std::lock_guard<std::mutex> lock(mutex);
+    const size_t used  = get_usage();
+    const size_t limit = (bytes > used) ? bytes - used : 0;
+    shrink(free_cells, limit);
+    shrink(free_bytes, limit);
+    shrink(free_words, limit);
+}
+
+void MemoryPool::trim()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    shrink(free_cells, 0);
+    shrink(free_bytes, 0);
+    shrink(free_words, 0);
+}
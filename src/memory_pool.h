@@ -0,0 +1,170 @@
+//
+// Shared storage for screens and history of the terminal emulator.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#ifndef MEMORY_POOL_H
+#define MEMORY_POOL_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <vector>
+
+#include "ansi_logic.h"
+
+//
+// Buffers of screen grids and history chunks, shared by all sessions.
+// Released buffers are kept by size, and given out again when a buffer
+// of about the same size is requested: resize of many sessions, or old
+// history chunks replaced by new ones, need no heap allocation.
+//
+// Owners report memory they hold. Free buffers are kept only while total
+// of used and free memory fits into the budget, and free memory is within
+// a quarter of it. History is discarded when the used memory is over the budget.
+//
+class MemoryPool {
+public:
+    // Default budget for all sessions of the process.
+    static constexpr size_t DEFAULT_BUDGET = 512 * 1024 * 1024;
+
+    explicit MemoryPool(size_t bytes = DEFAULT_BUDGET) : budget(bytes) {}
+    ~MemoryPool()                             = default;
+    MemoryPool(const MemoryPool &)            = delete;
+    MemoryPool &operator=(const MemoryPool &) = delete;
+
+    // Pool of the process.
+    static MemoryPool &global();
+
+    // Limit of memory for grids, history and free buffers together.
+    void set_budget(size_t bytes);
+    size_t get_budget() const { return budget.load(std::memory_order_relaxed); }
+
+    // Memory held by owners, as reported.
+    size_t get_usage() const { return usage.load(std::memory_order_relaxed); }
+    bool over_budget() const { return get_usage() > get_budget(); }
+
+    // Memory in free buffers.
+    size_t get_cached() const { return cached.load(std::memory_order_relaxed); }
+
+    // Owner holds now `actual` bytes instead of `reported` ones.
+    void update_usage(size_t &reported, size_t actual)
+    {
+        usage.fetch_add(actual - reported, std::memory_order_relaxed);
+        reported = actual;
+    }
+
+    // Make the buffer empty, with room for at least given number of elements.
+    // Buffer itself is kept when it fits.
+    template <typename T>
+    void get(std::vector<T> &buf, size_t count);
+
+    // Take the buffer back for reuse; it is left empty.
+    template <typename T>
+    void put(std::vector<T> &buf);
+
+    // Release all free buffers.
+    void trim();
+
+private:
+    std::atomic<size_t> budget;
+    std::atomic<size_t> usage{ 0 };
+    std::atomic<size_t> cached{ 0 };
+
+    // Free buffers, sorted by capacity.
+    std::mutex mutex;
+    std::vector<std::vector<Char>> free_cells;
+    std::vector<std::vector<uint8_t>> free_bytes;
+    std::vector<std::vector<uint64_t>> free_words;
+
+    std::vector<std::vector<Char>> &free_list(Char *) { return free_cells; }
+    std::vector<std::vector<uint8_t>> &free_list(uint8_t *) { return free_bytes; }
+    std::vector<std::vector<uint64_t>> &free_list(uint64_t *) { return free_words; }
+
+    // Largest capacity given out for the requested one.
+    static size_t fit_limit(size_t count) { return count + count / 4; }
+
+    template <typename T>
+    void shrink(std::vector<std::vector<T>> &list, size_t limit);
+};
+
+template <typename T>
+void MemoryPool::get(std::vector<T> &buf, size_t count)
+{
+    buf.clear();
+    if (buf.capacity() >= count && buf.capacity() <= fit_limit(count)) {
+        return;
+    }
+    put(buf);
+    if (count == 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &list = free_list(static_cast<T *>(nullptr));
+        auto it    = std::lower_bound(
+            list.begin(), list.end(), count,
+            [](const std::vector<T> &b, size_t n) { return b.capacity() < n; });
+        if (it != list.end() && it->capacity() <= fit_limit(count)) {
+            buf.swap(*it);
+            list.erase(it);
+            cached.fetch_sub(buf.capacity() * sizeof(T), std::memory_order_relaxed);
+            return;
+        }
+    }
+    buf.reserve(count);
+}
+
+template <typename T>
+void MemoryPool::put(std::vector<T> &buf)
+{
+    const size_t bytes = buf.capacity() * sizeof(T);
+    if (bytes == 0) {
+        return;
+    }
+    buf.clear();
+    const size_t limit = get_budget();
+    const size_t free  = get_cached() + bytes;
+    if (free <= limit / 4 && get_usage() + free <= limit) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto &list = free_list(static_cast<T *>(nullptr));
+        auto it    = std::upper_bound(
+            list.begin(), list.end(), buf.capacity(),
+            [](size_t n, const std::vector<T> &b) { return n < b.capacity(); });
+        list.insert(it, std::vector<T>())->swap(buf);
+        cached.fetch_add(bytes, std::memory_order_relaxed);
+        return;
+    }
+    std::vector<T>().swap(buf);
+}
+
+template <typename T>
+void MemoryPool::shrink(std::vector<std::vector<T>> &list, size_t limit)
+{
+    // Largest buffers go first.
+    while (!list.empty() && cached.load(std::memory_order_relaxed) > limit) {
+        cached.fetch_sub(list.back().capacity() * sizeof(T), std::memory_order_relaxed);
+        list.pop_back();
+    }
+}
+
+#endif // MEMORY_POOL_H
@@ -0,0 +1,268 @@
+//
+// Recording of PTY output, for replay.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include "recording.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+
+static constexpr char MAGIC[8] = { 'T', 'E', 'R', 'M', 'R', 'E', 'C', '1' };
+
+struct FileHeader {
+    char magic[8];
+    uint32_t cols;
+    uint32_t rows;
+};
+
+struct RecordHeader {
+    uint64_t time_us;
+    uint32_t type;
+    uint32_t length;
+};
+
+struct ResizeData {
+    uint32_t cols;
+    uint32_t rows;
+};
+
+Recorder::~Recorder()
+{
+    close();
+}
+
+bool Recorder::open(const std::string &path, int cols, int rows)
+{
+    close();
+    fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) {
+        return false;
+    }
+    FileHeader header{};
+    memcpy(header.magic, MAGIC, sizeof(MAGIC));
+    header.cols = cols;
+    header.rows = rows;
+    if (!write_all(&header, sizeof(header))) {
+        int saved_errno = errno;
+        ::close(fd);
+        fd    = -1;
+        errno = saved_errno;
+        return false;
+    }
+    start         = std::chrono::steady_clock::now();
+    stop          = false;
+    failed        = false;
+    dropped_bytes = 0;
+    writer        = std::thread(&Recorder::writer_loop, this);
+    return true;
+}
+
+void Recorder::close()
+{
+    if (fd < 0) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stop = true;
+    }
+    wakeup.notify_one();
+    writer.join();
+
+    // Let replay know that the recording is incomplete.
+    if (dropped_bytes > 0) {
+        RecordHeader header{};
+        header.time_us       = elapsed_us();
+        header.type          = uint32_t(RecordType::DROPPED);
+        header.length        = sizeof(uint64_t);
+        const uint64_t count = dropped_bytes;
+        if (write_all(&header, sizeof(header))) {
+            write_all(&count, sizeof(count));
+        }
+    }
+    ::close(fd);
+    fd = -1;
+}
+
+bool Recorder::has_failed() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return failed;
+}
+
+size_t Recorder::get_dropped_bytes() const
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    return dropped_bytes;
+}
+
+void Recorder::write_output(const char *data, size_t length)
+{
+    append(RecordType::OUTPUT, data, length);
+}
+
+void Recorder::write_resize(int cols, int rows)
+{
+    ResizeData size{ uint32_t(cols), uint32_t(rows) };
+    append(RecordType::RESIZE, &size, sizeof(size));
+}
+
+uint64_t Recorder::elapsed_us() const
+{
+    const auto elapsed = std::chrono::steady_clock::now() - start;
+    return std::chrono::duration_cast<std::chrono::microseconds>(elapsed).count();
+}
+
+//
+// Queue the record. Only the copy is done under the lock.
+// When the queue is full, drop the record and stop recording.
+//
+void Recorder::append(RecordType type, const void *data, size_t length)
+{
+    if (fd < 0) {
+        return;
+    }
+    RecordHeader header{};
+    header.time_us = elapsed_us();
+    header.type    = uint32_t(type);
+    header.length = length;
+
+    std::unique_lock<std::mutex> lock(mutex);
+    if (!failed && queue.size() + sizeof(header) + length > queue_limit) {
+        failed = true;
+    }
+    if (failed) {
+        dropped_bytes += sizeof(header) + length;
+        return;
+    }
+    const bool was_empty = queue.empty();
+    const char *ptr      = static_cast<const char *>(data);
+    queue.insert(queue.end(), reinterpret_cast<const char *>(&header),
+                 reinterpret_cast<const char *>(&header + 1));
+    queue.insert(queue.end(), ptr, ptr + length);
+    lock.unlock();
+    if (was_empty) {
+        wakeup.notify_one();
+    }
+}
+
+bool Recorder::write_all(const void *data, size_t size)
+{
+    const char *ptr = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = write(fd, ptr, size);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += written;
+        size -= written;
+    }
+    return true;
+}
+
+//
+// Body of the writer thread: take everything queued, write it out of the lock.
+//
+void Recorder::writer_loop()
+{
+    std::unique_lock<std::mutex> lock(mutex);
+    for (;;) {
+        wakeup.wait(lock, [this] { return stop || !queue.empty(); });
+        if (queue.empty()) {
+            return;
+        }
+        writing.swap(queue);
+        lock.unlock();
+
+        bool ok            = write_all(writing.data(), writing.size());
+        const size_t taken = writing.size();
+        writing.clear();
+
+        lock.lock();
+        if (!ok) {
+            failed = true;
+            dropped_bytes += taken + queue.size();
+            queue.clear();
+        }
+    }
+}
+
+RecordingReader::~RecordingReader()
+{
+    if (file) {
+        fclose(file);
+    }
+}
+
+bool RecordingReader::open(const std::string &path)
+{
+    if (file) {
+        fclose(file);
+    }
+    file = fopen(path.c_str(), "rb");
+    if (!file) {
+        return false;
+    }
+    FileHeader header;
+    if (fread(&header, sizeof(header), 1, file) != 1 ||
+        memcmp(header.magic, MAGIC, sizeof(MAGIC)) != 0) {
+        fclose(file);
+        file  = nullptr;
+        errno = EINVAL;
+        return false;
+    }
+    cols = header.cols;
+    rows = header.rows;
+    return true;
+}
+
+bool RecordingReader::next(Record &record)
+{
+    RecordHeader header;
+    if (!file || fread(&header, sizeof(header), 1, file) != 1) {
+        return false;
+    }
+    record.type    = RecordType(header.type);
+    record.time_us = header.time_us;
+    record.data.resize(header.length);
+    if (header.length > 0 && fread(&record.data[0], header.length, 1, file) != 1) {
+        return false;
+    }
+    if (record.type == RecordType::RESIZE) {
+        ResizeData size{};
+        memcpy(&size, record.data.data(), std::min(record.data.size(), sizeof(size)));
+        record.cols = size.cols;
+        record.rows = size.rows;
+    } else if (record.type == RecordType::DROPPED) {
+        record.dropped = 0;
+        memcpy(&record.dropped, record.data.data(),
+               std::min(record.data.size(), sizeof(record.dropped)));
+    }
+    return true;
+}
@@ -0,0 +1,135 @@
+//
+// Recording of PTY output, for replay.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#ifndef RECORDING_H
+#define RECORDING_H
+
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+//
+// Format of the recording file: header with the initial screen size,
+// then records, each with time in microseconds since the start.
+// Numbers are in host byte order.
+//
+enum class RecordType : uint32_t {
+    OUTPUT,  // Data written by the child
+    RESIZE,  // New screen size
+    DROPPED, // Last record: the recording is incomplete, records were dropped
+};
+
+struct Record {
+    RecordType type{ RecordType::OUTPUT };
+    uint64_t time_us{ 0 };
+    std::string data;      // Output of the child
+    int cols{ 0 };         // Size of the screen after resize
+    int rows{ 0 };
+    uint64_t dropped{ 0 }; // Bytes of records which were dropped
+};
+
+//
+// Writer of the recording. Records are queued in memory and written
+// to the file by a background thread, so that the PTY read path
+// never waits for the disk. The queue is limited in size: when the disk
+// does not keep up, the data is dropped and the recording is marked failed.
+// Amount of dropped data is then written at close, in a DROPPED record.
+//
+class Recorder {
+public:
+    static constexpr size_t DEFAULT_QUEUE_LIMIT = 16 * 1024 * 1024;
+
+    explicit Recorder(size_t queue_limit = DEFAULT_QUEUE_LIMIT) : queue_limit(queue_limit) {}
+    ~Recorder();
+    Recorder(const Recorder &)            = delete;
+    Recorder &operator=(const Recorder &) = delete;
+
+    // Create the file and start the writer.
+    // Return false on failure, with errno set.
+    bool open(const std::string &path, int cols, int rows);
+
+    void write_output(const char *data, size_t length);
+    void write_resize(int cols, int rows);
+
+    // Write all queued records and close the file.
+    void close();
+
+    // Writing to the file has failed, or the queue has overflowed:
+    // the rest of the data is dropped.
+    bool has_failed() const;
+
+    // Number of bytes of records which were not written.
+    size_t get_dropped_bytes() const;
+
+private:
+    int fd{ -1 };
+    std::chrono::steady_clock::time_point start;
+    mutable std::mutex mutex;
+    std::condition_variable wakeup;
+    std::vector<char> queue;   // Records not taken by the writer yet
+    std::vector<char> writing; // Records being written
+    size_t queue_limit;        // Max size of the queue in bytes
+    size_t dropped_bytes{ 0 };
+    bool stop{ false };
+    bool failed{ false };
+    std::thread writer;
+
+    uint64_t elapsed_us() const;
+    void append(RecordType type, const void *data, size_t length);
+    bool write_all(const void *data, size_t size);
+    void writer_loop();
+};
+
+//
+// Sequential reader of the recording.
+//
+class RecordingReader {
+public:
+    RecordingReader() = default;
+    ~RecordingReader();
+    RecordingReader(const RecordingReader &)            = delete;
+    RecordingReader &operator=(const RecordingReader &) = delete;
+
+    // Open the file and read the header.
+    // Return false on failure, with errno set (EINVAL when the format is wrong).
+    bool open(const std::string &path);
+
+    // Screen size when the recording started.
+    int get_cols() const { return cols; }
+    int get_rows() const { return rows; }
+
+    // Get next record. Return false at the end of file, or when the record is truncated.
+    bool next(Record &record);
+
+private:
+    FILE *file{ nullptr };
+    int cols{ 0 };
+    int rows{ 0 };
+};
+
+#endif // RECORDING_H
@@ -0,0 +1,181 @@
+//
+// Replay of PTY output recorded by terminal_emulator -r.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include <locale.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <thread>
+
+#include "ansi_logic.h"
+#include "curses_terminal.h"
+#include "recording.h"
+
+using Clock = std::chrono::steady_clock;
+
+static void usage(const char *progname)
+{
+    std::cerr << "Usage: " << progname << " [-s] [-c] [-d] file" << std::endl;
+    std::cerr << "Options:" << std::endl;
+    std::cerr << "    -s          Replay at original speed (default as fast as possible)"
+              << std::endl;
+    std::cerr << "    -c          Draw frames with curses into /dev/null" << std::endl;
+    std::cerr << "    -d          Print contents of the screen at the end" << std::endl;
+    exit(1);
+}
+
+//
+// Print text of the screen, without trailing blanks.
+//
+static void dump_screen(const AnsiLogic &display)
+{
+    std::wstring line;
+    for (int row = 0; row < display.get_rows(); ++row) {
+        const Char *cells = display.get_row(row);
+        int length        = display.get_cols();
+        while (length > 0 && cells[length - 1].ch == L' ') {
+            --length;
+        }
+        line.clear();
+        for (int col = 0; col < length; ++col) {
+            if (cells[col].is_combined()) {
+                line += display.get_combined(cells[col].ch);
+            } else if (!cells[col].is_spacer()) {
+                line += cells[col].ch;
+            }
+        }
+        printf("%ls\n", line.c_str());
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    bool original_speed = false;
+    bool draw           = false;
+    bool dump           = false;
+    for (int opt; (opt = getopt(argc, argv, "scd")) != -1;) {
+        switch (opt) {
+        case 's':
+            original_speed = true;
+            break;
+        case 'c':
+            draw = true;
+            break;
+        case 'd':
+            dump = true;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+    }
+    setlocale(LC_ALL, "en_US.UTF-8");
+
+    RecordingReader reader;
+    if (!reader.open(argv[optind])) {
+        std::cerr << argv[optind] << ": " << strerror(errno) << std::endl;
+        return 1;
+    }
+
+    // Either parse only, or parse and draw like the terminal does.
+    std::unique_ptr<AnsiLogic> logic;
+    std::unique_ptr<CursesTerminal> terminal;
+    FILE *output = nullptr;
+    if (draw) {
+        output   = fopen("/dev/null", "w");
+        terminal = std::make_unique<CursesTerminal>(reader.get_cols(), reader.get_rows(), output);
+    } else {
+        logic = std::make_unique<AnsiLogic>(reader.get_cols(), reader.get_rows());
+    }
+
+    Record record;
+    uint64_t bytes          = 0;
+    uint64_t records        = 0;
+    uint64_t dropped        = 0;
+    Clock::time_point start = Clock::now();
+    while (reader.next(record)) {
+        if (original_speed) {
+            const Clock::time_point due = start + std::chrono::microseconds(record.time_us);
+            while (terminal) {
+                // Draw frames which are due before the record.
+                int timeout = terminal->update_display();
+                if (timeout < 0 || Clock::now() + std::chrono::milliseconds(timeout) >= due) {
+                    break;
+                }
+                std::this_thread::sleep_for(std::chrono::milliseconds(timeout));
+            }
+            std::this_thread::sleep_until(due);
+        }
+        switch (record.type) {
+        case RecordType::OUTPUT:
+            if (terminal) {
+                terminal->process_output(record.data.data(), record.data.size());
+                terminal->update_display();
+            } else {
+                logic->process_input(record.data.data(), record.data.size());
+                logic->clear_dirty();
+                logic->clear_reply();
+            }
+            bytes += record.data.size();
+            break;
+        case RecordType::RESIZE:
+            if (terminal) {
+                terminal->resize(record.cols, record.rows);
+            } else {
+                logic->resize(record.cols, record.rows);
+            }
+            break;
+        case RecordType::DROPPED:
+            dropped += record.dropped;
+            break;
+        }
+        records++;
+    }
+    if (terminal) {
+        terminal->render_frame();
+    }
+    const double seconds = std::chrono::duration<double>(Clock::now() - start).count();
+
+    if (dump) {
+        dump_screen(terminal ? terminal->get_display() : *logic);
+    }
+    terminal.reset();
+    if (output) {
+        fclose(output);
+    }
+    fprintf(stderr, "%llu bytes, %llu records in %.3f seconds, %.1f MB/s\n",
+            (unsigned long long)bytes, (unsigned long long)records, seconds,
+            bytes / seconds / (1024 * 1024));
+    if (dropped > 0) {
+        fprintf(stderr, "Recording is incomplete: %llu bytes were dropped\n",
+                (unsigned long long)dropped);
+    }
+    return 0;
+}
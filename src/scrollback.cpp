@@ -0,0 +1,1037 @@
+//
+// Scrollback history of the terminal emulator.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include "scrollback.h"
+
+#include "memory_pool.h"
+
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cerrno>
+#include <cwchar>
+
+//
+// Variable length encoding of unsigned integers: 7 bits per byte,
+// high bit set when more bytes follow.
+//
+static constexpr int MAX_VARINT_SIZE = 5;
+
+static void put_varint(uint8_t *&ptr, uint32_t value)
+{
+    while (value >= 0x80) {
+        *ptr++ = value | 0x80;
+        value >>= 7;
+    }
+    *ptr++ = value;
+}
+
+static uint32_t get_varint(const uint8_t *&ptr)
+{
+    uint32_t value = 0;
+    for (int shift = 0;; shift += 7) {
+        uint8_t byte = *ptr++;
+        value |= uint32_t(byte & 0x7f) << shift;
+        if (!(byte & 0x80)) {
+            return value;
+        }
+    }
+}
+
+static void put_color(uint8_t *&ptr, const RgbColor &color)
+{
+    *ptr++ = color.r;
+    *ptr++ = color.g;
+    *ptr++ = color.b;
+}
+
+static RgbColor get_color(const uint8_t *&ptr)
+{
+    RgbColor color(ptr[0], ptr[1], ptr[2]);
+    ptr += 3;
+    return color;
+}
+
+//
+// Character of a cell. Character with combining marks is stored with its
+// text, so that history does not depend on the table of the screen:
+// Char::COMBINED plus length of the text, then the characters.
+//
+static void put_char(uint8_t *&ptr, wchar_t ch, const wchar_t *combined)
+{
+    if (ch < Char::COMBINED) {
+        put_varint(ptr, ch);
+        return;
+    }
+    const wchar_t *text = &combined[ch - Char::COMBINED];
+    const size_t length = wcslen(text);
+    put_varint(ptr, Char::COMBINED + length);
+    for (size_t i = 0; i < length; ++i) {
+        put_varint(ptr, text[i]);
+    }
+}
+
+//
+// Get character of a cell. Text of character with combining marks is appended
+// to the table, null-terminated, and the result refers to it by offset.
+// Without the table, only the base character is given.
+//
+static wchar_t get_char(const uint8_t *&ptr, std::vector<wchar_t> *combined)
+{
+    const wchar_t ch = get_varint(ptr);
+    if (ch < Char::COMBINED) {
+        return ch;
+    }
+    const size_t length = ch - Char::COMBINED;
+    const wchar_t base  = get_varint(ptr);
+    if (!combined) {
+        for (size_t i = 1; i < length; ++i) {
+            get_varint(ptr);
+        }
+        return base;
+    }
+    const wchar_t result = Char::COMBINED + combined->size();
+    combined->push_back(base);
+    for (size_t i = 1; i < length; ++i) {
+        combined->push_back(get_varint(ptr));
+    }
+    combined->push_back(0);
+    return result;
+}
+
+Scrollback::Scrollback(size_t limit) : Scrollback(MemoryPool::global(), limit)
+{
+}
+
+Scrollback::~Scrollback()
+{
+    stop_packer();
+    if (spill_data_map) {
+        munmap(const_cast<uint8_t *>(spill_data_map), spill_data_map_size);
+    }
+    if (spill_index_map) {
+        munmap(const_cast<uint8_t *>(spill_index_map), spill_index_map_size);
+    }
+    for (int fd : { spill_data_fd, spill_index_fd }) {
+        if (fd >= 0) {
+            close(fd);
+        }
+    }
+    for (Chunk &chunk : chunks) {
+        release_chunk(chunk);
+    }
+    memory_used = 0;
+    report_usage();
+}
+
+//
+// Return buffers of the chunk to the pool.
+//
+void Scrollback::release_chunk(Chunk &chunk)
+{
+    pool.put(chunk.data);
+    pool.put(chunk.bloom);
+}
+
+void Scrollback::report_usage()
+{
+    pool.update_usage(reported_usage, memory_used);
+}
+
+//
+// Create anonymous file in given directory.
+//
+static int create_spill_file(const std::string &directory)
+{
+    std::string path = directory + "/terminal-scrollback-XXXXXX";
+    int fd           = mkstemp(&path[0]);
+    if (fd >= 0) {
+        unlink(path.c_str());
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+    }
+    return fd;
+}
+
+bool Scrollback::enable_spill(const std::string &directory)
+{
+    if (spill_data_fd >= 0) {
+        return true;
+    }
+    spill_data_fd = create_spill_file(directory);
+    if (spill_data_fd < 0) {
+        return false;
+    }
+    spill_index_fd = create_spill_file(directory);
+    if (spill_index_fd < 0) {
+        int saved_errno = errno;
+        close(spill_data_fd);
+        spill_data_fd = -1;
+        errno         = saved_errno;
+        return false;
+    }
+
+    // Spilled lines follow the lines discarded so far.
+    spill_end_line = first_line;
+    return true;
+}
+
+//
+// Write all data at given position of the file.
+//
+static bool write_at(int fd, const void *data, size_t size, uint64_t offset)
+{
+    const char *ptr = static_cast<const char *>(data);
+    while (size > 0) {
+        ssize_t written = pwrite(fd, ptr, size, offset);
+        if (written < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        ptr += written;
+        size -= written;
+        offset += written;
+    }
+    return true;
+}
+
+//
+// Append sealed chunk to the spill files.
+//
+bool Scrollback::spill_chunk(const Chunk &chunk)
+{
+    SpillEntry entry{};
+    entry.first_line = chunk.first_line;
+    entry.offset     = spill_data_size;
+    entry.size       = chunk.data.size();
+    entry.raw_size   = chunk.raw_size;
+    entry.line_count = chunk.line_count;
+    entry.compressed = chunk.compressed;
+    std::copy(chunk.bloom.begin(), chunk.bloom.end(), entry.bloom);
+    if (!write_at(spill_data_fd, chunk.data.data(), chunk.data.size(), spill_data_size) ||
+        !write_at(spill_index_fd, &entry, sizeof(entry), spill_count * sizeof(entry))) {
+        return false;
+    }
+    spill_data_size += chunk.data.size();
+    spill_count++;
+    spill_end_line = chunk.first_line + chunk.line_count;
+    return true;
+}
+
+//
+// Position of trigram in a bloom filter.
+//
+static uint32_t trigram_hash(wchar_t a, wchar_t b, wchar_t c, int bits)
+{
+    uint32_t hash = uint32_t(a) * 0x9e3779b1u;
+    hash          = (hash ^ uint32_t(b)) * 0x85ebca77u;
+    hash          = (hash ^ uint32_t(c)) * 0xc2b2ae3du;
+    return hash >> (32 - bits);
+}
+
+void Scrollback::set_limit(size_t bytes)
+{
+    memory_limit = bytes;
+    enforce_limit();
+}
+
+void Scrollback::push_line(const Char *cells, int cols, const CharAttr *attrs, bool wrapped,
+                           const wchar_t *combined)
+{
+    if (memory_limit == 0) {
+        return;
+    }
+    if (cols != line_width) {
+        width_changed |= (next_line != first_line);
+        line_width = cols;
+    }
+    append_line(cells, cols, attrs, wrapped, combined);
+}
+
+//
+// Encode line as:
+//      number of cells, times two, plus one when wrapped
+//      for each run of attributes: foreground, background, length
+//      for each cell: character, see put_char()
+// Trailing blanks with default attributes are not stored,
+// unless the line is wrapped: then they belong to the text.
+//
+void Scrollback::append_line(const Char *cells, int cols, const CharAttr *attrs, bool wrapped,
+                             const wchar_t *combined)
+{
+    // Attribute 0 is normally the default one: check for it first,
+    // four cells at a time, as most of the line is blank usually.
+    const CharAttr default_attr;
+    int length = cols;
+    if (wrapped) {
+        // Keep all cells.
+    } else if (attrs[0] == default_attr) {
+        for (; length >= 4; length -= 4) {
+            const Char *c = &cells[length - 4];
+            if (((c[0].ch ^ L' ') | (c[1].ch ^ L' ') | (c[2].ch ^ L' ') | (c[3].ch ^ L' ') |
+                 c[0].attr | c[1].attr | c[2].attr | c[3].attr) != 0) {
+                break;
+            }
+        }
+        while (length > 0 && cells[length - 1].ch == L' ' && cells[length - 1].attr == 0) {
+            --length;
+        }
+    }
+    while (!wrapped && length > 0 && cells[length - 1].ch == L' ' &&
+           attrs[cells[length - 1].attr] == default_attr) {
+        --length;
+    }
+
+    // Reserve for the worst case: every cell in a separate run, with all marks.
+    const size_t max_size =
+        MAX_VARINT_SIZE * 2 + length * (6 + MAX_VARINT_SIZE * (3 + AnsiLogic::MAX_COMBINING_MARKS));
+    if (record.size() < max_size) {
+        record.resize(max_size);
+    }
+    uint8_t *ptr = &record[MAX_VARINT_SIZE]; // Room for size prefix
+
+    put_varint(ptr, length * 2 + wrapped);
+    for (int col = 0; col < length;) {
+        int start = col;
+        while (col < length && cells[col].attr == cells[start].attr) {
+            ++col;
+        }
+        const CharAttr &attr = attrs[cells[start].attr];
+        put_color(ptr, attr.fg);
+        put_color(ptr, attr.bg);
+        put_varint(ptr, col - start);
+    }
+    for (int col = 0; col < length; ++col) {
+        put_char(ptr, cells[col].ch, combined);
+    }
+
+    // Put size of the line in front of it.
+    uint8_t prefix[MAX_VARINT_SIZE];
+    uint8_t *prefix_end = prefix;
+    put_varint(prefix_end, ptr - &record[MAX_VARINT_SIZE]);
+    uint8_t *start = &record[MAX_VARINT_SIZE] - (prefix_end - prefix);
+    std::copy(prefix, prefix_end, start);
+
+    if (chunks.empty() || chunks.back().sealed) {
+        chunks.emplace_back();
+        Chunk &chunk     = chunks.back();
+        chunk.first_line = next_line;
+        pool.get(chunk.data, CHUNK_SIZE + 16);
+        memory_used += chunk.data.capacity();
+    }
+    Chunk &chunk        = chunks.back();
+    size_t old_capacity = chunk.data.capacity();
+    chunk.data.insert(chunk.data.end(), start, ptr);
+    chunk.line_count++;
+    next_line++;
+    memory_used += chunk.data.capacity() - old_capacity;
+
+    if (chunk.data.size() >= CHUNK_SIZE) {
+        seal_chunk(chunk);
+    }
+    enforce_limit();
+}
+
+#ifdef HAVE_ZLIB
+//
+// Compress data in zlib format, like compress2(). State of the stream
+// is kept for the thread: it is larger than a chunk, and its setup
+// would allocate memory for every chunk.
+// Return size of compressed data, or 0 when it does not fit.
+//
+static size_t compress_data(const uint8_t *data, size_t size, uint8_t *out, size_t out_size)
+{
+    struct Deflater {
+        z_stream stream{};
+        bool ready{ false };
+
+        // Fastest level: terminal output is very redundant anyway.
+        Deflater() { ready = (deflateInit(&stream, Z_BEST_SPEED) == Z_OK); }
+        ~Deflater()
+        {
+            if (ready) {
+                deflateEnd(&stream);
+            }
+        }
+    };
+    thread_local Deflater deflater;
+
+    z_stream &stream = deflater.stream;
+    if (!deflater.ready || deflateReset(&stream) != Z_OK) {
+        return 0;
+    }
+    stream.next_in   = const_cast<Bytef *>(data);
+    stream.avail_in  = size;
+    stream.next_out  = out;
+    stream.avail_out = out_size;
+    if (deflate(&stream, Z_FINISH) != Z_STREAM_END) {
+        return 0;
+    }
+    return out_size - stream.avail_out;
+}
+#endif
+
+//
+// No more lines go to the chunk: hand it to the packer thread.
+// Data stay readable in the chunk meanwhile.
+//
+void Scrollback::seal_chunk(Chunk &chunk)
+{
+    chunk.sealed   = true;
+    chunk.packing  = true;
+    chunk.raw_size = chunk.data.size();
+    pack_pending++;
+
+    PackJob job{ chunk.first_line, chunk.line_count, chunk.data.data(), chunk.data.size(),
+                 false, {}, {} };
+    {
+        std::lock_guard<std::mutex> lock(pack_mutex);
+        if (!packer.joinable()) {
+            packer = std::thread(&Scrollback::packer_loop, this);
+        }
+        pack_queue.push_back(std::move(job));
+    }
+    pack_wakeup.notify_one();
+}
+
+//
+// Body of the packer thread: take all queued jobs, do them out of the lock.
+//
+void Scrollback::packer_loop()
+{
+    std::unique_lock<std::mutex> lock(pack_mutex);
+    for (;;) {
+        pack_wakeup.wait(lock, [this] { return pack_stop || !pack_queue.empty(); });
+        if (pack_stop) {
+            return;
+        }
+        pack_work.swap(pack_queue);
+        pack_busy = true;
+        lock.unlock();
+
+        for (PackJob &job : pack_work) {
+            pack(job);
+        }
+
+        lock.lock();
+        for (PackJob &job : pack_work) {
+            packed.push_back(std::move(job));
+        }
+        pack_work.clear();
+        pack_busy = false;
+        packed_ready.store(true, std::memory_order_release);
+        pack_done.notify_all();
+    }
+}
+
+//
+// Build bloom filter of trigrams of all lines in the chunk,
+// and compress the data. Runs in the packer thread.
+//
+void Scrollback::pack(PackJob &job)
+{
+    pool.get(job.bloom, BLOOM_WORDS);
+    job.bloom.resize(BLOOM_WORDS);
+    const uint8_t *ptr = job.data;
+    for (uint32_t line = 0; line < job.line_count; ++line) {
+        uint32_t size       = get_varint(ptr);
+        const uint8_t *next = ptr + size;
+        if (size == 0) {
+            continue;
+        }
+
+        // Skip attributes. Spacers of wide characters are skipped too,
+        // as they are not in the search text.
+        int length = get_varint(ptr) >> 1;
+        for (int col = 0; col < length;) {
+            ptr += 6;
+            col += get_varint(ptr);
+        }
+        wchar_t prev[2] = { 0, 0 };
+        int count       = 0;
+        for (int col = 0; col < length; ++col) {
+            const wchar_t ch = get_char(ptr, nullptr);
+            if (ch == Char::WIDE_SPACER) {
+                continue;
+            }
+            if (++count >= 3) {
+                uint32_t bit = trigram_hash(prev[0], prev[1], ch, BLOOM_BITS_LOG2);
+                job.bloom[bit / 64] |= uint64_t(1) << (bit % 64);
+            }
+            prev[0] = prev[1];
+            prev[1] = ch;
+        }
+        ptr = next;
+    }
+
+    // Data move to a buffer of their size.
+    const uint8_t *bytes = job.data;
+    size_t size          = job.size;
+#ifdef HAVE_ZLIB
+    std::vector<uint8_t> compressed;
+    pool.get(compressed, compressBound(size));
+    compressed.resize(compressBound(size));
+    size_t packed_size = compress_data(bytes, size, compressed.data(), compressed.size());
+    if (packed_size > 0 && packed_size < size) {
+        bytes          = compressed.data();
+        size           = packed_size;
+        job.compressed = true;
+    }
+#endif
+    pool.get(job.packed, size);
+    job.packed.assign(bytes, bytes + size);
+#ifdef HAVE_ZLIB
+    pool.put(compressed);
+#endif
+}
+
+//
+// Put results of the packer into their chunks. The large buffers
+// go back to the pool, for the next chunks.
+//
+void Scrollback::install_packed()
+{
+    if (!packed_ready.load(std::memory_order_acquire)) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pack_mutex);
+        pack_install.swap(packed);
+        packed_ready.store(false, std::memory_order_relaxed);
+    }
+    for (PackJob &job : pack_install) {
+        auto it = std::upper_bound(chunks.begin(), chunks.end(), job.first_line,
+                                   [](uint64_t i, const Chunk &c) { return i < c.first_line; });
+        Chunk &chunk = *(it - 1);
+        memory_used -= chunk.data.capacity();
+        chunk.data.swap(job.packed);
+        chunk.bloom.swap(job.bloom);
+        chunk.compressed = job.compressed;
+        chunk.packing    = false;
+        memory_used += chunk.data.capacity() + chunk.bloom.capacity() * sizeof(uint64_t);
+        pool.put(job.packed);
+        pack_pending--;
+
+        // Decoded data now live in the cache, not in the chunk.
+        forget_cache(chunk.first_line);
+    }
+    pack_install.clear();
+}
+
+void Scrollback::finish_packing()
+{
+    if (pack_pending == 0) {
+        return;
+    }
+    {
+        std::unique_lock<std::mutex> lock(pack_mutex);
+        pack_done.wait(lock, [this] { return pack_queue.empty() && !pack_busy; });
+    }
+    install_packed();
+}
+
+//
+// Stop the packer thread. Jobs not done yet are dropped.
+//
+void Scrollback::stop_packer()
+{
+    if (!packer.joinable()) {
+        return;
+    }
+    {
+        std::lock_guard<std::mutex> lock(pack_mutex);
+        pack_stop = true;
+    }
+    pack_wakeup.notify_one();
+    packer.join();
+    for (auto *jobs : { &pack_queue, &packed }) {
+        for (PackJob &job : *jobs) {
+            pool.put(job.packed);
+            pool.put(job.bloom);
+        }
+        jobs->clear();
+    }
+}
+
+void Scrollback::forget_cache(uint64_t chunk_first_line)
+{
+    if (cached_chunk == chunk_first_line) {
+        cached_chunk = NO_CHUNK;
+    }
+}
+
+//
+// Spill or discard oldest chunks while over the limit.
+// Chunks which are being packed count with their full size. Only when
+// the oldest chunk is one of them, the packer is waited for: compressed,
+// the chunks may fit into the limit.
+//
+void Scrollback::enforce_limit()
+{
+    install_packed();
+    report_usage();
+    while (!chunks.empty() && (memory_used > memory_limit || pool.over_budget())) {
+        Chunk &chunk = chunks.front();
+        if (spill_data_fd >= 0 && !spill_failed && !chunk.sealed) {
+            seal_chunk(chunk);
+        }
+        if (chunk.packing) {
+            finish_packing();
+            report_usage();
+            continue;
+        }
+        forget_cache(chunk.first_line);
+        if (spill_data_fd >= 0 && !spill_failed) {
+            // Disk full or alike: fall back to discarding.
+            spill_failed = !spill_chunk(chunk);
+        }
+        memory_used -= chunk.data.capacity() + chunk.bloom.capacity() * sizeof(uint64_t);
+        if (spill_data_fd < 0 || spill_failed) {
+            first_line = chunk.first_line + chunk.line_count;
+        }
+        release_chunk(chunk);
+        chunks.pop_front();
+        report_usage();
+    }
+    if (chunks.empty() && (spill_data_fd < 0 || spill_failed)) {
+        first_line = next_line;
+    }
+}
+
+//
+// Map the file for reading, when the requested range is past
+// the current mapping.
+//
+static bool map_file(int fd, uint64_t file_size, uint64_t needed, const uint8_t *&map,
+                     size_t &map_size)
+{
+    if (needed <= map_size) {
+        return true;
+    }
+    if (map) {
+        munmap(const_cast<uint8_t *>(map), map_size);
+        map      = nullptr;
+        map_size = 0;
+    }
+    void *ptr = mmap(nullptr, file_size, PROT_READ, MAP_SHARED, fd, 0);
+    if (ptr == MAP_FAILED) {
+        return false;
+    }
+    map      = static_cast<const uint8_t *>(ptr);
+    map_size = file_size;
+    return true;
+}
+
+//
+// Get entries of spill index, mapping the index file as needed.
+//
+const Scrollback::SpillEntry *Scrollback::spill_entries() const
+{
+    const size_t index_size = spill_count * sizeof(SpillEntry);
+    if (!map_file(spill_index_fd, index_size, index_size, spill_index_map, spill_index_map_size)) {
+        return nullptr;
+    }
+    return reinterpret_cast<const SpillEntry *>(spill_index_map);
+}
+
+//
+// Get ordinal number of chunk containing given line:
+// spilled chunks go first, then chunks in memory.
+//
+size_t Scrollback::find_chunk(uint64_t index) const
+{
+    if (index < spill_end_line) {
+        const SpillEntry *entries = spill_entries();
+        if (!entries) {
+            return chunk_count(); // Not found
+        }
+        auto it = std::upper_bound(
+            entries, entries + spill_count, index,
+            [](uint64_t i, const SpillEntry &e) { return i < e.first_line; });
+        return (it - entries) - 1;
+    }
+    auto it = std::upper_bound(chunks.begin(), chunks.end(), index,
+                               [](uint64_t i, const Chunk &c) { return i < c.first_line; });
+    return spill_count + (it - chunks.begin()) - 1;
+}
+
+//
+// Locate data of the chunk: in the spill file, or in memory.
+//
+bool Scrollback::get_chunk(size_t ordinal, ChunkData &chunk) const
+{
+    if (ordinal < spill_count) {
+        const SpillEntry *entries = spill_entries();
+        if (!entries) {
+            return false;
+        }
+        const SpillEntry &entry = entries[ordinal];
+        if (!map_file(spill_data_fd, spill_data_size, entry.offset + entry.size, spill_data_map,
+                      spill_data_map_size)) {
+            return false;
+        }
+        chunk.first_line = entry.first_line;
+        chunk.line_count = entry.line_count;
+        chunk.bloom      = entry.bloom;
+        chunk.data       = spill_data_map + entry.offset;
+        chunk.size       = entry.size;
+        chunk.raw_size   = entry.raw_size;
+        chunk.compressed = entry.compressed != 0;
+        return true;
+    }
+    if (ordinal >= chunk_count()) {
+        return false;
+    }
+    const Chunk &found = chunks[ordinal - spill_count];
+    chunk.first_line   = found.first_line;
+    chunk.line_count   = found.line_count;
+    chunk.bloom        = found.bloom.empty() ? nullptr : found.bloom.data();
+    chunk.data         = found.data.data();
+    chunk.size         = found.data.size();
+    chunk.raw_size     = found.raw_size;
+    chunk.compressed   = found.compressed;
+    return true;
+}
+
+//
+// Get encoded line by number.
+// Only the chunk containing it is decompressed.
+//
+const uint8_t *Scrollback::find_line(uint64_t index) const
+{
+    ChunkData chunk;
+    if (!get_chunk(find_chunk(index), chunk)) {
+        return nullptr;
+    }
+    if (cached_chunk != chunk.first_line) {
+        cached_chunk   = chunk.first_line;
+        cache_scan_pos = 0;
+        cache_offsets.clear();
+#ifdef HAVE_ZLIB
+        if (chunk.compressed) {
+            uLongf size = chunk.raw_size;
+            cache.resize(size);
+            if (uncompress(cache.data(), &size, chunk.data, chunk.size) != Z_OK) {
+                cached_chunk = NO_CHUNK;
+                return nullptr;
+            }
+        }
+#endif
+    }
+    const uint8_t *bytes = chunk.compressed ? cache.data() : chunk.data;
+
+    // Find offsets of lines up to the requested one.
+    // Lines may be added to the last chunk later, so the scan continues where it stopped.
+    size_t line = index - chunk.first_line;
+    while (cache_offsets.size() <= line) {
+        cache_offsets.push_back(cache_scan_pos);
+        const uint8_t *ptr = &bytes[cache_scan_pos];
+        uint32_t size      = get_varint(ptr);
+        cache_scan_pos     = ptr - bytes + size;
+    }
+    const uint8_t *ptr = &bytes[cache_offsets[line]];
+    get_varint(ptr);
+    return ptr;
+}
+
+bool Scrollback::read_line(uint64_t index, wchar_t *text, CharAttr *attrs, int cols,
+                           std::vector<wchar_t> *combined) const
+{
+    int col            = 0;
+    bool wrapped       = false;
+    const uint8_t *ptr = (index >= first_line && index < next_line) ? find_line(index) : nullptr;
+    if (ptr) {
+        uint32_t header = get_varint(ptr);
+        int length      = header >> 1;
+        wrapped         = header & 1;
+        while (col < length) {
+            CharAttr attr;
+            attr.fg     = get_color(ptr);
+            attr.bg     = get_color(ptr);
+            int run_end = col + get_varint(ptr);
+            for (; col < run_end; ++col) {
+                if (col < cols) {
+                    attrs[col] = attr;
+                }
+            }
+        }
+        for (col = 0; col < length; ++col) {
+            wchar_t ch = get_char(ptr, col < cols ? combined : nullptr);
+            if (col < cols) {
+                text[col] = ch;
+            }
+        }
+        col = std::min(length, cols);
+    }
+    std::fill(text + col, text + cols, L' ');
+    std::fill(attrs + col, attrs + cols, CharAttr());
+    return wrapped;
+}
+
+//
+// Decode all lines of memory chunks, join wrapped ones, and store them again
+// split at the new width. Old chunks are released one by one.
+//
+void Scrollback::rewrap(int cols)
+{
+    if (cols == line_width && !width_changed) {
+        return;
+    }
+    line_width    = cols;
+    width_changed = false;
+    if (chunks.empty()) {
+        return;
+    }
+    finish_packing();
+
+    std::deque<Chunk> old_chunks;
+    old_chunks.swap(chunks);
+    for (const Chunk &chunk : old_chunks) {
+        memory_used -= chunk.data.capacity() + chunk.bloom.capacity() * sizeof(uint64_t);
+    }
+    next_line    = old_chunks.front().first_line;
+    cached_chunk = NO_CHUNK;
+
+    // Text of a logical line: wrapped lines joined together.
+    std::vector<wchar_t> text;
+    std::vector<wchar_t> combined; // Characters with combining marks of the text
+    std::vector<CharAttr> line_attrs;
+    std::vector<Char> cells(cols);
+    std::vector<CharAttr> table(cols);
+    auto emit = [&](bool wrapped) {
+        // Each run of attributes gets own entry in the table.
+        size_t pos = 0;
+        do {
+            int length = std::min<size_t>(cols, text.size() - pos);
+            int runs   = 0;
+            if (length == cols && cols > 1 && pos + length < text.size() &&
+                text[pos + length] == Char::WIDE_SPACER) {
+                // Wide character would be split: it moves to the next line.
+                --length;
+            }
+            for (int col = 0; col < length; ++col) {
+                if (col == 0 || !(line_attrs[pos + col] == line_attrs[pos + col - 1])) {
+                    table[runs++] = line_attrs[pos + col];
+                }
+                cells[col] = { text[pos + col], uint16_t(runs - 1) };
+            }
+            pos += length;
+            append_line(cells.data(), length, table.data(), wrapped || pos < text.size(),
+                        combined.data());
+        } while (pos < text.size());
+        text.clear();
+        line_attrs.clear();
+        combined.clear();
+    };
+
+    bool wrapped = false;
+    std::vector<uint8_t> unpacked;
+    while (!old_chunks.empty()) {
+        Chunk &chunk         = old_chunks.front();
+        const uint8_t *bytes = chunk.data.data();
+#ifdef HAVE_ZLIB
+        if (chunk.compressed) {
+            uLongf size = chunk.raw_size;
+            unpacked.resize(size);
+            if (uncompress(unpacked.data(), &size, chunk.data.data(), chunk.data.size()) !=
+                Z_OK) {
+                // Lines are lost: the numbering must stay contiguous.
+                unpacked.assign(chunk.line_count, 0);
+            }
+            bytes = unpacked.data();
+        }
+#endif
+        for (uint32_t line = 0; line < chunk.line_count; ++line) {
+            const uint8_t *ptr = bytes;
+            uint32_t size      = get_varint(ptr);
+            bytes              = ptr + size;
+            if (size == 0) {
+                emit(false);
+                continue;
+            }
+            uint32_t header = get_varint(ptr);
+            size_t length   = header >> 1;
+            wrapped         = header & 1;
+
+            size_t start = text.size();
+            text.resize(start + length);
+            line_attrs.resize(start + length);
+            for (size_t col = 0; col < length;) {
+                CharAttr attr;
+                attr.fg        = get_color(ptr);
+                attr.bg        = get_color(ptr);
+                size_t run_end = col + get_varint(ptr);
+                std::fill(line_attrs.begin() + start + col, line_attrs.begin() + start + run_end,
+                          attr);
+                col = run_end;
+            }
+            for (size_t col = 0; col < length; ++col) {
+                text[start + col] = get_char(ptr, &combined);
+            }
+            if (!wrapped) {
+                emit(false);
+            }
+        }
+        release_chunk(chunk);
+        old_chunks.pop_front();
+    }
+    if (wrapped) {
+        // Tail continues on the screen.
+        emit(true);
+    }
+    report_usage();
+}
+
+int Scrollback::find_text(const wchar_t *str, int length, const std::wstring &text)
+{
+    const int size = text.size();
+    if (size == 0) {
+        return -1;
+    }
+
+    // Library routines are vectorized: find first character, then compare the rest.
+    // Spacers of wide characters in the line are skipped.
+    for (int pos = 0; pos + size <= length;) {
+        const wchar_t *hit = wmemchr(str + pos, text[0], length - size + 1 - pos);
+        if (!hit) {
+            return -1;
+        }
+        pos = hit - str;
+        if (wmemcmp(hit + 1, text.data() + 1, size - 1) == 0) {
+            return pos;
+        }
+        int k = 1;
+        for (int i = 1; k < size && pos + i < length; ++i) {
+            if (hit[i] == Char::WIDE_SPACER) {
+                continue;
+            }
+            if (hit[i] != text[k]) {
+                break;
+            }
+            ++k;
+        }
+        if (k == size) {
+            return pos;
+        }
+        ++pos;
+    }
+    return -1;
+}
+
+//
+// Look for text in lines of the chunk, starting from given line.
+//
+bool Scrollback::search_chunk(const ChunkData &chunk, const std::wstring &text, uint64_t from,
+                              bool backward, uint64_t &found_line, int &found_col) const
+{
+    const uint64_t low  = std::max(chunk.first_line, first_line);
+    const uint64_t high = chunk.first_line + chunk.line_count;
+    for (uint64_t index = from; index >= low && index < high; backward ? --index : ++index) {
+        const uint8_t *ptr = find_line(index);
+        if (!ptr) {
+            return false;
+        }
+
+        // Skip attributes, get the text.
+        int length = get_varint(ptr) >> 1;
+        for (int col = 0; col < length;) {
+            ptr += 6;
+            col += get_varint(ptr);
+        }
+        search_text.resize(length);
+        for (int col = 0; col < length; ++col) {
+            search_text[col] = get_char(ptr, nullptr);
+        }
+
+        int col = find_text(search_text.data(), length, text);
+        if (col >= 0) {
+            found_line = index;
+            found_col  = col;
+            return true;
+        }
+        if (backward && index == 0) {
+            break;
+        }
+    }
+    return false;
+}
+
+bool Scrollback::search(const std::wstring &text, uint64_t from, bool backward,
+                        uint64_t &found_line, int &found_col) const
+{
+    if (text.empty() || first_line == next_line) {
+        return false;
+    }
+    if (backward) {
+        if (from < first_line) {
+            return false;
+        }
+        from = std::min(from, next_line - 1);
+    } else {
+        if (from >= next_line) {
+            return false;
+        }
+        from = std::max(from, first_line);
+    }
+
+    // Trigrams of the text: a chunk can match only when all of them are in its filter.
+    std::vector<uint32_t> trigrams;
+    for (size_t i = 0; i + 2 < text.size(); ++i) {
+        trigrams.push_back(trigram_hash(text[i], text[i + 1], text[i + 2], BLOOM_BITS_LOG2));
+    }
+
+    for (size_t ordinal = find_chunk(from); ordinal < chunk_count();) {
+        ChunkData chunk;
+        if (!get_chunk(ordinal, chunk)) {
+            return false;
+        }
+        // Chunks without filter, not packed yet, are always searched.
+        bool may_match = !chunk.bloom ||
+                         std::all_of(trigrams.begin(), trigrams.end(), [&chunk](uint32_t bit) {
+                             return chunk.bloom[bit / 64] & (uint64_t(1) << (bit % 64));
+                         });
+        if (may_match && search_chunk(chunk, text, from, backward, found_line, found_col)) {
+            return true;
+        }
+
+        // Continue with neighbouring chunk.
+        if (backward) {
+            if (ordinal == 0 || chunk.first_line <= first_line) {
+                break;
+            }
+            --ordinal;
+            from = chunk.first_line - 1;
+        } else {
+            ++ordinal;
+            from = chunk.first_line + chunk.line_count;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,238 @@
+//
+// Scrollback history of the terminal emulator.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#ifndef SCROLLBACK_H
+#define SCROLLBACK_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "ansi_logic.h"
+
+class MemoryPool;
+
+//
+// Lines scrolled off the top of the screen.
+// Lines are encoded compactly: trailing blanks are dropped, attributes
+// are stored once per run of equal cells. Encoded lines are collected
+// in chunks. Full chunks are handed to a background thread, which builds
+// their search filters and compresses them, so that the thread feeding
+// the lines does not wait for zlib. When total size exceeds
+// the limit, or memory of all sessions exceeds the budget of the pool,
+// oldest chunks are discarded, or moved to a spill file when it is enabled.
+// Buffers of chunks come from the pool and return there.
+//
+// Lines are numbered from the start of the session, so that numbers
+// stay valid when old lines are dropped.
+//
+class Scrollback {
+public:
+    // Default limit of memory for the history.
+    static constexpr size_t DEFAULT_LIMIT = 16 * 1024 * 1024;
+
+    explicit Scrollback(size_t limit = DEFAULT_LIMIT);
+
+    // Buffers of chunks are taken from given pool.
+    explicit Scrollback(MemoryPool &pool, size_t limit = DEFAULT_LIMIT)
+        : pool(pool), memory_limit(limit)
+    {
+    }
+    ~Scrollback();
+    Scrollback(const Scrollback &)            = delete;
+    Scrollback &operator=(const Scrollback &) = delete;
+
+    // Set limit of memory; zero disables the history.
+    void set_limit(size_t bytes);
+
+    // Instead of discarding old chunks, append them to a file in given directory.
+    // The file is removed right away, and disappears when closed.
+    // Return false on failure, with errno set.
+    bool enable_spill(const std::string &directory);
+
+    // Append a line of cells with attributes from given table.
+    // Wrapped line continues on the next one: it was split at the right margin.
+    // Text of characters with combining marks is copied from the combined table.
+    void push_line(const Char *cells, int cols, const CharAttr *attrs, bool wrapped = false,
+                   const wchar_t *combined = nullptr);
+
+    // Wrap lines in memory again at given width, when the width has changed.
+    // Spilled lines keep their layout. Line numbers after the spill change.
+    void rewrap(int cols);
+
+    // Range of line numbers available.
+    uint64_t begin() const { return first_line; }
+    uint64_t end() const { return next_line; }
+
+    // Wait until the background thread has compressed all full chunks.
+    void finish_packing();
+
+    // Decode line into array of characters and attributes, cols entries each.
+    // Data past the stored length are filled with blanks.
+    // Characters with combining marks are appended to the combined table, and
+    // refer to it like cells of AnsiLogic; without the table, base characters are given.
+    // Return true when the line is wrapped.
+    bool read_line(uint64_t index, wchar_t *text, CharAttr *attrs, int cols,
+                   std::vector<wchar_t> *combined = nullptr) const;
+
+    // Memory occupied by stored lines.
+    size_t get_memory_usage() const { return memory_used; }
+
+    // Find line containing given text, starting from line `from`
+    // towards older lines (backward) or newer ones.
+    // Only chunks which may contain all trigrams of the text are decoded.
+    // Return true, with number of the line and column of the match.
+    bool search(const std::wstring &text, uint64_t from, bool backward, uint64_t &found_line,
+                int &found_col) const;
+
+    // Position of text in array of characters, or -1.
+    static int find_text(const wchar_t *str, int length, const std::wstring &text);
+
+private:
+    // Size of encoded lines in a chunk, before compression.
+    static constexpr size_t CHUNK_SIZE = 64 * 1024;
+
+    // Bloom filter of character trigrams in a chunk, for search.
+    static constexpr int BLOOM_BITS_LOG2 = 14;
+    static constexpr int BLOOM_WORDS     = (1 << BLOOM_BITS_LOG2) / 64;
+
+    struct Chunk {
+        uint64_t first_line{ 0 };    // Number of first line in the chunk
+        uint32_t line_count{ 0 };    // Number of lines in the chunk
+        bool sealed{ false };        // Full, no more lines to be added
+        bool packing{ false };       // Sealed, given to the packer; data are not changed
+        bool compressed{ false };    // Data are compressed
+        size_t raw_size{ 0 };        // Size of data before compression
+        std::vector<uint8_t> data;   // Encoded lines, each prefixed with size
+        std::vector<uint64_t> bloom; // Trigrams of the lines, empty until packed
+    };
+
+    // Sealed chunk for the packer thread. Data are read in place, in the chunk.
+    struct PackJob {
+        uint64_t first_line;
+        uint32_t line_count;
+        const uint8_t *data;
+        size_t size;
+        bool compressed;
+        std::vector<uint8_t> packed; // Data of the chunk, in a buffer of their size
+        std::vector<uint64_t> bloom;
+    };
+
+    // Entry of spill index: where to find the chunk in the data file.
+    struct SpillEntry {
+        uint64_t first_line;
+        uint64_t offset;
+        uint32_t size;
+        uint32_t raw_size;
+        uint32_t line_count;
+        uint32_t compressed;
+        uint64_t bloom[BLOOM_WORDS];
+    };
+
+    // Location of chunk data, in memory or in the spill file.
+    struct ChunkData {
+        uint64_t first_line;
+        uint32_t line_count;
+        const uint64_t *bloom; // Null when the chunk is not packed yet
+        const uint8_t *data;
+        size_t size;
+        size_t raw_size;
+        bool compressed;
+    };
+
+    MemoryPool &pool;
+    size_t memory_limit;
+    size_t memory_used{ 0 };
+    size_t reported_usage{ 0 }; // Part of memory_used known to the pool
+    uint64_t first_line{ 0 };
+    uint64_t next_line{ 0 };
+    std::deque<Chunk> chunks;
+    std::vector<uint8_t> record; // Line being encoded, with room for size prefix
+    int line_width{ 0 };         // Width of lines pushed last
+    bool width_changed{ false }; // Lines of different width are stored
+
+    // Spilled chunks: lines before spill_end_line are in the files.
+    // Both files are append-only, and mapped into memory for reading.
+    int spill_data_fd{ -1 };
+    int spill_index_fd{ -1 };
+    uint64_t spill_data_size{ 0 };
+    uint64_t spill_count{ 0 };
+    uint64_t spill_end_line{ 0 };
+    bool spill_failed{ false }; // Write error: old chunks are discarded again
+    mutable const uint8_t *spill_data_map{ nullptr };
+    mutable size_t spill_data_map_size{ 0 };
+    mutable const uint8_t *spill_index_map{ nullptr };
+    mutable size_t spill_index_map_size{ 0 };
+
+    // One chunk is kept decoded for reading, with offsets of its lines.
+    // Chunks are identified by number of their first line.
+    static constexpr uint64_t NO_CHUNK = UINT64_MAX;
+    mutable uint64_t cached_chunk{ NO_CHUNK };
+    mutable std::vector<uint8_t> cache;
+    mutable std::vector<uint32_t> cache_offsets;
+    mutable size_t cache_scan_pos{ 0 };
+    mutable std::vector<wchar_t> search_text; // Line decoded for search
+
+    // Packer thread, started with the first full chunk. Jobs go from queue
+    // to the thread, then to packed, and back to the owner, who installs
+    // the results. Vectors are swapped, so that their storage is reused.
+    std::thread packer;
+    std::mutex pack_mutex;
+    std::condition_variable pack_wakeup; // New jobs, or stop
+    std::condition_variable pack_done;   // Jobs finished
+    std::vector<PackJob> pack_queue;     // Waiting for the thread
+    std::vector<PackJob> pack_work;      // Taken by the thread
+    std::vector<PackJob> packed;         // Finished, not installed yet
+    std::vector<PackJob> pack_install;   // Being installed by the owner
+    std::atomic<bool> packed_ready{ false };
+    bool pack_busy{ false };
+    bool pack_stop{ false };
+    size_t pack_pending{ 0 }; // Sealed chunks not installed, known to the owner only
+
+    void append_line(const Char *cells, int length, const CharAttr *attrs, bool wrapped,
+                     const wchar_t *combined);
+    void seal_chunk(Chunk &chunk);
+    void packer_loop();
+    void pack(PackJob &job);
+    void install_packed();
+    void stop_packer();
+    bool spill_chunk(const Chunk &chunk);
+    void enforce_limit();
+    void release_chunk(Chunk &chunk);
+    void report_usage();
+    void forget_cache(uint64_t chunk_first_line);
+    size_t chunk_count() const { return spill_count + chunks.size(); }
+    const SpillEntry *spill_entries() const;
+    size_t find_chunk(uint64_t index) const;
+    bool get_chunk(size_t ordinal, ChunkData &chunk) const;
+    bool search_chunk(const ChunkData &chunk, const std::wstring &text, uint64_t from,
+                      bool backward, uint64_t &found_line, int &found_col) const;
+    const uint8_t *find_line(uint64_t index) const;
+};
+
+#endif // SCROLLBACK_H
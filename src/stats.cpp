@@ -0,0 +1,107 @@
+//
+// Performance statistics of the terminal emulator.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#include "stats.h"
+
+#include <algorithm>
+
+std::atomic<Stats::Block *> Stats::blocks{ nullptr };
+
+//
+// Add block of the calling thread to the list. Lock-free push:
+// blocks are only added, so readers can walk the list at any time.
+//
+Stats::Block *Stats::register_block()
+{
+    Block *block = new Block;
+    block->next  = blocks.load(std::memory_order_relaxed);
+    while (!blocks.compare_exchange_weak(block->next, block, std::memory_order_release,
+                                         std::memory_order_relaxed)) {
+    }
+    return block;
+}
+
+void Stats::collect(Snapshot &snap)
+{
+    snap = Snapshot();
+    const Block *block = blocks.load(std::memory_order_acquire);
+    for (; block; block = block->next) {
+        for (int c = 0; c < COUNTER_COUNT; ++c) {
+            snap.counters[c] += block->counters[c].load(std::memory_order_relaxed);
+        }
+        for (int h = 0; h < HISTOGRAM_COUNT; ++h) {
+            for (int b = 0; b < BUCKET_COUNT; ++b) {
+                snap.buckets[h][b] += block->buckets[h][b].load(std::memory_order_relaxed);
+            }
+            snap.sums[h] += block->sums[h].load(std::memory_order_relaxed);
+        }
+    }
+}
+
+Stats::Snapshot Stats::Snapshot::operator-(const Snapshot &earlier) const
+{
+    Snapshot diff;
+    for (int c = 0; c < COUNTER_COUNT; ++c) {
+        diff.counters[c] = counters[c] - earlier.counters[c];
+    }
+    for (int h = 0; h < HISTOGRAM_COUNT; ++h) {
+        for (int b = 0; b < BUCKET_COUNT; ++b) {
+            diff.buckets[h][b] = buckets[h][b] - earlier.buckets[h][b];
+        }
+        diff.sums[h] = sums[h] - earlier.sums[h];
+    }
+    return diff;
+}
+
+uint64_t Stats::Snapshot::count(Histogram h) const
+{
+    uint64_t total = 0;
+    for (int b = 0; b < BUCKET_COUNT; ++b) {
+        total += buckets[h][b];
+    }
+    return total;
+}
+
+uint64_t Stats::Snapshot::mean(Histogram h) const
+{
+    uint64_t total = count(h);
+    return total ? sums[h] / total : 0;
+}
+
+uint64_t Stats::Snapshot::percentile(Histogram h, double fraction) const
+{
+    const uint64_t total = count(h);
+    if (total == 0) {
+        return 0;
+    }
+    const uint64_t target = std::max<uint64_t>(1, uint64_t(total * fraction + 0.5));
+    uint64_t seen         = 0;
+    for (int b = 0; b < BUCKET_COUNT; ++b) {
+        seen += buckets[h][b];
+        if (seen >= target) {
+            // Bucket b holds values below 2^b.
+            return b == 0 ? 0 : (uint64_t(1) << b) - 1;
+        }
+    }
+    return UINT64_MAX;
+}
@@ -0,0 +1,153 @@
+//
+// Performance statistics of the terminal emulator.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+
+//
+// Counters and histograms of the hot paths.
+// Each thread updates its own block with plain relaxed stores, so there are
+// no locks nor atomic read-modify-write on the hot path. Blocks of all threads
+// are summed when the statistics are collected.
+// Without WITH_STATS all updates compile to nothing.
+//
+class Stats {
+public:
+    enum Counter {
+        PTY_WAKEUPS,      // Reads of PTY after poll
+        PTY_BYTES,        // Bytes read from PTY
+        ESCAPE_SEQUENCES, // Escape sequences parsed
+        FRAMES,           // Frames drawn
+        ROWS_DRAWN,       // Rows with changed cells sent to curses
+        CELLS_DRAWN,      // Cells sent to curses
+        COUNTER_COUNT
+    };
+
+    enum Histogram {
+        BYTES_PER_WAKEUP, // Bytes
+        PARSE_TIME,       // Nanoseconds in AnsiLogic::process_input()
+        RENDER_TIME,      // Nanoseconds to compose a frame for curses
+        REFRESH_TIME,     // Nanoseconds in refresh()
+        ROWS_PER_FRAME,   // Rows
+        HISTOGRAM_COUNT
+    };
+
+    // Histogram bucket N holds values of N significant bits.
+    static constexpr int BUCKET_COUNT = 48;
+
+    struct Snapshot {
+        uint64_t counters[COUNTER_COUNT]{};
+        uint64_t buckets[HISTOGRAM_COUNT][BUCKET_COUNT]{};
+        uint64_t sums[HISTOGRAM_COUNT]{};
+
+        // Changes since the earlier snapshot.
+        Snapshot operator-(const Snapshot &earlier) const;
+
+        uint64_t count(Histogram h) const;
+        uint64_t mean(Histogram h) const;
+
+        // Upper bound of the value below which given fraction of samples fall.
+        uint64_t percentile(Histogram h, double fraction) const;
+    };
+
+#ifdef WITH_STATS
+    static constexpr bool ENABLED = true;
+
+    static void add(Counter c, uint64_t n = 1) { bump(local().counters[c], n); }
+
+    static void record(Histogram h, uint64_t value)
+    {
+        Block &block = local();
+        bump(block.buckets[h][bucket(value)], 1);
+        bump(block.sums[h], value);
+    }
+#else
+    static constexpr bool ENABLED = false;
+
+    static void add(Counter, uint64_t = 1) {}
+    static void record(Histogram, uint64_t) {}
+#endif
+
+    // Sum of all threads.
+    static void collect(Snapshot &snap);
+
+    static int bucket(uint64_t value)
+    {
+        return value == 0 ? 0 : std::min(64 - __builtin_clzll(value), BUCKET_COUNT - 1);
+    }
+
+private:
+    // Counters of one thread. Blocks are never freed, so that
+    // counts of finished threads are kept.
+    struct Block {
+        std::atomic<uint64_t> counters[COUNTER_COUNT]{};
+        std::atomic<uint64_t> buckets[HISTOGRAM_COUNT][BUCKET_COUNT]{};
+        std::atomic<uint64_t> sums[HISTOGRAM_COUNT]{};
+        Block *next{ nullptr };
+    };
+
+    // Only the owner thread writes: no need for atomic increment.
+    static void bump(std::atomic<uint64_t> &value, uint64_t n)
+    {
+        value.store(value.load(std::memory_order_relaxed) + n, std::memory_order_relaxed);
+    }
+
+    static Block &local()
+    {
+        thread_local Block *block = register_block();
+        return *block;
+    }
+
+    static Block *register_block();
+    static std::atomic<Block *> blocks;
+};
+
+//
+// Record time of the scope, in nanoseconds.
+//
+class StatsTimer {
+public:
+#ifdef WITH_STATS
+    explicit StatsTimer(Stats::Histogram h) : histogram(h), start(Clock::now()) {}
+    ~StatsTimer()
+    {
+        Stats::record(histogram, std::chrono::duration_cast<std::chrono::nanoseconds>(
+                                     Clock::now() - start)
+                                     .count());
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+    Stats::Histogram histogram;
+    Clock::time_point start;
+#else
+    explicit StatsTimer(Stats::Histogram) {}
+#endif
+};
+
+#endif // STATS_H
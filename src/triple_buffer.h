@@ -0,0 +1,69 @@
+//
+// Triple buffer for passing data between threads.
+//
+// Copyright (c) 2025 Serge Vakulenko
+//
+// Permission is hereby granted, free of charge, to any person obtaining a copy
+// of this software and associated documentation files (the "Software"), to deal
+// in the Software without restriction, including without limitation the rights
+// to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+// copies of the Software, and to permit persons to whom the Software is
+// furnished to do so, subject to the following conditions:
+//
+// The above copyright notice and this permission notice shall be included in all
+// copies or substantial portions of the Software.
+//
+// THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+// IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+// FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+// AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+// LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+// OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE
+// SOFTWARE.
+//
+#ifndef TRIPLE_BUFFER_H
+#define TRIPLE_BUFFER_H
+
+#include <atomic>
+
+//
+// Lock-free handoff of values from one producer to one consumer.
+// The producer fills back() and calls publish(); the consumer calls
+// acquire() and reads front(). Each side owns its slot exclusively,
+// the third slot holds the latest published value in between.
+// The consumer always gets the newest value, intermediate ones are skipped.
+//
+template <typename T>
+class TripleBuffer {
+public:
+    T &back() { return slots[back_index]; }
+    const T &front() const { return slots[front_index]; }
+
+    // Make back() visible to the consumer, and get another slot to fill.
+    void publish()
+    {
+        back_index = middle.exchange(back_index | FRESH, std::memory_order_acq_rel) & INDEX_MASK;
+    }
+
+    // Take the latest published value, if any.
+    // Return false when nothing was published since last call.
+    bool acquire()
+    {
+        if (!(middle.load(std::memory_order_relaxed) & FRESH)) {
+            return false;
+        }
+        front_index = middle.exchange(front_index, std::memory_order_acq_rel) & INDEX_MASK;
+        return true;
+    }
+
+private:
+    static constexpr unsigned INDEX_MASK = 3;
+    static constexpr unsigned FRESH      = 4; // Middle slot was not acquired yet
+
+    T slots[3];
+    unsigned back_index{ 0 };
+    unsigned front_index{ 1 };
+    std::atomic<unsigned> middle{ 2 };
+};
+
+#endif // TRIPLE_BUFFER_H
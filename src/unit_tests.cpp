@@ -23,12 +23,43 @@
 //
 #include <gtest/gtest.h>
 
+#include <cwchar>
+#include <set>
+#include <thread>
+
 #include "ansi_logic.h"
+#include "char_width.h"
+#include "memory_pool.h"
+#include "recording.h"
+#include "scrollback.h"
+#include "stats.h"
+#include "triple_buffer.h"
+
+// Get list of dirty rows and reset dirty state
+static std::vector<int> take_dirty_rows(AnsiLogic &logic)
+{
+    std::vector<int> dirty_rows;
+    for (int r = logic.next_dirty_row(0); r < logic.get_rows(); r = logic.next_dirty_row(r + 1)) {
+        dirty_rows.push_back(r);
+    }
+    logic.clear_dirty();
+    return dirty_rows;
+}
+
+// Feed a string to the terminal
+static void send(AnsiLogic &logic, const std::string &input)
+{
+    logic.process_input(input.data(), input.size());
+}
 
 // Test fixture for AnsiLogic
 class AnsiLogicTest : public ::testing::Test {
 protected:
-    void SetUp() override { logic = std::make_unique<AnsiLogic>(80, 24); }
+    void SetUp() override
+    {
+        logic = std::make_unique<AnsiLogic>(80, 24);
+        logic->clear_dirty();
+    }
 
     std::unique_ptr<AnsiLogic> logic;
 };
@@ -38,9 +69,10 @@ TEST_F(AnsiLogicTest, EscCResetsStateAndClearsScreen)
 {
     logic->current_attr.fg    = { 255, 0, 0 }; // Red foreground
     logic->cursor             = { 5, 10 };
-    logic->text_buffer[5][10] = { L'x', logic->current_attr };
+    logic->row(5)[10] = { L'x', logic->current_attr_index };
 
-    std::vector<int> dirty_rows = logic->process_input("\33c", 2);
+    logic->process_input("\33c", 2);
+    std::vector<int> dirty_rows = take_dirty_rows(*logic);
 
     EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[7]);
     EXPECT_EQ(logic->current_attr.bg, AnsiLogic::normal_colors[0]);
@@ -48,7 +80,7 @@ TEST_F(AnsiLogicTest, EscCResetsStateAndClearsScreen)
     EXPECT_EQ(logic->cursor.col, 0);
     for (int r = 0; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            EXPECT_EQ(logic->text_buffer[r][c].ch, L' ');
+            EXPECT_EQ(logic->row(r)[c].ch, L' ');
         }
     }
     std::vector<int> expected_dirty_rows;
@@ -63,42 +95,43 @@ TEST_F(AnsiLogicTest, EscKClearsLine)
 {
     logic->cursor = { 5, 10 };
     for (int c = 0; c < logic->get_cols(); ++c) {
-        logic->text_buffer[5][c] = { L'x', logic->current_attr };
+        logic->row(5)[c] = { L'x', logic->current_attr_index };
     }
 
     // Test mode 0: clear from cursor to end
     std::vector<int> dirty_rows;
-    logic->parse_ansi_sequence("[0K", dirty_rows);
+    send(*logic, "\033[0K");
+    dirty_rows = take_dirty_rows(*logic);
     for (int c = 0; c < 10; ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L'x');
+        EXPECT_EQ(logic->row(5)[c].ch, L'x');
     }
     for (int c = 10; c < logic->get_cols(); ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L' ');
+        EXPECT_EQ(logic->row(5)[c].ch, L' ');
     }
     EXPECT_EQ(dirty_rows, std::vector<int>({ 5 }));
 
     // Test mode 1: clear from start to cursor
     for (int c = 0; c < logic->get_cols(); ++c) {
-        logic->text_buffer[5][c] = { L'x', logic->current_attr };
+        logic->row(5)[c] = { L'x', logic->current_attr_index };
     }
-    dirty_rows.clear();
-    logic->parse_ansi_sequence("[1K", dirty_rows);
+    send(*logic, "\033[1K");
+    dirty_rows = take_dirty_rows(*logic);
     for (int c = 0; c <= 10; ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L' ');
+        EXPECT_EQ(logic->row(5)[c].ch, L' ');
     }
     for (int c = 11; c < logic->get_cols(); ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L'x');
+        EXPECT_EQ(logic->row(5)[c].ch, L'x');
     }
     EXPECT_EQ(dirty_rows, std::vector<int>({ 5 }));
 
     // Test mode 2: clear entire line
     for (int c = 0; c < logic->get_cols(); ++c) {
-        logic->text_buffer[5][c] = { L'x', logic->current_attr };
+        logic->row(5)[c] = { L'x', logic->current_attr_index };
     }
-    dirty_rows.clear();
-    logic->parse_ansi_sequence("[2K", dirty_rows);
+    send(*logic, "\033[2K");
+    dirty_rows = take_dirty_rows(*logic);
     for (int c = 0; c < logic->get_cols(); ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L' ');
+        EXPECT_EQ(logic->row(5)[c].ch, L' ');
     }
     EXPECT_EQ(dirty_rows, std::vector<int>({ 5 }));
 }
@@ -108,16 +141,19 @@ TEST_F(AnsiLogicTest, EscMSetsColors)
 {
     std::vector<int> dirty_rows;
 
-    logic->parse_ansi_sequence("[31m", dirty_rows); // Red foreground
+    send(*logic, "\033[31m"); // Red foreground
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[1]);
     EXPECT_TRUE(dirty_rows.empty());
 
-    logic->parse_ansi_sequence("[41m", dirty_rows); // Red background
+    send(*logic, "\033[41m"); // Red background
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[1]); // Foreground should remain red
     EXPECT_EQ(logic->current_attr.bg, AnsiLogic::normal_colors[1]);
     EXPECT_TRUE(dirty_rows.empty());
 
-    logic->parse_ansi_sequence("[0m", dirty_rows); // Reset
+    send(*logic, "\033[0m"); // Reset
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[7]);
     EXPECT_EQ(logic->current_attr.bg, AnsiLogic::normal_colors[0]);
     EXPECT_TRUE(dirty_rows.empty());
@@ -129,31 +165,32 @@ TEST_F(AnsiLogicTest, CursorMovement)
     logic->cursor = { 5, 10 };
     std::vector<int> dirty_rows;
 
-    logic->parse_ansi_sequence("[3;5H", dirty_rows); // Move to row 3, col 5
+    send(*logic, "\033[3;5H"); // Move to row 3, col 5
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->cursor.row, 2);
     EXPECT_EQ(logic->cursor.col, 4);
     EXPECT_EQ(dirty_rows, std::vector<int>({}));
 
-    dirty_rows.clear();
-    logic->parse_ansi_sequence("[2A", dirty_rows); // Up 2
+    send(*logic, "\033[2A"); // Up 2
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->cursor.row, 0);
     EXPECT_EQ(logic->cursor.col, 4);
     EXPECT_EQ(dirty_rows, std::vector<int>({}));
 
-    dirty_rows.clear();
-    logic->parse_ansi_sequence("[3B", dirty_rows); // Down 3
+    send(*logic, "\033[3B"); // Down 3
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->cursor.row, 3);
     EXPECT_EQ(logic->cursor.col, 4);
     EXPECT_EQ(dirty_rows, std::vector<int>({}));
 
-    dirty_rows.clear();
-    logic->parse_ansi_sequence("[5C", dirty_rows); // Right 5
+    send(*logic, "\033[5C"); // Right 5
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->cursor.row, 3);
     EXPECT_EQ(logic->cursor.col, 9);
     EXPECT_EQ(dirty_rows, std::vector<int>({}));
 
-    dirty_rows.clear();
-    logic->parse_ansi_sequence("[2D", dirty_rows); // Left 2
+    send(*logic, "\033[2D"); // Left 2
+    dirty_rows = take_dirty_rows(*logic);
     EXPECT_EQ(logic->cursor.row, 3);
     EXPECT_EQ(logic->cursor.col, 7);
     EXPECT_EQ(dirty_rows, std::vector<int>({}));
@@ -175,13 +212,13 @@ TEST_F(AnsiLogicTest, ShiftModifier)
 TEST_F(AnsiLogicTest, TextBufferInsertion)
 {
     logic->cursor             = { 5, 10 };
-    logic->text_buffer[5][10] = { L'x', logic->current_attr };
+    logic->row(5)[10] = { L'x', logic->current_attr_index };
 
     // Simulate printable character input
-    logic->text_buffer[5][10] = { L'y', logic->current_attr };
+    logic->row(5)[10] = { L'y', logic->current_attr_index };
     logic->cursor.col++;
 
-    EXPECT_EQ(logic->text_buffer[5][10].ch, L'y');
+    EXPECT_EQ(logic->row(5)[10].ch, L'y');
     EXPECT_EQ(logic->cursor.col, 11);
 }
 
@@ -190,11 +227,11 @@ TEST_F(AnsiLogicTest, ScrollUp)
 {
     // Fill the first row with 'a'
     for (int c = 0; c < logic->get_cols(); ++c) {
-        logic->text_buffer[0][c] = { L'a', logic->current_attr };
+        logic->row(0)[c] = { L'a', logic->current_attr_index };
     }
     // Fill the last row with 'b'
     for (int c = 0; c < logic->get_cols(); ++c) {
-        logic->text_buffer[logic->get_rows() - 1][c] = { L'b', logic->current_attr };
+        logic->row(logic->get_rows() - 1)[c] = { L'b', logic->current_attr_index };
     }
 
     // Set cursor to last row
@@ -203,23 +240,21 @@ TEST_F(AnsiLogicTest, ScrollUp)
 
     // Process a newline to trigger scroll
     const char input[] = "\n";
-    auto dirty_rows    = logic->process_input(input, 1);
+    logic->process_input(input, 1);
+    auto dirty_rows = take_dirty_rows(*logic);
 
     // Verify buffer shifted: first row is gone, second row now first, last row is blank
-    EXPECT_EQ(logic->text_buffer[0][0].ch, L' ');
-    EXPECT_EQ(logic->text_buffer[logic->get_rows() - 2][0].ch, L'b');
-    EXPECT_EQ(logic->text_buffer[logic->get_rows() - 1][0].ch, L' ');
+    EXPECT_EQ(logic->row(0)[0].ch, L' ');
+    EXPECT_EQ(logic->row(logic->get_rows() - 2)[0].ch, L'b');
+    EXPECT_EQ(logic->row(logic->get_rows() - 1)[0].ch, L' ');
 
     // Verify cursor is on the last row
     EXPECT_EQ(logic->cursor.row, logic->get_rows() - 1);
     EXPECT_EQ(logic->cursor.col, 0);
 
-    // Verify all rows are marked dirty
-    std::vector<int> expected_dirty_rows;
-    for (int r = 0; r < logic->get_rows(); ++r) {
-        expected_dirty_rows.push_back(r);
-    }
-    EXPECT_EQ(dirty_rows, expected_dirty_rows);
+    // Verify scroll is pending and only the new row is marked dirty
+    EXPECT_TRUE(logic->get_pending_scrolls().empty()); // Cleared by take_dirty_rows()
+    EXPECT_EQ(dirty_rows, std::vector<int>({ logic->get_rows() - 1 }));
 }
 
 // Test ESC [0J (clear from cursor to end of screen)
@@ -228,32 +263,33 @@ TEST_F(AnsiLogicTest, ClearScreenEsc0J)
     // Fill buffer with 'x'
     for (int r = 0; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            logic->text_buffer[r][c] = { L'x', logic->current_attr };
+            logic->row(r)[c] = { L'x', logic->current_attr_index };
         }
     }
     logic->cursor = { 5, 10 };
 
     // Process ESC [0J
     const char input[] = "\033[0J";
-    auto dirty_rows    = logic->process_input(input, 4);
+    logic->process_input(input, 4);
+    auto dirty_rows = take_dirty_rows(*logic);
 
     // Verify rows before cursor.row are unchanged
     for (int r = 0; r < 5; ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            EXPECT_EQ(logic->text_buffer[r][c].ch, L'x');
+            EXPECT_EQ(logic->row(r)[c].ch, L'x');
         }
     }
     // Verify cursor.row from cursor.col to end is cleared
     for (int c = 0; c < 10; ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L'x');
+        EXPECT_EQ(logic->row(5)[c].ch, L'x');
     }
     for (int c = 10; c < logic->get_cols(); ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L' ');
+        EXPECT_EQ(logic->row(5)[c].ch, L' ');
     }
     // Verify rows after cursor.row are cleared
     for (int r = 6; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            EXPECT_EQ(logic->text_buffer[r][c].ch, L' ');
+            EXPECT_EQ(logic->row(r)[c].ch, L' ');
         }
     }
 
@@ -275,32 +311,33 @@ TEST_F(AnsiLogicTest, ClearScreenEsc1J)
     // Fill buffer with 'x'
     for (int r = 0; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            logic->text_buffer[r][c] = { L'x', logic->current_attr };
+            logic->row(r)[c] = { L'x', logic->current_attr_index };
         }
     }
     logic->cursor = { 5, 10 };
 
     // Process ESC [1J
     const char input[] = "\033[1J";
-    auto dirty_rows    = logic->process_input(input, 4);
+    logic->process_input(input, 4);
+    auto dirty_rows = take_dirty_rows(*logic);
 
     // Verify rows before cursor.row are cleared
     for (int r = 0; r < 5; ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            EXPECT_EQ(logic->text_buffer[r][c].ch, L' ');
+            EXPECT_EQ(logic->row(r)[c].ch, L' ');
         }
     }
     // Verify cursor.row from start to cursor.col is cleared
     for (int c = 0; c <= 10; ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L' ');
+        EXPECT_EQ(logic->row(5)[c].ch, L' ');
     }
     for (int c = 11; c < logic->get_cols(); ++c) {
-        EXPECT_EQ(logic->text_buffer[5][c].ch, L'x');
+        EXPECT_EQ(logic->row(5)[c].ch, L'x');
     }
     // Verify rows after cursor.row are unchanged
     for (int r = 6; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            EXPECT_EQ(logic->text_buffer[r][c].ch, L'x');
+            EXPECT_EQ(logic->row(r)[c].ch, L'x');
         }
     }
 
@@ -322,19 +359,20 @@ TEST_F(AnsiLogicTest, ClearScreenEsc2J)
     // Fill buffer with 'x'
     for (int r = 0; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            logic->text_buffer[r][c] = { L'x', logic->current_attr };
+            logic->row(r)[c] = { L'x', logic->current_attr_index };
         }
     }
     logic->cursor = { 5, 10 };
 
     // Process ESC [2J
     const char input[] = "\033[2J";
-    auto dirty_rows    = logic->process_input(input, 4);
+    logic->process_input(input, 4);
+    auto dirty_rows = take_dirty_rows(*logic);
 
     // Verify entire buffer is cleared
     for (int r = 0; r < logic->get_rows(); ++r) {
         for (int c = 0; c < logic->get_cols(); ++c) {
-            EXPECT_EQ(logic->text_buffer[r][c].ch, L' ');
+            EXPECT_EQ(logic->row(r)[c].ch, L' ');
         }
     }
 
@@ -357,25 +395,1242 @@ TEST_F(AnsiLogicTest, Utf8Input)
     const char ascii[] = "a";
     logic->cursor      = { 5, 10 };
     logic->process_input(ascii, 1);
-    EXPECT_EQ(logic->text_buffer[5][10].ch, L'a');
+    EXPECT_EQ(logic->row(5)[10].ch, L'a');
 
     // Test 2-byte UTF-8 (Cyrillic 'Я')
     const char cyrillic[] = "\xD0\xAF";
     logic->cursor         = { 5, 11 };
     logic->process_input(cyrillic, 2);
-    EXPECT_EQ(logic->text_buffer[5][11].ch, 0x042F); // Я
+    EXPECT_EQ(logic->row(5)[11].ch, 0x042F); // Я
 
     // Test 3-byte UTF-8 (Euro symbol '€')
     const char euro[] = "\xE2\x82\xAC";
     logic->cursor     = { 5, 12 };
     logic->process_input(euro, 3);
-    EXPECT_EQ(logic->text_buffer[5][12].ch, 0x20AC); // €
+    EXPECT_EQ(logic->row(5)[12].ch, 0x20AC); // €
 
     // Test 4-byte UTF-8 (emoji '😀')
     const char emoji[] = "\xF0\x9F\x98\x80";
     logic->cursor      = { 5, 13 };
     logic->process_input(emoji, 4);
-    EXPECT_EQ(logic->text_buffer[5][13].ch, 0x1F600); // 😀
+    EXPECT_EQ(logic->row(5)[13].ch, 0x1F600); // 😀
+}
+
+// Test scrolling many times through the circular buffer
+TEST_F(AnsiLogicTest, ScrollWrapsAround)
+{
+    // Print more lines than the screen holds, so the buffer wraps around.
+    std::string input;
+    for (int n = 0; n < 50; ++n) {
+        input += std::to_string(n % 10) + "\n";
+    }
+    logic->process_input(input.data(), input.size());
+
+    // Lines 27..49 remain on screen, last row is blank.
+    for (int r = 0; r < logic->get_rows() - 1; ++r) {
+        EXPECT_EQ(logic->get_row(r)[0].ch, L'0' + (r + 27) % 10);
+        EXPECT_EQ(logic->get_row(r)[1].ch, L' ');
+    }
+    EXPECT_EQ(logic->get_row(logic->get_rows() - 1)[0].ch, L' ');
+    EXPECT_EQ(logic->cursor.row, logic->get_rows() - 1);
+}
+
+// Test that resize keeps rows in screen order after scrolling
+TEST_F(AnsiLogicTest, ResizeAfterScroll)
+{
+    std::string input;
+    for (int n = 0; n < 30; ++n) {
+        input += std::to_string(n % 10) + "\n";
+    }
+    logic->process_input(input.data(), input.size());
+    EXPECT_NE(logic->buffer_index(0), 0);
+
+    // Rows above the cursor move to the history, so that the cursor stays visible.
+    uint64_t history_size = logic->get_scrollback().end();
+    logic->resize(100, 10);
+    EXPECT_EQ(logic->buffer_index(0), 0);
+    EXPECT_EQ(logic->get_cols(), 100);
+    EXPECT_EQ(logic->get_rows(), 10);
+    EXPECT_EQ(logic->get_cursor().row, 9);
+    for (int r = 0; r < logic->get_rows() - 1; ++r) {
+        EXPECT_EQ(logic->get_row(r)[0].ch, L'0' + (r + 1) % 10);
+    }
+    EXPECT_EQ(logic->get_row(9)[0].ch, L' ');
+    EXPECT_EQ(logic->get_scrollback().end(), history_size + 14);
+}
+
+// Test that wrapped text is joined and split again at new width
+TEST_F(AnsiLogicTest, ResizeRewraps)
+{
+    logic->resize(10, 5);
+    const char input[] = "0123456789abcde\r\nxy";
+    logic->process_input(input, sizeof(input) - 1);
+    EXPECT_TRUE(logic->is_wrapped(0));
+    EXPECT_FALSE(logic->is_wrapped(1));
+
+    // Wider: the line is whole again.
+    logic->resize(20, 5);
+    EXPECT_EQ(std::wstring(&logic->get_row(0)[0].ch, 1), L"0");
+    EXPECT_EQ(logic->get_row(0)[14].ch, L'e');
+    EXPECT_FALSE(logic->is_wrapped(0));
+    EXPECT_EQ(logic->get_row(1)[0].ch, L'x');
+    EXPECT_EQ(logic->get_cursor().row, 1);
+    EXPECT_EQ(logic->get_cursor().col, 2);
+
+    // Narrower: the line takes three rows, the first one goes to the history.
+    logic->resize(6, 3);
+    EXPECT_EQ(logic->get_row(0)[0].ch, L'6');
+    EXPECT_EQ(logic->get_row(1)[0].ch, L'c');
+    EXPECT_EQ(logic->get_row(2)[0].ch, L'x');
+    EXPECT_TRUE(logic->is_wrapped(0));
+    EXPECT_FALSE(logic->is_wrapped(1));
+    EXPECT_EQ(logic->get_cursor().row, 2);
+    EXPECT_EQ(logic->get_cursor().col, 2);
+    logic->resize(6, 2);
+    EXPECT_EQ(logic->get_row(0)[0].ch, L'c');
+    EXPECT_EQ(logic->get_cursor().row, 1);
+
+    // History rejoins the rows on demand. The line continues on the screen.
+    Scrollback &history = logic->get_scrollback();
+    ASSERT_EQ(history.end(), 2u);
+    history.rewrap(20);
+    ASSERT_EQ(history.end(), 1u);
+    std::vector<wchar_t> text(20);
+    std::vector<CharAttr> attrs(20);
+    EXPECT_TRUE(history.read_line(0, text.data(), attrs.data(), 20));
+    EXPECT_EQ(std::wstring(text.data(), 13), L"0123456789ab ");
+}
+
+// Test that cells reference shared entries in the attribute table
+TEST_F(AnsiLogicTest, AttributeTable)
+{
+    EXPECT_EQ(sizeof(Char), 8u);
+
+    const char input[] = "a\033[31mb\033[0mc\033[31md";
+    logic->process_input(input, sizeof(input) - 1);
+
+    const Char *line = logic->get_row(0);
+    EXPECT_EQ(line[0].attr, 0);
+    EXPECT_NE(line[1].attr, 0);
+    EXPECT_EQ(line[2].attr, 0);
+    EXPECT_EQ(line[3].attr, line[1].attr);
+    EXPECT_EQ(logic->get_attr(line[1].attr).fg, AnsiLogic::normal_colors[1]);
+    EXPECT_EQ(logic->attr_table.size(), 2u);
+
+    // Many distinct colors get own entries, and are found again.
+    std::vector<uint16_t> indices;
+    for (int pass = 0; pass < 2; ++pass) {
+        for (int i = 0; i < 1000; ++i) {
+            const std::string sgr =
+                "\033[38;2;" + std::to_string(i & 0xff) + ";" + std::to_string(i >> 8) + ";0m";
+            logic->process_input(sgr.data(), sgr.size());
+            if (pass == 0) {
+                indices.push_back(logic->current_attr_index);
+            } else {
+                EXPECT_EQ(logic->current_attr_index, indices[i]);
+            }
+        }
+    }
+    EXPECT_EQ(std::set<uint16_t>(indices.begin(), indices.end()).size(), indices.size());
+}
+
+// Test removal of unused attributes when the table is full
+TEST_F(AnsiLogicTest, AttributeTableCompaction)
+{
+    const char red[] = "\033[31mx";
+    logic->process_input(red, sizeof(red) - 1);
+    uint16_t red_index = logic->get_row(0)[0].attr;
+
+    // Fill the table with entries not present on the screen.
+    while (logic->attr_table.size() < AnsiLogic::MAX_ATTRS) {
+        CharAttr attr;
+        attr.bg.r = logic->attr_table.size() & 0xff;
+        attr.bg.g = logic->attr_table.size() >> 8;
+        attr.bg.b = 1;
+        logic->attr_table.push_back(attr);
+    }
+
+    const char green[]  = "\033[32my";
+    unsigned generation = logic->get_attr_generation();
+    logic->process_input(green, sizeof(green) - 1);
+
+    EXPECT_EQ(logic->get_attr_generation(), generation + 1);
+    EXPECT_EQ(logic->attr_table.size(), 3u);
+    const Char *line = logic->get_row(0);
+    EXPECT_EQ(logic->get_attr(line[0].attr).fg, AnsiLogic::normal_colors[1]);
+    EXPECT_EQ(logic->get_attr(line[1].attr).fg, AnsiLogic::normal_colors[2]);
+    EXPECT_LE(line[0].attr, red_index);
+
+    // Lookup still works after renumbering.
+    logic->process_input(red, sizeof(red) - 1);
+    EXPECT_EQ(logic->get_row(0)[2].attr, line[0].attr);
+    EXPECT_EQ(logic->attr_table.size(), 3u);
+}
+
+// Test tracking of modified columns
+TEST_F(AnsiLogicTest, DirtySpans)
+{
+    logic->cursor      = { 3, 10 };
+    const char input[] = "abc";
+    logic->process_input(input, 3);
+    EXPECT_TRUE(logic->is_dirty(3));
+    EXPECT_EQ(logic->get_dirty_span(3).first_col, 10);
+    EXPECT_EQ(logic->get_dirty_span(3).last_col, 12);
+
+    // Erase to beginning of line extends the span.
+    send(*logic, "\033[1K");
+    EXPECT_EQ(logic->get_dirty_span(3).first_col, 0);
+    EXPECT_EQ(logic->get_dirty_span(3).last_col, 13);
+    EXPECT_EQ(take_dirty_rows(*logic), std::vector<int>({ 3 }));
+
+    // Cursor movement alone leaves the screen clean.
+    const char moves[] = "\r\n\033[5;5H";
+    logic->process_input(moves, sizeof(moves) - 1);
+    EXPECT_EQ(logic->next_dirty_row(0), logic->get_rows());
+
+    // Rows past the first 64-bit word of the bitset.
+    logic->resize(80, 100);
+    logic->clear_dirty();
+    logic->cursor = { 70, 0 };
+    logic->process_input(input, 1);
+    EXPECT_EQ(take_dirty_rows(*logic), std::vector<int>({ 70 }));
+}
+
+// Test views of cells: they point into the screen, dirty ones cover the changed columns
+TEST_F(AnsiLogicTest, CellSpans)
+{
+    send(*logic, "\033[3;11Habc\033[5;1Hxy");
+
+    CellSpan cells = logic->get_cells(2);
+    EXPECT_EQ(cells.size(), 80u);
+    EXPECT_EQ(cells.data(), logic->get_row(2));
+    EXPECT_EQ(cells[10].ch, L'a');
+    EXPECT_TRUE(cells.subspan(78, 10).size() == 2);
+
+    std::vector<std::wstring> changed;
+    std::vector<int> rows, cols;
+    logic->for_each_dirty_row([&](int row, int first_col, CellSpan span) {
+        rows.push_back(row);
+        cols.push_back(first_col);
+        std::wstring text;
+        for (const Char &c : span) {
+            text += c.ch;
+        }
+        changed.push_back(text);
+    });
+    EXPECT_EQ(rows, std::vector<int>({ 2, 4 }));
+    EXPECT_EQ(cols, std::vector<int>({ 10, 0 }));
+    EXPECT_EQ(changed, std::vector<std::wstring>({ L"abc", L"xy" }));
+}
+
+// Test that dirty rows move along with scrolled contents
+TEST_F(AnsiLogicTest, PendingScroll)
+{
+    // Modify row 10, then scroll the screen by 3 lines.
+    logic->cursor = { 10, 5 };
+    logic->process_input("x", 1);
+    logic->cursor = { logic->get_rows() - 1, 0 };
+    logic->process_input("\n\n\n", 3);
+
+    ASSERT_EQ(logic->get_pending_scrolls().size(), 1u);
+    EXPECT_EQ(logic->get_pending_scrolls()[0].top, 0);
+    EXPECT_EQ(logic->get_pending_scrolls()[0].bottom, logic->get_rows() - 1);
+    EXPECT_EQ(logic->get_pending_scrolls()[0].lines, 3);
+    EXPECT_TRUE(logic->is_dirty(7));
+    EXPECT_EQ(logic->get_dirty_span(7).first_col, 5);
+    EXPECT_EQ(logic->get_dirty_span(7).last_col, 5);
+    EXPECT_EQ(take_dirty_rows(*logic), std::vector<int>({ 7, 21, 22, 23 }));
+    EXPECT_TRUE(logic->get_pending_scrolls().empty());
+
+    // Scrolling by a whole screen or more leaves every row dirty.
+    std::string input(logic->get_rows() + 5, '\n');
+    logic->process_input(input.data(), input.size());
+    EXPECT_EQ(take_dirty_rows(*logic).size(), size_t(logic->get_rows()));
+
+    // Full repaint cancels the pending scroll.
+    logic->process_input("\n\033[2J", 5);
+    EXPECT_TRUE(logic->get_pending_scrolls().empty());
+}
+
+// Test that a long run of ASCII text wraps to the next row
+TEST_F(AnsiLogicTest, AsciiRunWraps)
+{
+    std::string input(100, 'a');
+    input += "\tb";
+    logic->cursor = { 2, 0 };
+    logic->process_input(input.data(), input.size());
+
+    for (int c = 0; c < logic->get_cols(); ++c) {
+        EXPECT_EQ(logic->row(2)[c].ch, L'a');
+    }
+    for (int c = 0; c < 20; ++c) {
+        EXPECT_EQ(logic->row(3)[c].ch, L'a');
+    }
+    EXPECT_EQ(logic->row(3)[20].ch, L' ');
+    EXPECT_EQ(logic->row(3)[24].ch, L'b');
+    EXPECT_EQ(logic->cursor.row, 3);
+    EXPECT_EQ(logic->cursor.col, 25);
+    EXPECT_EQ(logic->get_dirty_span(3).first_col, 0);
+    EXPECT_EQ(logic->get_dirty_span(3).last_col, 24);
+}
+
+// Test parsing of CSI parameters
+TEST_F(AnsiLogicTest, CsiParameters)
+{
+    // Parameters split between calls.
+    send(*logic, "\033[1");
+    send(*logic, "2;3");
+    send(*logic, "4H");
+    EXPECT_EQ(logic->cursor.row, 11);
+    EXPECT_EQ(logic->cursor.col, 33);
+
+    // Empty parameters take default values.
+    send(*logic, "\033[;5H");
+    EXPECT_EQ(logic->cursor.row, 0);
+    EXPECT_EQ(logic->cursor.col, 4);
+
+    // Huge values saturate instead of overflowing.
+    send(*logic, "\033[99999999999999999999;99999999999999999999H");
+    EXPECT_EQ(logic->cursor.row, logic->get_rows() - 1);
+    EXPECT_EQ(logic->cursor.col, logic->get_cols() - 1);
+
+    // Extra parameters are ignored.
+    send(*logic, "\033[0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;0;31m");
+    EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[7]);
+
+    // Private and intermediate sequences are not mistaken for SGR.
+    send(*logic, "\033[>4;2m\033[31 m");
+    EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[7]);
+
+    // Final characters other than letters end the sequence.
+    send(*logic, "\033[H\033[2~x");
+    EXPECT_EQ(logic->row(logic->cursor.row)[logic->cursor.col - 1].ch, L'x');
+    EXPECT_EQ(logic->state, AnsiState::GROUND);
+}
+
+// Test SGR with colors of 256-color palette and direct colors
+TEST_F(AnsiLogicTest, ExtendedColors)
+{
+    send(*logic, "\033[38;5;196;48;5;21m");
+    EXPECT_EQ(logic->current_attr.fg, RgbColor(255, 0, 0));
+    EXPECT_EQ(logic->current_attr.bg, RgbColor(0, 0, 255));
+
+    // First 16 entries are the ANSI colors, last 24 are grays.
+    send(*logic, "\033[38;5;1;48;5;232m");
+    EXPECT_EQ(logic->current_attr.fg, AnsiLogic::normal_colors[1]);
+    EXPECT_EQ(logic->current_attr.bg, RgbColor(8, 8, 8));
+
+    send(*logic, "\033[38;2;10;20;30;48;2;300;0;1m");
+    EXPECT_EQ(logic->current_attr.fg, RgbColor(10, 20, 30));
+    EXPECT_EQ(logic->current_attr.bg, RgbColor(255, 0, 1));
+
+    // Colon form, with and without color space; parameters after it still apply.
+    send(*logic, "\033[38:2::1:2:3;48:5:16m");
+    EXPECT_EQ(logic->current_attr.fg, RgbColor(1, 2, 3));
+    EXPECT_EQ(logic->current_attr.bg, RgbColor(0, 0, 0));
+    send(*logic, "\033[38:2:4:5:6;41m");
+    EXPECT_EQ(logic->current_attr.fg, RgbColor(4, 5, 6));
+    EXPECT_EQ(logic->current_attr.bg, AnsiLogic::normal_colors[1]);
+
+    // Default colors, and truncated sequence.
+    send(*logic, "\033[39;49m");
+    EXPECT_EQ(logic->current_attr, CharAttr());
+    send(*logic, "\033[38;5m\033[38;2;1;2m");
+    EXPECT_EQ(logic->current_attr, CharAttr());
+
+    // Colors are stored in the attribute table.
+    send(*logic, "\033[38;5;82mx");
+    EXPECT_EQ(logic->get_attr(logic->get_row(0)[0].attr).fg, RgbColor(95, 255, 0));
+}
+
+// Test switching to alternate screen and back
+TEST_F(AnsiLogicTest, AlternateScreen)
+{
+    send(*logic, "main\r\nscreen");
+    const Char *main_cells = logic->text_buffer.data();
+
+    send(*logic, "\033[?1049h");
+    EXPECT_TRUE(logic->is_alt_screen());
+    EXPECT_EQ(logic->query_dec_mode(1049), 1);
+    EXPECT_EQ(logic->get_row(0)[0].ch, L' ');
+    EXPECT_TRUE(logic->is_dirty(logic->get_rows() - 1));
+
+    // Scrolling on the alternate screen does not go to the history.
+    logic->clear_dirty();
+    uint64_t history_size = logic->get_scrollback().end();
+    send(*logic, "\033[5;3Halt");
+    for (int n = 0; n < 30; ++n) {
+        send(*logic, "\n");
+    }
+    EXPECT_EQ(logic->get_scrollback().end(), history_size);
+
+    // Main screen comes back as it was, with the cursor. Cells are not copied.
+    send(*logic, "\033[?1049l");
+    EXPECT_FALSE(logic->is_alt_screen());
+    EXPECT_EQ(logic->text_buffer.data(), main_cells);
+    EXPECT_EQ(logic->get_row(0)[0].ch, L'm');
+    EXPECT_EQ(logic->get_row(1)[0].ch, L's');
+    EXPECT_EQ(logic->cursor.row, 1);
+    EXPECT_EQ(logic->cursor.col, 6);
+    EXPECT_TRUE(logic->is_dirty(0));
+
+    // Resize while on the alternate screen keeps the main screen.
+    send(*logic, "\033[?1049hfull");
+    logic->resize(40, 10);
+    EXPECT_EQ(logic->get_row(0)[0].ch, L' ');
+    send(*logic, "\033[?1049l");
+    EXPECT_EQ(logic->get_row(0)[0].ch, L'm');
+    EXPECT_EQ(logic->cursor.row, 1);
+}
+
+// Test scrolls inside of scroll region, and insert/delete lines
+TEST_F(AnsiLogicTest, ScrollRegion)
+{
+    for (int r = 0; r < logic->get_rows(); ++r) {
+        logic->row(r)[0] = { wchar_t(L'A' + r), 0 };
+    }
+    logic->clear_dirty();
+    uint64_t history_size = logic->get_scrollback().end();
+
+    // Region of rows 5...10: line feed at the bottom scrolls only the region.
+    send(*logic, "\033[6;11r");
+    EXPECT_EQ(logic->cursor.row, 0);
+    send(*logic, "\033[11H\n");
+    EXPECT_EQ(logic->cursor.row, 10);
+    EXPECT_EQ(logic->get_row(4)[0].ch, L'E');
+    EXPECT_EQ(logic->get_row(5)[0].ch, L'G');
+    EXPECT_EQ(logic->get_row(9)[0].ch, L'K');
+    EXPECT_EQ(logic->get_row(10)[0].ch, L' ');
+    EXPECT_EQ(logic->get_row(11)[0].ch, L'L');
+    EXPECT_EQ(logic->get_scrollback().end(), history_size);
+    ASSERT_EQ(logic->get_pending_scrolls().size(), 1u);
+    EXPECT_EQ(logic->get_pending_scrolls()[0].top, 5);
+    EXPECT_EQ(logic->get_pending_scrolls()[0].bottom, 10);
+    EXPECT_EQ(logic->get_pending_scrolls()[0].lines, 1);
+    EXPECT_EQ(take_dirty_rows(*logic), std::vector<int>({ 10 }));
+
+    // Reverse index at the top moves the region down.
+    send(*logic, "\033[6H\033M");
+    EXPECT_EQ(logic->get_row(5)[0].ch, L' ');
+    EXPECT_EQ(logic->get_row(6)[0].ch, L'G');
+    EXPECT_EQ(logic->get_row(10)[0].ch, L'K');
+    EXPECT_EQ(logic->get_pending_scrolls()[0].lines, -1);
+    EXPECT_EQ(take_dirty_rows(*logic), std::vector<int>({ 5 }));
+
+    // Delete and insert lines at the cursor.
+    send(*logic, "\033[8H\033[2M");
+    EXPECT_EQ(logic->get_row(6)[0].ch, L'G');
+    EXPECT_EQ(logic->get_row(7)[0].ch, L'J');
+    EXPECT_EQ(logic->get_row(9)[0].ch, L' ');
+    EXPECT_EQ(logic->get_row(11)[0].ch, L'L');
+    send(*logic, "\033[L");
+    EXPECT_EQ(logic->get_row(7)[0].ch, L' ');
+    EXPECT_EQ(logic->get_row(8)[0].ch, L'J');
+    EXPECT_EQ(take_dirty_rows(*logic), std::vector<int>({ 7, 10 })); // Blank row 9 moved to 10
+
+    // Scroll up and down by parameter.
+    send(*logic, "\033[2S");
+    EXPECT_EQ(logic->get_row(6)[0].ch, L'J');
+    send(*logic, "\033[T");
+    EXPECT_EQ(logic->get_row(7)[0].ch, L'J');
+
+    // Full region again: lines go to the history.
+    send(*logic, "\033[r\033[2S");
+    EXPECT_EQ(logic->get_row(0)[0].ch, L'C');
+    EXPECT_EQ(logic->get_scrollback().end(), history_size + 2);
+}
+
+// Test synchronized update mode and its query
+TEST_F(AnsiLogicTest, SynchronizedUpdate)
+{
+    EXPECT_FALSE(logic->is_synchronized_update());
+    send(*logic, "\033[?2026$p");
+    EXPECT_EQ(logic->get_reply(), "\033[?2026;2$y");
+    logic->clear_reply();
+
+    send(*logic, "\033[?2026h");
+    EXPECT_TRUE(logic->is_synchronized_update());
+    send(*logic, "\033[?2026$p\033[?1234$p");
+    EXPECT_EQ(logic->get_reply(), "\033[?2026;1$y\033[?1234;0$y");
+    logic->clear_reply();
+
+    // Private sequences do not touch the screen.
+    EXPECT_TRUE(take_dirty_rows(*logic).empty());
+    EXPECT_EQ(logic->cursor.row, 0);
+    EXPECT_EQ(logic->cursor.col, 0);
+
+    send(*logic, "\033[?2026l");
+    EXPECT_FALSE(logic->is_synchronized_update());
+
+    send(*logic, "\033[?2026h\033c");
+    EXPECT_FALSE(logic->is_synchronized_update());
+}
+
+// Test strings and sequences which must not leave text on the screen
+TEST_F(AnsiLogicTest, ControlStrings)
+{
+    auto text = [&](int r, int length) {
+        std::wstring str;
+        for (int col = 0; col < length; ++col) {
+            str += logic->get_row(r)[col].ch;
+        }
+        return str;
+    };
+
+    // Window title ends with BEL or with ST; title is kept in UTF-8.
+    send(*logic, "\033]0;first\007A\033]2;\xd0\xbf\xd1\x80\xd0\xb8\033\\B");
+    EXPECT_EQ(logic->get_title(), "\xd0\xbf\xd1\x80\xd0\xb8");
+    EXPECT_EQ(text(0, 3), L"AB ");
+
+    // Hyperlink: only the link text is shown.
+    send(*logic, "\033]8;;http://example.com\033\\link\033]8;;\033\\");
+    EXPECT_EQ(text(0, 7), L"ABlink ");
+
+    // Designation of character set, DCS and APC strings are skipped.
+    send(*logic, "\033(B\033P1$r0m\033\\\033_data\033\\C");
+    EXPECT_EQ(text(0, 8), L"ABlinkC ");
+    EXPECT_EQ(logic->state, AnsiState::GROUND);
+
+    // Malformed CSI is consumed up to the final byte.
+    send(*logic, "\033[1?2HD");
+    EXPECT_EQ(logic->cursor.row, 0);
+    EXPECT_EQ(text(0, 8), L"ABlinkCD");
+
+    // Controls are executed in the middle of CSI; CAN cancels the sequence.
+    send(*logic, "\033[\r1CX\033[5\030F");
+    EXPECT_EQ(text(0, 4), L"AXFi");
+    EXPECT_EQ(logic->cursor.row, 0);
+}
+
+// Test bracketed paste mode, as set by the application
+TEST(AnsiLogic, BracketedPasteMode)
+{
+    AnsiLogic logic(80, 24);
+    EXPECT_FALSE(logic.is_bracketed_paste());
+    send(logic, "\033[?2004h\033[?2004$p");
+    EXPECT_TRUE(logic.is_bracketed_paste());
+    EXPECT_EQ(logic.get_reply(), "\033[?2004;1$y");
+    send(logic, "\033[?2004l");
+    EXPECT_FALSE(logic.is_bracketed_paste());
+    send(logic, "\033[?2004h\033c");
+    EXPECT_FALSE(logic.is_bracketed_paste());
+}
+
+// Test sequences of keys with modifiers and in application modes
+TEST(AnsiLogic, KeySequences)
+{
+    AnsiLogic logic(80, 24);
+    std::string out = "x";
+    logic.process_key(KeyInput(KeyCode::UP), out);
+    logic.process_key(KeyInput(KeyCode::UP, false, true), out); // Ctrl+Up
+    logic.process_key(KeyInput(KeyCode::PAGEUP, false, false, true), out); // Alt+PageUp
+    logic.process_key(KeyInput(KeyCode::F1), out);
+    logic.process_key(KeyInput(KeyCode::F1, true), out); // Shift+F1
+    logic.process_key(KeyInput(KeyCode::F5), out);
+    logic.process_key(KeyInput(KeyCode::TAB, true), out); // Back tab
+    logic.process_key(KeyInput('x', false, false, true), out); // Alt+X
+    EXPECT_EQ(out, "x\033[A\033[1;5A\033[5;3~\033OP\033[1;2P\033[15~\033[Z\033x");
+
+    // Cursor keys and keypad Enter in application modes.
+    send(logic, "\033[?1h\033=");
+    EXPECT_EQ(logic.process_key(KeyInput(KeyCode::LEFT)), "\033OD");
+    EXPECT_EQ(logic.process_key(KeyInput(KeyCode::LEFT, true)), "\033[1;2D");
+    EXPECT_EQ(logic.process_key(KeyInput(KeyCode::ENTER)), "\033OM");
+    send(logic, "\033[?1$p");
+    EXPECT_EQ(logic.get_reply(), "\033[?1;1$y");
+    send(logic, "\033[?1l\033>");
+    EXPECT_EQ(logic.process_key(KeyInput(KeyCode::LEFT)), "\033[D");
+    EXPECT_EQ(logic.process_key(KeyInput(KeyCode::ENTER)), "\r");
+}
+
+// Test wide characters: two cells, wrap when only one is left, overwrite of halves
+TEST_F(AnsiLogicTest, WideCharacters)
+{
+    send(*logic, "a\xE4\xB8\xAD" "b"); // a中b
+    EXPECT_EQ(logic->row(0)[1].ch, 0x4E2D);
+    EXPECT_TRUE(logic->row(0)[2].is_spacer());
+    EXPECT_EQ(logic->row(0)[3].ch, L'b');
+    EXPECT_EQ(logic->cursor.col, 4);
+
+    // Overwrite the right half: the left one is blanked.
+    send(*logic, "\033[1;3Hx");
+    EXPECT_EQ(logic->row(0)[1].ch, L' ');
+    EXPECT_EQ(logic->row(0)[2].ch, L'x');
+
+    // No room in the last column: the character goes to the next row.
+    logic->cursor = { 2, logic->get_cols() - 1 };
+    send(*logic, "\xE4\xB8\xAD");
+    EXPECT_EQ(logic->row(2)[logic->get_cols() - 1].ch, L' ');
+    EXPECT_TRUE(logic->is_wrapped(2));
+    EXPECT_EQ(logic->row(3)[0].ch, 0x4E2D);
+    EXPECT_TRUE(logic->row(3)[1].is_spacer());
+    EXPECT_EQ(logic->cursor.row, 3);
+    EXPECT_EQ(logic->cursor.col, 2);
+
+    // Erase of the left half blanks the right one.
+    send(*logic, "\033[4;1H\033[1K");
+    EXPECT_EQ(logic->row(3)[1].ch, L' ');
+
+    // Resize does not split wide characters.
+    AnsiLogic narrow(8, 4);
+    send(narrow, "abc\xE4\xB8\xAD");
+    narrow.resize(4, 4);
+    EXPECT_EQ(narrow.get_row(0)[3].ch, L' ');
+    EXPECT_TRUE(narrow.is_wrapped(0));
+    EXPECT_EQ(narrow.get_row(1)[0].ch, 0x4E2D);
+    EXPECT_TRUE(narrow.get_row(1)[1].is_spacer());
+    EXPECT_EQ(narrow.get_cursor().row, 1);
+    EXPECT_EQ(narrow.get_cursor().col, 2);
+}
+
+// Test combining marks: stored with the base character, once per combination
+TEST_F(AnsiLogicTest, CombiningMarks)
+{
+    send(*logic, "e\xCC\x81" "x\xE4\xB8\xAD\xCC\x88"); // e + acute, x, 中 + diaeresis
+    const Char &accented = logic->row(0)[0];
+    ASSERT_TRUE(accented.is_combined());
+    EXPECT_EQ(std::wstring(logic->get_combined(accented.ch)), L"e\u0301");
+    EXPECT_EQ(logic->row(0)[1].ch, L'x');
+    ASSERT_TRUE(logic->row(0)[2].is_combined());
+    EXPECT_EQ(std::wstring(logic->get_combined(logic->row(0)[2].ch)), L"\u4E2D\u0308");
+    EXPECT_TRUE(logic->row(0)[3].is_spacer());
+    EXPECT_EQ(logic->cursor.col, 4);
+
+    // Same combination refers to the same entry.
+    const size_t size = logic->get_combined_table().size();
+    send(*logic, "e\xCC\x81");
+    EXPECT_EQ(logic->row(0)[4].ch, accented.ch);
+    EXPECT_EQ(logic->get_combined_table().size(), size);
+
+    // Mark after a wrap goes to the last character of the previous row.
+    logic->cursor = { 1, logic->get_cols() - 1 };
+    send(*logic, "o\xCC\x88");
+    EXPECT_EQ(std::wstring(logic->get_combined(logic->row(1)[logic->get_cols() - 1].ch)),
+              L"o\u0308");
+
+    // Marks past the limit are dropped, and marks at the start have nothing to combine with.
+    logic->cursor = { 3, 0 };
+    send(*logic, "\xCC\x81" "a");
+    for (int i = 0; i < AnsiLogic::MAX_COMBINING_MARKS + 2; ++i) {
+        send(*logic, "\xCC\x81");
+    }
+    ASSERT_TRUE(logic->row(3)[0].is_combined());
+    EXPECT_EQ(logic->get_combined(logic->row(3)[0].ch)[0], L'a');
+    EXPECT_EQ(wcslen(logic->get_combined(logic->row(3)[0].ch)),
+              size_t(AnsiLogic::MAX_COMBINING_MARKS + 1));
+}
+
+// Test that history keeps text of combined characters, so that entries
+// gone from the screens are removed when the table is full
+TEST_F(AnsiLogicTest, CombinedTableCompaction)
+{
+    send(*logic, "e\xCC\x81");
+    for (int i = 0; i < 24; ++i) {
+        send(*logic, "\n");
+    }
+
+    // Ideographs with one of 16 marks: more combinations than fit in the table.
+    auto put = [&](wchar_t base, wchar_t mark) {
+        const char text[] = { char(0xE0 | (base >> 12)), char(0x80 | ((base >> 6) & 0x3F)),
+                              char(0x80 | (base & 0x3F)), char(0xC0 | (mark >> 6)),
+                              char(0x80 | (mark & 0x3F)) };
+        logic->process_input(text, sizeof(text));
+    };
+    ScreenSnapshot snap;
+    const int count = 30001;
+    for (int i = 0; i < count; ++i) {
+        put(0x4E00 + i / 16, 0x300 + i % 16);
+        if (i % 1000 == 0) {
+            logic->take_snapshot(snap);
+            ASSERT_EQ(snap.combined, logic->get_combined_table());
+        }
+    }
+    EXPECT_LE(logic->get_combined_table().size(), AnsiLogic::MAX_COMBINED_TEXT);
+    const Char &last = logic->row(logic->cursor.row)[logic->cursor.col - 2];
+    ASSERT_TRUE(last.is_combined());
+    const wchar_t expected[] = { wchar_t(0x4E00 + (count - 1) / 16),
+                                 wchar_t(0x300 + (count - 1) % 16), 0 };
+    EXPECT_EQ(std::wstring(logic->get_combined(last.ch)), expected);
+    logic->take_snapshot(snap);
+    EXPECT_EQ(snap.combined, logic->get_combined_table());
+
+    // Lines in history have own copies, found by the base character.
+    const Scrollback &history = logic->get_scrollback();
+    std::vector<wchar_t> text(80);
+    std::vector<CharAttr> attrs(80);
+    std::vector<wchar_t> combined;
+    history.read_line(history.begin(), text.data(), attrs.data(), 80, &combined);
+    ASSERT_GE(text[0], Char::COMBINED);
+    EXPECT_EQ(std::wstring(&combined[text[0] - Char::COMBINED]), L"e\u0301");
+    uint64_t line;
+    int col;
+    ASSERT_TRUE(history.search(L"\u4E00", history.begin(), false, line, col));
+    EXPECT_EQ(col, 0);
+    history.read_line(line, text.data(), attrs.data(), 80, &combined);
+    ASSERT_GE(text[2], Char::COMBINED);
+    EXPECT_EQ(std::wstring(&combined[text[2] - Char::COMBINED]), L"\u4E00\u0301");
+    history.read_line(line, text.data(), attrs.data(), 80);
+    EXPECT_EQ(text[2], L'\u4E00');
+
+    // Reset clears the screen: nothing is left in the table.
+    send(*logic, "\033c");
+    EXPECT_TRUE(logic->get_combined_table().empty());
+}
+
+// Test width table on characters of different classes
+TEST(CharWidth, Table)
+{
+    EXPECT_EQ(char_width('a'), 1);
+    EXPECT_EQ(char_width(0x00E9), 1); // é
+    EXPECT_EQ(char_width(0x0301), 0); // Combining acute accent
+    EXPECT_EQ(char_width(0x200D), 0); // Zero width joiner
+    EXPECT_EQ(char_width(0x1100), 2); // Hangul choseong
+    EXPECT_EQ(char_width(0x1160), 0); // Hangul jungseong
+    EXPECT_EQ(char_width(0x4E2D), 2); // 中
+    EXPECT_EQ(char_width(0xFF21), 2); // Fullwidth A
+    EXPECT_EQ(char_width(0x1F600), 2); // 😀
+    EXPECT_EQ(char_width(0x2A6D6), 2); // CJK extension B
+    EXPECT_EQ(char_width(0x10FFFF), 1);
+}
+
+// Test snapshot of scrolled screen
+TEST_F(AnsiLogicTest, Snapshot)
+{
+    send(*logic, "\033[31mtop");
+    for (int i = 0; i < 30; ++i) {
+        send(*logic, "\nline");
+    }
+    ASSERT_NE(logic->buffer_index(0), 0);
+
+    ScreenSnapshot snap;
+    logic->take_snapshot(snap);
+    EXPECT_EQ(snap.cols, 80);
+    EXPECT_EQ(snap.rows, 24);
+    EXPECT_EQ(snap.scroll_count, 30u - 23u);
+    EXPECT_EQ(snap.cursor.row, logic->cursor.row);
+    EXPECT_EQ(snap.cursor.col, logic->cursor.col);
+    ASSERT_EQ(snap.cells.size(), size_t(80 * 24));
+    for (int r = 0; r < 24; ++r) {
+        for (int c = 0; c < 80; ++c) {
+            EXPECT_EQ(snap.cells[r * 80 + c], logic->get_row(r)[c]);
+        }
+    }
+    const Char &cell = snap.cells[23 * 80];
+    EXPECT_EQ(cell.ch, L'l');
+    EXPECT_EQ(snap.attrs[cell.attr].fg, (RgbColor{ 192, 0, 0 }));
+}
+
+// Test that lines scrolled off the screen go to history
+TEST_F(AnsiLogicTest, ScrollbackReceivesLines)
+{
+    send(*logic, "\033[32mfirst\033[0m");
+    for (int i = 0; i < 24; ++i) {
+        send(*logic, "\nline");
+    }
+    const Scrollback &history = logic->get_scrollback();
+    ASSERT_EQ(history.end() - history.begin(), 1u);
+
+    std::vector<wchar_t> text(80);
+    std::vector<CharAttr> attrs(80);
+    history.read_line(history.begin(), text.data(), attrs.data(), 80);
+    EXPECT_EQ(std::wstring(text.data(), 5), L"first");
+    EXPECT_EQ(text[5], L' ');
+    EXPECT_EQ(attrs[0].fg, logic->normal_colors[2]);
+    EXPECT_EQ(attrs[5], CharAttr());
+}
+
+// Test UTF-8 sequences split between calls of process_input()
+TEST_F(AnsiLogicTest, Utf8SplitAcrossCalls)
+{
+    const char input[] = "\xD0\xAF\xE2\x82\xAC\xF0\x9F\x98\x80";
+    logic->cursor      = { 5, 10 };
+    for (size_t i = 0; i < sizeof(input) - 1; ++i) {
+        logic->process_input(&input[i], 1);
+    }
+    EXPECT_EQ(logic->row(5)[10].ch, 0x042F);  // Я
+    EXPECT_EQ(logic->row(5)[11].ch, 0x20AC);  // €
+    EXPECT_EQ(logic->row(5)[12].ch, 0x1F600); // 😀, wide
+    EXPECT_TRUE(logic->row(5)[13].is_spacer());
+    EXPECT_EQ(logic->cursor.col, 14);
+}
+
+// Test replacement of invalid UTF-8 sequences
+TEST_F(AnsiLogicTest, Utf8Invalid)
+{
+    // Stray continuation byte, overlong encoding, surrogate,
+    // and a sequence interrupted by ASCII.
+    const char input[] = "\x80|\xC0\xAF|\xED\xA0\x80|\xE2\x82x";
+    logic->process_input(input, sizeof(input) - 1);
+
+    std::wstring text;
+    for (int c = 0; c < logic->cursor.col; ++c) {
+        text += logic->row(0)[c].ch;
+    }
+    EXPECT_EQ(text, L"\uFFFD|\uFFFD\uFFFD|\uFFFD\uFFFD\uFFFD|\uFFFDx");
+    EXPECT_EQ(logic->utf8_state, AnsiLogic::UTF8_ACCEPT);
+}
+
+// Test decoding of every valid code point
+// Test that consumer of triple buffer sees published values in order, skipping some
+TEST(TripleBuffer, Handoff)
+{
+    TripleBuffer<int> buffer;
+    EXPECT_FALSE(buffer.acquire());
+    buffer.back() = 1;
+    buffer.publish();
+    buffer.back() = 2;
+    buffer.publish();
+    EXPECT_TRUE(buffer.acquire());
+    EXPECT_EQ(buffer.front(), 2);
+    EXPECT_FALSE(buffer.acquire());
+    EXPECT_EQ(buffer.front(), 2);
+
+    const int count = 100000;
+    std::thread producer([&buffer] {
+        for (int i = 3; i <= count; ++i) {
+            buffer.back() = i;
+            buffer.publish();
+        }
+    });
+    int last = 2;
+    while (last < count) {
+        if (buffer.acquire()) {
+            ASSERT_GT(buffer.front(), last);
+            last = buffer.front();
+        }
+    }
+    producer.join();
+}
+
+// Make a line with text and alternating attributes
+static std::vector<Char> make_line(const std::wstring &text)
+{
+    std::vector<Char> line(text.size());
+    for (size_t i = 0; i < text.size(); ++i) {
+        line[i] = { text[i], uint16_t(i / 3 % 2) };
+    }
+    return line;
+}
+
+// Test storing and reading back lines of history
+TEST(Scrollback, RoundTrip)
+{
+    const CharAttr attrs[2] = { CharAttr(), { { 255, 0, 0 }, { 0, 0, 255 } } };
+    Scrollback history;
+
+    // Enough lines to fill several chunks, which are compressed.
+    const int count = 20000;
+    for (int i = 0; i < count; ++i) {
+        std::wstring text = L"line " + std::to_wstring(i) + L" \u00e9\U0001F600";
+        history.push_line(make_line(text).data(), text.size(), attrs);
+    }
+    EXPECT_EQ(history.begin(), 0u);
+    EXPECT_EQ(history.end(), uint64_t(count));
+
+    // Chunks are found by search before and after the packer is done with them.
+    uint64_t found_line = 0;
+    int found_col       = -1;
+    EXPECT_TRUE(history.search(L"line 4567 ", count - 1, true, found_line, found_col));
+    EXPECT_EQ(found_line, 4567u);
+    history.finish_packing();
+    EXPECT_LT(history.get_memory_usage(), count * 16u);
+    EXPECT_TRUE(history.search(L"line 4567 ", count - 1, true, found_line, found_col));
+    EXPECT_EQ(found_line, 4567u);
+    EXPECT_EQ(found_col, 0);
+
+    std::vector<wchar_t> text(40);
+    std::vector<CharAttr> line_attrs(40);
+    for (int i : { 0, 1, 4567, count / 2, count - 2, count - 1, 3 }) {
+        std::wstring expect = L"line " + std::to_wstring(i) + L" \u00e9\U0001F600";
+        history.read_line(i, text.data(), line_attrs.data(), 40);
+        EXPECT_EQ(std::wstring(text.data(), expect.size()), expect);
+        for (size_t col = 0; col < expect.size(); ++col) {
+            EXPECT_EQ(line_attrs[col], attrs[col / 3 % 2]);
+        }
+        EXPECT_EQ(text[expect.size()], L' ');
+        EXPECT_EQ(line_attrs[expect.size()], CharAttr());
+    }
+
+    // Narrower output truncates the line.
+    history.read_line(count - 1, text.data(), line_attrs.data(), 3);
+    EXPECT_EQ(std::wstring(text.data(), 3), L"lin");
+}
+
+// Test that memory limit discards oldest lines
+TEST(Scrollback, MemoryLimit)
+{
+    const CharAttr attrs[2] = { CharAttr(), { { 255, 0, 0 }, { 0, 0, 255 } } };
+    Scrollback history(256 * 1024);
+
+    const int count = 100000;
+    for (int i = 0; i < count; ++i) {
+        std::wstring text = L"line " + std::to_wstring(i * 7919 % 100003);
+        history.push_line(make_line(text).data(), text.size(), attrs);
+        ASSERT_LE(history.get_memory_usage(), 256u * 1024);
+    }
+    EXPECT_GT(history.begin(), 0u);
+    EXPECT_EQ(history.end(), uint64_t(count));
+
+    // Lines which are kept are intact.
+    std::vector<wchar_t> text(20);
+    std::vector<CharAttr> line_attrs(20);
+    uint64_t index      = history.begin();
+    std::wstring expect = L"line " + std::to_wstring(index * 7919 % 100003);
+    history.read_line(index, text.data(), line_attrs.data(), 20);
+    EXPECT_EQ(std::wstring(text.data(), expect.size()), expect);
+
+    // Discarded lines read as blanks.
+    history.read_line(0, text.data(), line_attrs.data(), 20);
+    EXPECT_EQ(std::wstring(text.data(), 4), L"    ");
+
+    // Zero limit drops everything.
+    history.set_limit(0);
+    EXPECT_EQ(history.begin(), history.end());
+    EXPECT_EQ(history.get_memory_usage(), 0u);
+}
+
+// Test that with spill file no lines are lost, while memory stays limited
+TEST(Scrollback, Spill)
+{
+    const CharAttr attrs[2] = { CharAttr(), { { 255, 0, 0 }, { 0, 0, 255 } } };
+    Scrollback history(128 * 1024);
+    ASSERT_TRUE(history.enable_spill(testing::TempDir()));
+
+    const int count = 200000;
+    for (int i = 0; i < count; ++i) {
+        std::wstring text = L"line " + std::to_wstring(i * 7919 % 100003);
+        history.push_line(make_line(text).data(), text.size(), attrs);
+        ASSERT_LE(history.get_memory_usage(), 128u * 1024);
+    }
+    EXPECT_EQ(history.begin(), 0u);
+    EXPECT_EQ(history.end(), uint64_t(count));
+
+    std::vector<wchar_t> text(20);
+    std::vector<CharAttr> line_attrs(20);
+    for (int i : { 0, 1, 12345, count / 2, count - 1, 2 }) {
+        std::wstring expect = L"line " + std::to_wstring(i * 7919 % 100003);
+        history.read_line(i, text.data(), line_attrs.data(), 20);
+        EXPECT_EQ(std::wstring(text.data(), expect.size()), expect);
+        for (size_t col = 0; col < expect.size(); ++col) {
+            EXPECT_EQ(line_attrs[col], attrs[col / 3 % 2]);
+        }
+    }
+}
+
+// Test that wrapped lines are joined and split again at new width
+TEST(Scrollback, Rewrap)
+{
+    const CharAttr attrs[2] = { CharAttr(), { { 255, 0, 0 }, { 0, 0, 255 } } };
+    Scrollback history;
+
+    // Logical lines of 30 characters, stored as three rows of 10.
+    const int count = 30000;
+    for (int i = 0; i < count; ++i) {
+        std::wstring text = std::to_wstring(1000000 + i) + L" abcdefghijklmnopqrstuv";
+        for (int piece = 0; piece < 3; ++piece) {
+            history.push_line(make_line(text.substr(piece * 10, 10)).data(), 10, attrs,
+                              piece < 2);
+        }
+    }
+    history.rewrap(10);
+    ASSERT_EQ(history.end(), uint64_t(count * 3));
+
+    history.rewrap(40);
+    ASSERT_EQ(history.end(), uint64_t(count));
+    std::vector<wchar_t> text(40);
+    std::vector<CharAttr> line_attrs(40);
+    for (int i : { 0, 1, count / 2, count - 1 }) {
+        std::wstring expect = std::to_wstring(1000000 + i) + L" abcdefghijklmnopqrstuv";
+        EXPECT_FALSE(history.read_line(i, text.data(), line_attrs.data(), 40));
+        EXPECT_EQ(std::wstring(text.data(), 31), expect + L" ");
+        EXPECT_EQ(line_attrs[12], attrs[0]); // Attributes restart in each piece
+        EXPECT_EQ(line_attrs[13], attrs[1]);
+    }
+
+    history.rewrap(16);
+    ASSERT_EQ(history.end(), uint64_t(count * 2));
+    EXPECT_TRUE(history.read_line(2, text.data(), line_attrs.data(), 16));
+    EXPECT_EQ(std::wstring(text.data(), 16), L"1000001 abcdefgh");
+    EXPECT_FALSE(history.read_line(3, text.data(), line_attrs.data(), 16));
+    EXPECT_EQ(std::wstring(text.data(), 15), L"ijklmnopqrstuv ");
+}
+
+// Test search of text in history, both in memory and in spill file
+TEST(Scrollback, Search)
+{
+    const CharAttr attrs[2] = { CharAttr(), { { 255, 0, 0 }, { 0, 0, 255 } } };
+    Scrollback history(128 * 1024);
+    ASSERT_TRUE(history.enable_spill(testing::TempDir()));
+
+    const int count = 100000;
+    for (int i = 0; i < count; ++i) {
+        std::wstring text = L"line " + std::to_wstring(i);
+        if (i == 100 || i == 50000 || i == count - 10) {
+            text += L" needle";
+        }
+        history.push_line(make_line(text).data(), text.size(), attrs);
+    }
+
+    uint64_t line;
+    int col;
+    ASSERT_TRUE(history.search(L"needle", history.end(), true, line, col));
+    EXPECT_EQ(line, uint64_t(count - 10));
+    EXPECT_EQ(col, 11);
+    ASSERT_TRUE(history.search(L"needle", line - 1, true, line, col));
+    EXPECT_EQ(line, 50000u);
+    ASSERT_TRUE(history.search(L"needle", line - 1, true, line, col));
+    EXPECT_EQ(line, 100u);
+    EXPECT_EQ(col, 9);
+    EXPECT_FALSE(history.search(L"needle", line - 1, true, line, col));
+
+    ASSERT_TRUE(history.search(L"needle", 101, false, line, col));
+    EXPECT_EQ(line, 50000u);
+    ASSERT_TRUE(history.search(L"line 7", 0, false, line, col));
+    EXPECT_EQ(line, 7u);
+    EXPECT_EQ(col, 0);
+
+    // Short text can't use the filter, but is still found.
+    ASSERT_TRUE(history.search(L"99", 0, false, line, col));
+    EXPECT_EQ(line, 99u);
+    EXPECT_FALSE(history.search(L"haystack", 0, false, line, col));
+
+    EXPECT_EQ(Scrollback::find_text(L"abcabd", 6, L"abd"), 3);
+    EXPECT_EQ(Scrollback::find_text(L"abcabd", 5, L"abd"), -1);
+}
+
+TEST(AnsiLogic, Utf8AllCodePoints)
+{
+    AnsiLogic logic(64, 2);
+    for (uint32_t code = 0xA0; code <= 0x10FFFF; ++code) {
+        if (code >= 0xD800 && code <= 0xDFFF) {
+            continue; // Surrogates are not valid
+        }
+        char utf8[4];
+        size_t length;
+        if (code < 0x800) {
+            utf8[0] = 0xC0 | (code >> 6);
+            utf8[1] = 0x80 | (code & 0x3F);
+            length  = 2;
+        } else if (code < 0x10000) {
+            utf8[0] = 0xE0 | (code >> 12);
+            utf8[1] = 0x80 | ((code >> 6) & 0x3F);
+            utf8[2] = 0x80 | (code & 0x3F);
+            length  = 3;
+        } else {
+            utf8[0] = 0xF0 | (code >> 18);
+            utf8[1] = 0x80 | ((code >> 12) & 0x3F);
+            utf8[2] = 0x80 | ((code >> 6) & 0x3F);
+            utf8[3] = 0x80 | (code & 0x3F);
+            length  = 4;
+        }
+        logic.process_input("\rx", 2);
+        logic.process_input(utf8, length);
+        const int width = char_width(code);
+        ASSERT_EQ(logic.get_cursor().col, 1 + width);
+        if (width == 0) {
+            // Combining mark goes to the previous character.
+            const Char &cell = logic.get_row(0)[0];
+            ASSERT_TRUE(cell.is_combined());
+            const wchar_t expected[] = { L'x', wchar_t(code), 0 };
+            ASSERT_EQ(std::wstring(logic.get_combined(cell.ch)), expected);
+        } else {
+            ASSERT_EQ(uint32_t(logic.get_row(0)[1].ch), code);
+        }
+    }
+}
+
+// Test that splitting input into single bytes gives the same screen
+TEST(AnsiLogic, ChunkingDoesNotMatter)
+{
+    std::string input;
+    for (int n = 0; n < 40; ++n) {
+        input += "line " + std::to_string(n) + " \033[31mred\033[0m \xD0\xAF\xE2\x82\xAC ";
+        input += std::string(n * 3, 'a' + n % 26) + "\x7f\b|\r\n";
+    }
+
+    AnsiLogic whole(80, 24), bytes(80, 24);
+    whole.process_input(input.data(), input.size());
+    for (char c : input) {
+        bytes.process_input(&c, 1);
+    }
+
+    for (int r = 0; r < 24; ++r) {
+        for (int c = 0; c < 80; ++c) {
+            EXPECT_EQ(whole.get_row(r)[c].ch, bytes.get_row(r)[c].ch);
+            EXPECT_EQ(whole.get_row(r)[c].attr, bytes.get_row(r)[c].attr);
+        }
+    }
+    EXPECT_EQ(whole.get_cursor().row, bytes.get_cursor().row);
+    EXPECT_EQ(whole.get_cursor().col, bytes.get_cursor().col);
+}
+
+// Test that recorded output and resizes are read back in order, and replay the same screen
+TEST(Recording, RoundTrip)
+{
+    const std::string path = testing::TempDir() + "recording_test.rec";
+    std::string big;
+    for (int n = 0; n < 5000; ++n) {
+        big += "line " + std::to_string(n) + "\r\n";
+    }
+    {
+        Recorder recorder;
+        ASSERT_TRUE(recorder.open(path, 80, 24));
+        recorder.write_output("hello", 5);
+        recorder.write_resize(100, 30);
+        recorder.write_output(big.data(), big.size());
+        recorder.close();
+        EXPECT_FALSE(recorder.has_failed());
+    }
+
+    RecordingReader reader;
+    ASSERT_TRUE(reader.open(path));
+    EXPECT_EQ(reader.get_cols(), 80);
+    EXPECT_EQ(reader.get_rows(), 24);
+
+    AnsiLogic logic(reader.get_cols(), reader.get_rows());
+    Record record;
+    std::vector<RecordType> types;
+    uint64_t last_time = 0;
+    while (reader.next(record)) {
+        types.push_back(record.type);
+        EXPECT_GE(record.time_us, last_time);
+        last_time = record.time_us;
+        if (record.type == RecordType::RESIZE) {
+            EXPECT_EQ(record.cols, 100);
+            EXPECT_EQ(record.rows, 30);
+            logic.resize(record.cols, record.rows);
+        } else {
+            logic.process_input(record.data.data(), record.data.size());
+        }
+    }
+    EXPECT_EQ(types, std::vector<RecordType>(
+                         { RecordType::OUTPUT, RecordType::RESIZE, RecordType::OUTPUT }));
+    EXPECT_EQ(record.data, big);
+    EXPECT_EQ(logic.get_cols(), 100);
+    EXPECT_EQ(logic.get_row(28)[0].ch, L'l');
+    EXPECT_EQ(logic.get_row(28)[5].ch, L'4');
+    EXPECT_EQ(logic.get_row(28)[8].ch, L'9');
+
+    RecordingReader bad;
+    EXPECT_FALSE(bad.open(testing::TempDir() + "no_such_recording.rec"));
+    remove(path.c_str());
+}
+
+// Test that a record larger than the queue limit is dropped and counted
+TEST(Recording, QueueOverflow)
+{
+    const std::string path = testing::TempDir() + "recording_overflow.rec";
+    const std::string big(4096, 'x');
+    size_t dropped = 0;
+    {
+        Recorder recorder(1024);
+        ASSERT_TRUE(recorder.open(path, 80, 24));
+        recorder.write_output("hello", 5);
+        recorder.write_output(big.data(), big.size());
+        recorder.write_output("world", 5);
+        recorder.close();
+        EXPECT_TRUE(recorder.has_failed());
+        dropped = recorder.get_dropped_bytes();
+        EXPECT_GE(dropped, big.size() + 5);
+    }
+
+    // Output up to the overflow, then the amount of dropped data.
+    RecordingReader reader;
+    ASSERT_TRUE(reader.open(path));
+    Record record;
+    std::string output;
+    while (reader.next(record) && record.type == RecordType::OUTPUT) {
+        output += record.data;
+    }
+    EXPECT_EQ(output, "hello");
+    EXPECT_EQ(record.type, RecordType::DROPPED);
+    EXPECT_EQ(record.dropped, dropped);
+    EXPECT_FALSE(reader.next(record));
+    remove(path.c_str());
+}
+
+// Test that counts of all threads are summed, and histograms give percentiles
+TEST(Stats, CountersAndHistograms)
+{
+    if (!Stats::ENABLED) {
+        GTEST_SKIP() << "Statistics are not compiled in";
+    }
+    Stats::Snapshot before;
+    Stats::collect(before);
+
+    auto work = [] {
+        for (int i = 1; i <= 100; ++i) {
+            Stats::add(Stats::PTY_BYTES, 10);
+            Stats::record(Stats::BYTES_PER_WAKEUP, i);
+        }
+    };
+    std::thread other(work);
+    work();
+    other.join();
+
+    Stats::Snapshot after;
+    Stats::collect(after);
+    const Stats::Snapshot diff = after - before;
+    EXPECT_EQ(diff.counters[Stats::PTY_BYTES], 2000u);
+    EXPECT_EQ(diff.count(Stats::BYTES_PER_WAKEUP), 200u);
+    EXPECT_EQ(diff.mean(Stats::BYTES_PER_WAKEUP), 50u);
+
+    // Values are in buckets by powers of two: 50 falls into [32, 64).
+    EXPECT_EQ(diff.percentile(Stats::BYTES_PER_WAKEUP, 0.5), 63u);
+    EXPECT_EQ(diff.percentile(Stats::BYTES_PER_WAKEUP, 0.99), 127u);
+    EXPECT_EQ(Stats::bucket(0), 0);
+    EXPECT_EQ(Stats::bucket(1), 1);
+    EXPECT_EQ(Stats::bucket(255), 8);
+    EXPECT_EQ(Stats::bucket(256), 9);
+}
+
+TEST(MemoryPool, ReuseAndBudget)
+{
+    MemoryPool pool(1024 * 1024);
+    std::vector<uint8_t> buf;
+    pool.get(buf, 1000);
+    EXPECT_GE(buf.capacity(), 1000u);
+    const uint8_t *data = buf.data();
+    pool.put(buf);
+    EXPECT_EQ(buf.capacity(), 0u);
+    EXPECT_EQ(pool.get_cached(), 1000u);
+
+    // About the same size: the buffer is given out again.
+    pool.get(buf, 900);
+    EXPECT_EQ(buf.data(), data);
+    EXPECT_EQ(pool.get_cached(), 0u);
+
+    // Too large for the request: kept in the pool.
+    std::vector<uint8_t> small;
+    pool.put(buf);
+    pool.get(small, 100);
+    EXPECT_NE(small.data(), data);
+    EXPECT_EQ(pool.get_cached(), 1000u);
+
+    // Over the budget, free buffers are released.
+    size_t reported = 0;
+    pool.update_usage(reported, 2 * 1024 * 1024);
+    EXPECT_TRUE(pool.over_budget());
+    pool.put(small);
+    EXPECT_EQ(pool.get_cached(), 1000u);
+    pool.set_budget(512 * 1024);
+    EXPECT_EQ(pool.get_cached(), 0u);
+    pool.update_usage(reported, 0);
+    EXPECT_EQ(pool.get_usage(), 0u);
+
+    // Screen of a closed session goes to the next one.
+    MemoryPool sessions;
+    const Char *cells;
+    {
+        AnsiLogic first(80, 24, sessions);
+        cells = first.get_cells(0).data();
+        EXPECT_GE(sessions.get_usage(), 80 * 24 * sizeof(Char));
+        EXPECT_EQ(sessions.get_cached(), 0u);
+    }
+    EXPECT_EQ(sessions.get_usage(), 0u);
+    EXPECT_GE(sessions.get_cached(), 80 * 24 * sizeof(Char));
+    AnsiLogic second(80, 24, sessions);
+    EXPECT_EQ(second.get_cells(0).data(), cells);
 }
 
 int main(int argc, char **argv)